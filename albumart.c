@@ -29,6 +29,7 @@
 #include <libgen.h>
 #include <setjmp.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <jpeglib.h>
 
@@ -39,6 +40,11 @@
 #include "image_utils.h"
 #include "log.h"
 
+/* check_embedded_art() remembers the last image it saw, for every
+ * scanner thread.  Images are decoded and resized without the lock. */
+static pthread_mutex_t art_lock = PTHREAD_MUTEX_INITIALIZER;
+static int art_tmp = 0;
+
 static int
 art_cache_exists(const char *orig_path, char **cache_file)
 {
@@ -50,12 +56,25 @@ art_cache_exists(const char *orig_path, char **cache_file)
 	return (!access(*cache_file, F_OK));
 }
 
+/* A name to write cache_file under before renaming it into place, so
+ * that another thread never finds it half written */
+static char *
+art_cache_tmp(const char *cache_file)
+{
+	char *tmp;
+
+	if( xasprintf(&tmp, "%s.%d.tmp", cache_file, __sync_fetch_and_add(&art_tmp, 1)) < 0 )
+		return NULL;
+
+	return tmp;
+}
+
 static char *
 save_resized_album_art(image_s *imsrc, const char *path)
 {
 	int dstw, dsth;
 	image_s *imdst;
-	char *cache_file;
+	char *cache_file, *tmp;
 	char cache_dir[MAXPATHLEN];
 
 	if( !imsrc )
@@ -78,15 +97,19 @@ save_resized_album_art(image_s *imsrc, const char *path)
 		dsth = 160;
 	}
 	imdst = image_resize(imsrc, dstw, dsth);
-	if( !imdst )
+	tmp = imdst ? art_cache_tmp(cache_file) : NULL;
+	if( !tmp || !image_save_to_jpeg_file(imdst, tmp) || rename(tmp, cache_file) != 0 )
 	{
+		if( tmp )
+			remove(tmp);
+		free(tmp);
 		free(cache_file);
-		return NULL;
+		cache_file = NULL;
 	}
-
-	cache_file = image_save_to_jpeg_file(imdst, cache_file);
+	else
+		free(tmp);
 	image_free(imdst);
-	
+
 	return cache_file;
 }
 
@@ -163,7 +186,7 @@ check_embedded_art(const char *path, uint8_t *image_data, int image_size)
 {
 	int width = 0, height = 0;
 	char *art_path = NULL;
-	char *cache_dir;
+	char *cache_dir, *tmp;
 	FILE *dstfile;
 	image_s *imsrc;
 	static char last_path[PATH_MAX];
@@ -178,13 +201,18 @@ check_embedded_art(const char *path, uint8_t *image_data, int image_size)
 	/* If the embedded image matches the embedded image from the last file we
 	 * checked, just make a hard link.  Better than storing it on the disk twice. */
 	hash = DJBHash(image_data, image_size);
+	pthread_mutex_lock(&art_lock);
 	if( hash == last_hash )
 	{
 		if( !last_success )
+		{
+			pthread_mutex_unlock(&art_lock);
 			return NULL;
+		}
 		art_cache_exists(path, &art_path);
 		if( link(last_path, art_path) == 0 )
 		{
+			pthread_mutex_unlock(&art_lock);
 			return(art_path);
 		}
 		else
@@ -195,19 +223,25 @@ check_embedded_art(const char *path, uint8_t *image_data, int image_size)
 				make_dir(dirname(cache_dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
 				free(cache_dir);
 				if( link(last_path, art_path) == 0 )
+				{
+					pthread_mutex_unlock(&art_lock);
 					return(art_path);
+				}
 			}
 			DPRINTF(E_WARN, L_METADATA, "Linking %s to %s failed [%s]\n", art_path, last_path, strerror(errno));
 			free(art_path);
 			art_path = NULL;
 		}
 	}
-	last_hash = hash;
+	pthread_mutex_unlock(&art_lock);
 
 	imsrc = image_new_from_jpeg(NULL, 0, image_data, image_size, 1, ROTATE_NONE);
 	if( !imsrc )
 	{
+		pthread_mutex_lock(&art_lock);
+		last_hash = hash;
 		last_success = 0;
+		pthread_mutex_unlock(&art_lock);
 		return NULL;
 	}
 	width = imsrc->width;
@@ -225,36 +259,43 @@ check_embedded_art(const char *path, uint8_t *image_data, int image_size)
 		cache_dir = strdup(art_path);
 		make_dir(dirname(cache_dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
 		free(cache_dir);
-		dstfile = fopen(art_path, "w");
+		tmp = art_cache_tmp(art_path);
+		dstfile = tmp ? fopen(tmp, "w") : NULL;
 		if( !dstfile )
 		{
+			free(tmp);
 			free(art_path);
 			art_path = NULL;
 			goto end_art;
 		}
 		nwritten = fwrite((void *)image_data, 1, image_size, dstfile);
 		fclose(dstfile);
-		if( nwritten != image_size )
+		if( nwritten != image_size || rename(tmp, art_path) != 0 )
 		{
 			DPRINTF(E_WARN, L_METADATA, "Embedded art error: wrote %lu/%d bytes\n",
 				(unsigned long)nwritten, image_size);
-			remove(art_path);
+			remove(tmp);
+			free(tmp);
 			free(art_path);
 			art_path = NULL;
 			goto end_art;
 		}
+		free(tmp);
 	}
 end_art:
 	image_free(imsrc);
+	pthread_mutex_lock(&art_lock);
+	last_hash = hash;
+	last_success = (art_path != NULL);
+	if( art_path )
+		strcpy(last_path, art_path);
+	pthread_mutex_unlock(&art_lock);
 	if( !art_path )
 	{
 		DPRINTF(E_WARN, L_METADATA, "Invalid embedded album art in %s\n", basename((char *)path));
-		last_success = 0;
 		return NULL;
 	}
 	DPRINTF(E_DEBUG, L_METADATA, "Found new embedded album art in %s\n", basename((char *)path));
-	last_success = 1;
-	strcpy(last_path, art_path);
 
 	return(art_path);
 }
@@ -345,23 +386,121 @@ found_file:
 	return NULL;
 }
 
+/* Work out which image, if any, is the album art for path.  This doesn't
+ * touch the database, so it may be called from the scanner's worker
+ * threads; the caller frees the result. */
+char *
+album_art_path(const char *path, uint8_t *image_data, int image_size)
+{
+	char *album_art = NULL;
+
+	if( !image_size || !(album_art = check_embedded_art(path, image_data, image_size)) )
+		album_art = check_for_album_file(path);
+
+	return album_art;
+}
+
+int64_t
+album_art_id(const char *album_art)
+{
+	int64_t ret;
+
+	if( !album_art )
+		return 0;
+	ret = sql_get_int_field(db, "SELECT ID from ALBUM_ART where PATH = '%q'", album_art);
+	if( !ret )
+	{
+		if( sql_exec(db, "INSERT into ALBUM_ART (PATH) VALUES ('%q')", album_art) == SQLITE_OK )
+			ret = sqlite3_last_insert_rowid(db);
+	}
+
+	return ret;
+}
+
 int64_t
 find_album_art(const char *path, uint8_t *image_data, int image_size)
 {
-	char *album_art = NULL;
-	int64_t ret = 0;
+	char *album_art;
+	int64_t ret;
+
+	album_art = album_art_path(path, image_data, image_size);
+	ret = album_art_id(album_art);
+	free(album_art);
 
-	if( (image_size && (album_art = check_embedded_art(path, image_data, image_size))) ||
-	    (album_art = check_for_album_file(path)) )
+	return ret;
+}
+
+/* List the files under path into stmt, or with no stmt, remove the
+ * directories under it that are left empty */
+static void
+art_cache_walk(char *path, size_t size, sqlite3_stmt *stmt)
+{
+	DIR *dh;
+	struct dirent *dp;
+	struct stat st;
+	size_t len = strlen(path);
+
+	dh = opendir(path);
+	if( !dh )
+		return;
+	while( (dp = readdir(dh)) != NULL )
 	{
-		ret = sql_get_int_field(db, "SELECT ID from ALBUM_ART where PATH = '%q'", album_art);
-		if( !ret )
+		if( strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 )
+			continue;
+		if( snprintf(path + len, size - len, "/%s", dp->d_name) >= size - len )
+			continue;
+		if( lstat(path, &st) != 0 )
+			continue;
+		if( S_ISDIR(st.st_mode) )
+		{
+			art_cache_walk(path, size, stmt);
+			if( !stmt )
+				rmdir(path);
+		}
+		else if( stmt && sql_bind(stmt, "s", path) == SQLITE_OK )
 		{
-			if( sql_exec(db, "INSERT into ALBUM_ART (PATH) VALUES ('%q')", album_art) == SQLITE_OK )
-				ret = sqlite3_last_insert_rowid(db);
+			sql_step(stmt);
+			sqlite3_reset(stmt);
 		}
 	}
-	free(album_art);
+	closedir(dh);
+	path[len] = '\0';
+}
 
-	return ret;
+/* Remove the art extracted for files that are no longer in the library,
+ * which a complete scan has just found out */
+void
+prune_art_cache(void)
+{
+	char path[PATH_MAX];
+	sqlite3_stmt *stmt;
+	int n = 0;
+
+	if( sql_exec(db, "CREATE TEMP TABLE ART_FILES (PATH TEXT)") != SQLITE_OK )
+		return;
+	stmt = sql_prepare(db, "INSERT into temp.ART_FILES values (?)");
+	if( stmt )
+	{
+		snprintf(path, sizeof(path), "%s/art_cache", db_path);
+		sql_exec(db, "BEGIN");
+		art_cache_walk(path, sizeof(path), stmt);
+		sql_exec(db, "COMMIT");
+		sql_release(stmt);
+	}
+	stmt = sql_prepare(db, "SELECT PATH from temp.ART_FILES where PATH not in (SELECT PATH from ALBUM_ART)");
+	if( stmt )
+	{
+		while( sql_step(stmt) == SQLITE_ROW )
+		{
+			if( unlink((const char *)sqlite3_column_text(stmt, 0)) == 0 )
+				n++;
+		}
+		sql_release(stmt);
+	}
+	sql_exec(db, "DROP TABLE temp.ART_FILES");
+	if( n )
+	{
+		art_cache_walk(path, sizeof(path), NULL);
+		DPRINTF(E_INFO, L_SCANNER, "Removed %d unused images from the art cache\n", n);
+	}
 }
@@ -25,6 +25,9 @@
 #define __ALBUMART_H__
 
 void update_if_album_art(const char *path);
+char *album_art_path(const char *path, uint8_t *image_data, int image_size);
+int64_t album_art_id(const char *album_art);
 int64_t find_album_art(const char *path, uint8_t *image_data, int image_size);
+void prune_art_cache(void);
 
 #endif
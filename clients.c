@@ -16,8 +16,10 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "clients.h"
 #include "getifaddr.h"
@@ -266,6 +268,9 @@ struct client_type_s client_types[] =
 
 struct client_cache_s clients[CLIENT_CACHE_SLOTS];
 
+/* passwords are read and replaced by the SOAP worker threads */
+static pthread_mutex_t password_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct client_cache_s *
 SearchClientCache(struct in_addr addr, int quiet)
 {
@@ -288,10 +293,10 @@ SearchClientCache(struct in_addr addr, int quiet)
 				}
 				else
 				{
-					if (clients[i].password != NULL) {
-					    free(clients[i].password);
-					}
+					pthread_mutex_lock(&password_lock);
+					free(clients[i].password);
 					memset(&clients[i], 0, sizeof(struct client_cache_s));
+					pthread_mutex_unlock(&password_lock);
 					return NULL;
 				}
 			}
@@ -329,3 +334,27 @@ AddClientCache(struct in_addr addr, int type)
 	return NULL;
 }
 
+/* Returns a copy of the client's password list, to be freed by the caller */
+char *
+GetClientPassword(struct client_cache_s *client)
+{
+	char *password = NULL;
+
+	pthread_mutex_lock(&password_lock);
+	if (client->password)
+		password = strdup(client->password);
+	pthread_mutex_unlock(&password_lock);
+
+	return password;
+}
+
+/* Replaces the client's password list, taking ownership of password */
+void
+SetClientPassword(struct client_cache_s *client, char *password)
+{
+	pthread_mutex_lock(&password_lock);
+	if (client->password != password)
+		free(client->password);
+	client->password = password;
+	pthread_mutex_unlock(&password_lock);
+}
@@ -102,5 +102,7 @@ extern struct client_cache_s clients[CLIENT_CACHE_SLOTS];
 
 struct client_cache_s *SearchClientCache(struct in_addr addr, int quiet);
 struct client_cache_s *AddClientCache(struct in_addr addr, int type);
+char *GetClientPassword(struct client_cache_s *client);
+void SetClientPassword(struct client_cache_s *client, char *password);
 
 #endif
@@ -0,0 +1,128 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#ifdef HAVE_EPOLL
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "event.h"
+#include "log.h"
+
+#define MAX_EVENTS 64
+
+static int epfd = -1;
+
+static int
+epoll_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "epoll_create1(): %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+epoll_fini(void)
+{
+	if (epfd >= 0)
+		close(epfd);
+	epfd = -1;
+}
+
+static int
+epoll_ctl_event(int op, struct event *ev)
+{
+	struct epoll_event ee;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = EPOLLET | (ev->rdwr == EVENT_WRITE ? EPOLLOUT : EPOLLIN);
+	ee.data.ptr = ev;
+
+	if (epoll_ctl(epfd, op, ev->fd, &ee) < 0)
+	{
+		/* Deleting a descriptor that was never added is harmless */
+		if (op == EPOLL_CTL_DEL && errno == ENOENT)
+			return 0;
+		DPRINTF(E_ERROR, L_GENERAL, "epoll_ctl(%d, %d): %s\n",
+			op, ev->fd, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+epoll_add(struct event *ev)
+{
+	ev->index = 0;
+	return epoll_ctl_event(EPOLL_CTL_ADD, ev);
+}
+
+static int
+epoll_mod(struct event *ev)
+{
+	return epoll_ctl_event(EPOLL_CTL_MOD, ev);
+}
+
+static int
+epoll_del(struct event *ev)
+{
+	/* Forked children may still hold the descriptor open, so closing it
+	 * would not remove it from the interest list. */
+	ev->index = -1;
+	return epoll_ctl_event(EPOLL_CTL_DEL, ev);
+}
+
+static int
+epoll_process(int msec)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct event *ev;
+	int i, n;
+
+	n = epoll_wait(epfd, events, MAX_EVENTS, msec);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n; i++)
+	{
+		ev = events[i].data.ptr;
+		if (ev->index < 0)
+			continue;
+		ev->process(ev);
+	}
+
+	return 0;
+}
+
+struct event_module event_module = {
+	.init =		epoll_init,
+	.fini =		epoll_fini,
+	.add =		epoll_add,
+	.mod =		epoll_mod,
+	.del =		epoll_del,
+	.process =	epoll_process,
+};
+#endif /* HAVE_EPOLL */
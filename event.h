@@ -0,0 +1,63 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include <poll.h>
+
+typedef enum {
+	EVENT_READ,
+	EVENT_WRITE,
+} event_t;
+
+struct event;
+
+typedef void event_process_t(struct event *);
+
+/* A descriptor registered with the event module.  The structure is
+ * normally embedded in the object that owns the descriptor, and must
+ * stay valid until it has been deleted from the module. */
+struct event {
+	int		 fd;
+	int		 index;		/* private to the backend */
+	event_t		 rdwr;
+	event_process_t	*process;
+	void		*data;
+};
+
+struct event_module {
+	int	(*init)(void);
+	void	(*fini)(void);
+	int	(*add)(struct event *);
+	int	(*mod)(struct event *);	/* re-arm after changing rdwr */
+	int	(*del)(struct event *);
+	int	(*process)(int msec);
+};
+
+extern struct event_module event_module;
+
+/* The epoll backend is edge-triggered: a descriptor is reported once per
+ * state change, so read handlers must keep going until this returns 0. */
+static inline int
+event_readable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return (poll(&pfd, 1, 0) > 0);
+}
+
+#endif /* __EVENT_H__ */
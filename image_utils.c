@@ -31,7 +31,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <setjmp.h>
+#include <sys/stat.h>
 #include <jpeglib.h>
 #ifdef HAVE_MACHINE_ENDIAN_H
 #include <machine/endian.h>
@@ -190,7 +193,7 @@ jpeg_memory_src(j_decompress_ptr cinfo, const unsigned char * buffer, size_t buf
 	src->pub.bytes_in_buffer = bufsize;
 }
 
-jmp_buf setjmp_buffer;
+static __thread jmp_buf setjmp_buffer;
 /* Don't exit on error like libjpeg likes to do */
 static void
 libjpeg_error_handler(j_common_ptr cinfo)
@@ -230,171 +233,329 @@ put_pix_alpha_replace(image_s *pimage, int32_t x, int32_t y, pix col)
 		pimage->buf[(y * pimage->width) + x] = col;
 }
 
-int
-image_get_jpeg_resolution(const char * path, int * width, int * height)
+/* The headers of a JPEG file, read as they are walked, or a JPEG already
+ * in memory (fd -1).  Reading goes no further than the image data, and
+ * a file that shrinks meanwhile only looks truncated. */
+struct jpeg_src {
+	int fd;
+	uint8_t *p;
+	size_t len;	/* bytes in p */
+	size_t size;	/* allocated for p */
+};
+
+#define JPEG_READ_SIZE   (64 * 1024)
+#define JPEG_HEADER_MAX  (8 * 1024 * 1024)
+
+/* Make sure the first need bytes of src are in src->p */
+static int
+jpeg_need(struct jpeg_src *src, size_t need)
 {
-	FILE *img;
-	unsigned char buf[8];
-	uint16_t offset, h, w;
-	int ret = 1;
-	size_t nread;
-	long size;
-	
-
-	img = fopen(path, "r");
-	if( !img )
+	uint8_t *p;
+	size_t size;
+	ssize_t n;
+
+	if( need <= src->len )
+		return 0;
+	if( src->fd < 0 || need > JPEG_HEADER_MAX )
 		return -1;
+	if( need > src->size )
+	{
+		size = src->size ? src->size : JPEG_READ_SIZE;
+		while( size < need )
+			size *= 2;
+		p = realloc(src->p, size);
+		if( !p )
+			return -1;
+		src->p = p;
+		src->size = size;
+	}
+	while( src->len < need )
+	{
+		n = pread(src->fd, src->p + src->len, src->size - src->len, src->len);
+		if( n < 0 && errno == EINTR )
+			continue;
+		if( n <= 0 )
+			return -1;
+		src->len += n;
+	}
+
+	return 0;
+}
+
+static int jpeg_walk(struct jpeg_src *src, off_t file, struct jpeg_info *info);
+
+/* A TIFF structure (the body of an EXIF segment), and its byte order */
+struct tiff {
+	const uint8_t *p;
+	uint32_t len;
+	int mm;		/* big-endian ("MM") */
+};
+
+static unsigned
+tiff16(const struct tiff *t, const uint8_t *p)
+{
+	return t->mm ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static uint32_t
+tiff32(const struct tiff *t, const uint8_t *p)
+{
+	return t->mm ? ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+	             : p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-	fseek(img, 0, SEEK_END);
-	size = ftell(img);
-	rewind(img);
+/* The entries of the IFD at off, and the offset of the next one in next */
+static const uint8_t *
+tiff_ifd(const struct tiff *t, uint32_t off, unsigned *n, uint32_t *next)
+{
+	const uint8_t *p;
+
+	*n = 0;
+	if( next )
+		*next = 0;
+	if( off < 8 || off >= t->len - 1 )
+		return NULL;
+	p = t->p + off;
+	*n = tiff16(t, p);
+	if( (t->len - off - 2) / 12 < *n )
+		*n = (t->len - off - 2) / 12;
+	else if( next && t->len - off - 2 - *n * 12 >= 4 )
+		*next = tiff32(t, p + 2 + *n * 12);
+	return p + 2;
+}
+
+/* Copy the ASCII value of a directory entry */
+static void
+tiff_string(const struct tiff *t, const uint8_t *e, char *buf, size_t size)
+{
+	const uint8_t *val;
+	uint32_t count, off;
 
-	nread = fread(&buf, 2, 1, img);
-	if( (nread < 1) || (buf[0] != 0xFF) || (buf[1] != 0xD8) )
+	count = tiff32(t, e + 4);
+	if( tiff16(t, e + 2) != 2 || !count )
+		return;
+	if( count <= 4 )
+		val = e + 8;
+	else
 	{
-		fclose(img);
-		return -1;
+		off = tiff32(t, e + 8);
+		if( off > t->len || count > t->len - off )
+			return;
+		val = t->p + off;
 	}
-	memset(&buf, 0, sizeof(buf));
+	if( count >= size )
+		count = size - 1;
+	memcpy(buf, val, count);
+	buf[count] = '\0';
+}
 
-	while( ftell(img) < size )
+/* The SHORT or LONG value of a directory entry */
+static uint32_t
+tiff_int(const struct tiff *t, const uint8_t *e)
+{
+	switch( tiff16(t, e + 2) )
 	{
-		while( nread > 0 && buf[0] != 0xFF && !feof(img) )
-			nread = fread(&buf, 1, 1, img);
+	case 3:
+		return tiff16(t, e + 8);
+	case 4:
+		return tiff32(t, e + 8);
+	default:
+		return 0;
+	}
+}
 
-		while( nread > 0 && buf[0] == 0xFF && !feof(img) )
-			nread = fread(&buf, 1, 1, img);
+/* Read what we want from an EXIF segment, found at base in the file */
+static void
+jpeg_parse_exif(const uint8_t *p, uint32_t len, off_t base, struct jpeg_info *info)
+{
+	struct tiff t = { p, len, 0 };
+	char date[20] = "", digitized[20] = "";
+	const uint8_t *e;
+	uint32_t exif = 0, ifd1, thumb = 0, thumb_len = 0;
+	unsigned i, n;
 
-		if( (buf[0] >= 0xc0) && (buf[0] <= 0xc3) )
+	if( len < 8 )
+		return;
+	if( memcmp(p, "MM", 2) == 0 )
+		t.mm = 1;
+	else if( memcmp(p, "II", 2) != 0 )
+		return;
+	if( tiff16(&t, p + 2) != 42 )
+		return;
+
+	e = tiff_ifd(&t, tiff32(&t, p + 4), &n, &ifd1);
+	for( i = 0; i < n; i++, e += 12 )
+	{
+		switch( tiff16(&t, e) )
 		{
-			nread = fread(&buf, 7, 1, img);
-			*width = 0;
-			*height = 0;
-			if( nread < 1 )
-				break;
-			memcpy(&h, buf+3, 2);
-			*height = SWAP16(h);
-			memcpy(&w, buf+5, 2);
-			*width = SWAP16(w);
-			ret = 0;
+		case 0x010F:
+			tiff_string(&t, e, info->make, sizeof(info->make));
+			break;
+		case 0x0110:
+			tiff_string(&t, e, info->model, sizeof(info->model));
+			break;
+		case 0x0112:
+			info->orientation = tiff_int(&t, e);
+			break;
+		case 0x8769:	/* Exif IFD */
+			exif = tiff_int(&t, e);
 			break;
 		}
-		else
+	}
+
+	e = tiff_ifd(&t, exif, &n, NULL);
+	for( i = 0; i < n; i++, e += 12 )
+	{
+		switch( tiff16(&t, e) )
 		{
-			offset = 0;
-			nread = fread(&buf, 2, 1, img);
-			if( nread < 1 )
-				break;
-			memcpy(&offset, buf, 2);
-			offset = SWAP16(offset) - 2;
-			if( fseek(img, offset, SEEK_CUR) == -1 )
-				break;
+		case 0x9003:
+			tiff_string(&t, e, date, sizeof(date));
+			break;
+		case 0x9004:
+			tiff_string(&t, e, digitized, sizeof(digitized));
+			break;
 		}
 	}
-	fclose(img);
-	return ret;
-}
-
-int
-image_get_jpeg_date_xmp(const char * path, char ** date)
-{
-	FILE *img;
-	unsigned char buf[8];
-	char *data = NULL, *newdata;
-	uint16_t offset;
-	struct NameValueParserData xml;
-	char * exif;
-	int ret = 1;
-	size_t nread;
-
-	img = fopen(path, "r");
-	if( !img )
-		return(-1);
-
-	nread = fread(&buf, 2, 1, img);
-	if( (nread < 1) || (buf[0] != 0xFF) || (buf[1] != 0xD8) )
+	if( !date[0] )
+		strcpy(date, digitized);
+	/* "YYYY:MM:DD HH:MM:SS" */
+	if( strlen(date) > 10 )
 	{
-		fclose(img);
-		return(-1);
+		date[4] = '-';
+		date[7] = '-';
+		date[10] = 'T';
+		strcpy(info->date, date);
 	}
-	memset(&buf, 0, sizeof(buf));
 
-	while( !feof(img) )
+	/* IFD1 describes the thumbnail */
+	e = tiff_ifd(&t, ifd1, &n, NULL);
+	for( i = 0; i < n; i++, e += 12 )
 	{
-		while( nread > 0 && buf[0] != 0xFF && !feof(img) )
-			nread = fread(&buf, 1, 1, img);
-
-		while( nread > 0 && buf[0] == 0xFF && !feof(img) )
-			nread = fread(&buf, 1, 1, img);
-
-		if( feof(img) )
+		switch( tiff16(&t, e) )
+		{
+		case 0x0201:
+			thumb = tiff_int(&t, e);
+			break;
+		case 0x0202:
+			thumb_len = tiff_int(&t, e);
 			break;
+		}
+	}
+	if( thumb && thumb_len && thumb < len && thumb_len <= len - thumb )
+	{
+		struct jpeg_src src = { -1, (uint8_t *)p + thumb, thumb_len, thumb_len };
+		struct jpeg_info t;
 
-		if( buf[0] == 0xE1 ) // APP1 marker
+		info->thumb_offset = base + thumb;
+		info->thumb_size = thumb_len;
+		memset(&t, 0, sizeof(t));
+		if( jpeg_walk(&src, -1, &t) == 0 )
 		{
-			offset = 0;
-			nread = fread(&buf, 2, 1, img);
-			if( nread < 1 )
-				break;
-			memcpy(&offset, buf, 2);
-			offset = SWAP16(offset) - 2;
+			info->thumb_width = t.width;
+			info->thumb_height = t.height;
+		}
+	}
+}
 
-			if( offset < 30 )
-			{
-				fseek(img, offset, SEEK_CUR);
-				continue;
-			}
+/* Take the date from an XMP segment, if EXIF doesn't have one */
+static void
+jpeg_parse_xmp(const uint8_t *p, uint32_t len, char *date, size_t size)
+{
+	struct NameValueParserData xml;
+	char *val;
 
-			newdata = realloc(data, 30);
-			if( !newdata )
-				break;
-			data = newdata;
+	ParseNameValue((const char *)p, len, &xml, 0);
+	val = GetValueFromNameValueList(&xml, "DateTimeOriginal");
+	if( val )
+		snprintf(date, size, "%s", val);
+	ClearNameValueList(&xml);
+}
 
-			nread = fread(data, 29, 1, img);
-			if( nread < 1 )
-				break;
-			offset -= 29;
-			if( strcmp(data, "http://ns.adobe.com/xap/1.0/") != 0 )
-			{
-				fseek(img, offset, SEEK_CUR);
-				continue;
-			}
+#define XMP_ID "http://ns.adobe.com/xap/1.0/"
 
-			newdata = realloc(data, offset+1);
-			if( !newdata )
-				break;
-			data = newdata;
-			nread = fread(data, offset, 1, img);
-			if( nread < 1 )
-				break;
+/* Walk the segments of src up to the image data.  file is src's offset
+ * in the file, or -1 when src is the EXIF thumbnail, where only the frame
+ * size matters. */
+static int
+jpeg_walk(struct jpeg_src *src, off_t file, struct jpeg_info *info)
+{
+	char xmp_date[64] = "";
+	const uint8_t *p;
+	size_t pos = 2, n;
+	uint8_t marker;
+	int exif = 0, ret = -1;
 
-			ParseNameValue(data, offset, &xml, 0);
-			exif = GetValueFromNameValueList(&xml, "DateTimeOriginal");
-			if( !exif )
-			{
-				ClearNameValueList(&xml);
-				break;
-			}
-			*date = realloc(*date, strlen(exif)+1);
-			strcpy(*date, exif);
-			ClearNameValueList(&xml);
+	if( jpeg_need(src, 4) != 0 || src->p[0] != 0xFF || src->p[1] != 0xD8 )
+		return -1;
 
-			ret = 0;
-			break;
+	while( jpeg_need(src, pos + 4) == 0 )
+	{
+		p = src->p;
+		if( p[pos] != 0xFF )
+		{
+			pos++;
+			continue;
 		}
-		else
+		marker = p[pos+1];
+		pos += 2;
+		if( marker == 0xFF )
 		{
-			offset = 0;
-			nread = fread(&buf, 2, 1, img);
-			if( nread < 1 )
+			pos--;	/* fill byte */
+			continue;
+		}
+		if( marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8) )
+			continue;
+		if( marker == 0xD9 || marker == 0xDA )
+			break;
+		n = (p[pos] << 8) | p[pos+1];
+		if( n < 2 || jpeg_need(src, pos + n) != 0 )
+			break;
+		p = src->p;
+		pos += 2;
+		n -= 2;
+		/* every SOFn but DHT, JPG and DAC */
+		if( marker >= 0xC0 && marker <= 0xCF &&
+		    marker != 0xC4 && marker != 0xC8 && marker != 0xCC )
+		{
+			if( n >= 5 )
+			{
+				info->height = (p[pos+1] << 8) | p[pos+2];
+				info->width = (p[pos+3] << 8) | p[pos+4];
+				ret = 0;
+			}
+			if( file < 0 )
 				break;
-			memcpy(&offset, buf, 2);
-			offset = SWAP16(offset) - 2;
-			fseek(img, offset, SEEK_CUR);
 		}
+		else if( marker == 0xE1 && file >= 0 )
+		{
+			if( n > 6 && memcmp(p + pos, "Exif\0\0", 6) == 0 && !exif++ )
+				jpeg_parse_exif(p + pos + 6, n - 6, file + pos + 6, info);
+			else if( n > sizeof(XMP_ID) && memcmp(p + pos, XMP_ID, sizeof(XMP_ID)) == 0 )
+				jpeg_parse_xmp(p + pos + sizeof(XMP_ID), n - sizeof(XMP_ID),
+				               xmp_date, sizeof(xmp_date));
+		}
+		pos += n;
 	}
-	fclose(img);
-	free(data);
+	if( !info->date[0] && xmp_date[0] )
+		strcpy(info->date, xmp_date);
+
+	return ret;
+}
+
+int
+image_get_jpeg_info(const char *path, struct jpeg_info *info)
+{
+	struct jpeg_src src = { -1, NULL, 0, 0 };
+	int ret;
+
+	memset(info, 0, sizeof(*info));
+	src.fd = open(path, O_RDONLY);
+	if( src.fd < 0 )
+		return -1;
+	ret = jpeg_walk(&src, 0, info);
+	close(src.fd);
+	free(src.p);
+
 	return ret;
 }
 
@@ -22,6 +22,7 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <inttypes.h>
+#include <sys/types.h>
 
 #define ROTATE_NONE 0x0
 #define ROTATE_90   0x1
@@ -39,11 +40,25 @@ typedef struct {
 void
 image_free(image_s *pimage);
 
-int
-image_get_jpeg_date_xmp(const char * path, char ** date);
+/* What the headers of a JPEG file say about it */
+struct jpeg_info {
+	int width;
+	int height;
+	char date[64];		/* from EXIF, as YYYY-MM-DDTHH:MM:SS, or from XMP */
+	char make[32];
+	char model[64];
+	int orientation;	/* EXIF orientation, or 0 */
+	off_t thumb_offset;	/* of the EXIF thumbnail, if thumb_size */
+	size_t thumb_size;
+	int thumb_width;
+	int thumb_height;
+};
 
+/* image_get_jpeg_info()
+ * fill info in a single pass over the segments before the image data of
+ * the JPEG file at path.  Returns 0 if its frame size was found. */
 int
-image_get_jpeg_resolution(const char * path, int * width, int * height);
+image_get_jpeg_info(const char *path, struct jpeg_info *info);
 
 image_s *
 image_new_from_jpeg(const char *path, int is_file, const uint8_t *ptr, int size, int scale, int resize);
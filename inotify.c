@@ -559,8 +559,8 @@ inotify_remove_file(const char * path)
 		sql_exec(db, "DELETE from DETAILS where ID ="
 		             " (SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s$%llX')",
 		         MUSIC_PLIST_ID, detailID);
-		sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s$%llX' or PARENT_ID = '%s$%llX'",
-		         MUSIC_PLIST_ID, detailID, MUSIC_PLIST_ID, detailID);
+		delete_objects("OBJECT_ID = '%s$%llX' or PARENT_ID = '%s$%llX'",
+		               MUSIC_PLIST_ID, detailID, MUSIC_PLIST_ID, detailID);
 	}
 	else
 	{
@@ -585,14 +585,14 @@ inotify_remove_file(const char * path)
 					continue;
 				if( children < 2 )
 				{
-					sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
+					delete_objects("OBJECT_ID = '%s'", result[i]);
 
 					ptr = strrchr(result[i], '$');
 					if( ptr )
 						*ptr = '\0';
 					if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]) == 0 )
 					{
-						sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
+						delete_objects("OBJECT_ID = '%s'", result[i]);
 					}
 				}
 			}
@@ -600,7 +600,7 @@ inotify_remove_file(const char * path)
 		}
 		/* Now delete the actual objects */
 		sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
-		sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
+		delete_objects("DETAIL_ID = %lld", detailID);
 	}
 	snprintf(art_cache, sizeof(art_cache), "%s/art_cache%s", db_path, path);
 	remove(art_cache);
@@ -629,7 +629,7 @@ inotify_remove_directory(int fd, const char * path)
 			{
 				detailID = strtoll(result[i], NULL, 10);
 				sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
-				sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
+				delete_objects("DETAIL_ID = %lld", detailID);
 			}
 			ret = 0;
 		}
@@ -663,15 +663,24 @@ start_inotify(void)
 	if ( pollfds[0].fd < 0 )
 		DPRINTF(E_ERROR, L_INOTIFY, "inotify_init() failed!\n");
 
-	while( scanning )
+	while( scanning || rebuilding )
 	{
 		if( quitting )
 			goto quitting;
 		sleep(1);
 	}
+	/* a writer of our own, so the main thread never waits on our updates */
+	snprintf(path_buf, sizeof(path_buf), "%s/files.db", db_path);
+	if ((db = sql_open(path_buf, 0)) == NULL)
+	{
+		DPRINTF(E_ERROR, L_INOTIFY, "Failed to open the database; not watching for changes\n");
+		goto quitting;
+	}
 	inotify_create_watches(pollfds[0].fd);
 	if (setpriority(PRIO_PROCESS, 0, 19) == -1)
 		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce inotify thread priority\n");
+	if (set_io_priority(IO_PRIO_IDLE) == -1)
+		DPRINTF(E_INFO, L_INOTIFY,  "Failed to reduce inotify I/O priority\n");
 	sqlite3_release_memory(1<<31);
 	av_register_all();
         
@@ -682,7 +691,9 @@ start_inotify(void)
 		{
 			if( next_pl_fill && (time(NULL) >= next_pl_fill) )
 			{
+				pthread_mutex_lock(&library_lock);
 				fill_playlists();
+				pthread_mutex_unlock(&library_lock);
 				next_pl_fill = 0;
 			}
 			continue;
@@ -700,6 +711,8 @@ start_inotify(void)
 			buffer[BUF_LEN-1] = '\0';
 		}
 
+		/* the backfill thread stores its batches in between */
+		pthread_mutex_lock(&library_lock);
 		i = 0;
 		while( i < length )
 		{
@@ -757,10 +770,13 @@ start_inotify(void)
 			}
 			i += EVENT_SIZE + event->len;
 		}
+		pthread_mutex_unlock(&library_lock);
 	}
 	inotify_remove_watches(pollfds[0].fd);
 quitting:
 	close(pollfds[0].fd);
+	if (db)
+		sql_close(db);
 
 	return 0;
 }
@@ -180,3 +180,51 @@ lav_is_thumbnail_stream(AVStream *s, uint8_t **data, int *size)
 #endif
 	return 0;
 }
+
+#if LIBAVCODEC_VERSION_INT >= ((52<<16)+(39<<8)+0) && \
+    LIBAVCODEC_VERSION_INT < ((58<<16)+(9<<8)+100)
+#include <pthread.h>
+
+static inline int
+lav_lockmgr(void **mutex, enum AVLockOp op)
+{
+	switch (op)
+	{
+	case AV_LOCK_CREATE:
+		*mutex = malloc(sizeof(pthread_mutex_t));
+		if (!*mutex)
+			return 1;
+		if (pthread_mutex_init(*mutex, NULL) != 0)
+		{
+			free(*mutex);
+			*mutex = NULL;
+			return 1;
+		}
+		return 0;
+	case AV_LOCK_OBTAIN:
+		return !!pthread_mutex_lock(*mutex);
+	case AV_LOCK_RELEASE:
+		return !!pthread_mutex_unlock(*mutex);
+	case AV_LOCK_DESTROY:
+		pthread_mutex_destroy(*mutex);
+		free(*mutex);
+		*mutex = NULL;
+		return 0;
+	}
+	return 1;
+}
+#endif
+
+/* Make it safe to open files from several threads at once.  Returns 0 if
+ * this libavcodec has no way to do that, so callers should stay serial. */
+static inline int
+lav_threads_init(void)
+{
+#if LIBAVCODEC_VERSION_INT >= ((58<<16)+(9<<8)+100)
+	return 1;
+#elif LIBAVCODEC_VERSION_INT >= ((52<<16)+(39<<8)+0)
+	return (av_lockmgr_register(lav_lockmgr) == 0);
+#else
+	return 0;
+#endif
+}
@@ -137,16 +137,19 @@ log_err(int level, enum _log_facility facility, char *fname, int lineno, char *f
 	if (!log_fp)
 		log_fp = stdout;
 
+	// keep lines from different scanner threads whole
+	flockfile(log_fp);
+
 	// timestamp
 	if (!GETFLAG(SYSTEMD_MASK))
 	{
 		time_t t;
-		struct tm *tm;
+		struct tm tm;
 		t = time(NULL);
-		tm = localtime(&t);
+		localtime_r(&t, &tm);
 		fprintf(log_fp, "[%04d/%02d/%02d %02d:%02d:%02d] ",
-		        tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-		        tm->tm_hour, tm->tm_min, tm->tm_sec);
+		        tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+		        tm.tm_hour, tm.tm_min, tm.tm_sec);
 	}
 
 	if (level)
@@ -159,11 +162,13 @@ log_err(int level, enum _log_facility facility, char *fname, int lineno, char *f
 	if (vfprintf(log_fp, fmt, ap) == -1)
 	{
 		va_end(ap);
+		funlockfile(log_fp);
 		return;
 	}
 	va_end(ap);
 
 	fflush(log_fp);
+	funlockfile(log_fp);
 
 	if (level==E_FATAL)
 		exit(-1);
@@ -27,8 +27,8 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <fcntl.h>
+#include <pthread.h>
 
-#include <libexif/exif-loader.h>
 #include <jpeglib.h>
 #include <setjmp.h>
 #include "libav.h"
@@ -264,10 +264,10 @@ GetFolderMetadata(const char *name, const char *path, const char *artist, const
 {
 	int ret;
 
-	ret = sql_exec(db, "INSERT into DETAILS"
+	ret = sql_exec_bind(db, "INSERT into DETAILS"
 	                   " (TITLE, PATH, CREATOR, ARTIST, GENRE, ALBUM_ART) "
 	                   "VALUES"
-	                   " ('%q', %Q, %Q, %Q, %Q, %lld);",
+	                   " (?, ?, ?, ?, ?, ?)", "sssssI",
 	                   name, path, artist, artist, genre, album_art);
 	if( ret != SQLITE_OK )
 		ret = 0;
@@ -277,23 +277,67 @@ GetFolderMetadata(const char *name, const char *path, const char *artist, const
 	return ret;
 }
 
-int64_t
-GetAudioMetadata(const char *path, char *name)
+/* Make every string in m a copy of its own, so that it outlives the tags
+ * and buffers it was read from */
+static void
+own_metadata(metadata_t *m, uint32_t *flags)
+{
+	struct {
+		char **field;
+		uint32_t flag;
+	} fields[] = {
+		{ &m->title, FLAG_TITLE },
+		{ &m->artist, FLAG_ARTIST },
+		{ &m->album, FLAG_ALBUM },
+		{ &m->genre, FLAG_GENRE },
+		{ &m->comment, FLAG_COMMENT },
+		{ &m->creator, FLAG_CREATOR },
+		{ &m->date, FLAG_DATE },
+		{ &m->dlna_pn, FLAG_DLNA_PN },
+		{ &m->mime, FLAG_MIME },
+		{ &m->duration, FLAG_DURATION },
+		{ &m->resolution, FLAG_RESOLUTION },
+	};
+	int i;
+
+	for( i = 0; i < sizeof(fields)/sizeof(fields[0]); i++ )
+	{
+		if( *fields[i].field && !(*flags & fields[i].flag) )
+		{
+			*fields[i].field = strdup(*fields[i].field);
+			*flags |= fields[i].flag;
+		}
+	}
+	m->thumb_data = NULL;
+	m->thumb_size = 0;
+}
+
+static char lang[6];
+static pthread_once_t lang_once = PTHREAD_ONCE_INIT;
+
+static void
+init_lang(void)
+{
+	if( !getenv("LANG") )
+		strcpy(lang, "en_US");
+	else
+		strncpyt(lang, getenv("LANG"), sizeof(lang));
+}
+
+int
+ReadAudioMetadata(const char *path, char *name, struct file_details *d)
 {
 	char type[4];
-	static char lang[6] = { '\0' };
 	struct stat file;
-	int64_t ret;
 	char *esc_tag;
 	int i;
-	int64_t album_art = 0;
 	struct song_metadata song;
 	metadata_t m;
 	uint32_t free_flags = FLAG_MIME|FLAG_DURATION|FLAG_DLNA_PN|FLAG_DATE;
 	memset(&m, '\0', sizeof(metadata_t));
 
 	if ( stat(path, &file) != 0 )
-		return 0;
+		return -1;
 	strip_ext(name);
 
 	if( ends_with(path, ".mp3") )
@@ -340,23 +384,17 @@ GetAudioMetadata(const char *path, char *name)
 	else
 	{
 		DPRINTF(E_WARN, L_METADATA, "Unhandled file extension on %s\n", path);
-		return 0;
+		return -1;
 	}
 
-	if( !(*lang) )
-	{
-		if( !getenv("LANG") )
-			strcpy(lang, "en_US");
-		else
-			strncpyt(lang, getenv("LANG"), sizeof(lang));
-	}
+	pthread_once(&lang_once, init_lang);
 
 	if( readtags((char *)path, &song, &file, lang, type) != 0 )
 	{
 		DPRINTF(E_WARN, L_METADATA, "Cannot extract tags from %s!\n", path);
         	freetags(&song);
 		free_metadata(&m, free_flags);
-		return 0;
+		return -1;
 	}
 
 	if( song.dlna_pn )
@@ -452,33 +490,35 @@ GetAudioMetadata(const char *path, char *name)
 		}
 	}
 
-	album_art = find_album_art(path, song.image, song.image_size);
-
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, SIZE, TIMESTAMP, DURATION, CHANNELS, BITRATE, SAMPLERATE, DATE,"
-	                   "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART) "
-	                   "VALUES"
-	                   " (%Q, %lld, %lld, '%s', %d, %d, %d, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %d, %d, %Q, '%s', %lld);",
-	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration, song.channels, song.bitrate,
-	                   song.samplerate, m.date, m.title, m.creator, m.artist, m.album, m.genre, m.comment, song.disc,
-	                   song.track, m.dlna_pn, song.mime?song.mime:m.mime, album_art);
-	if( ret != SQLITE_OK )
-	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
-	}
-	else
+	if( song.mime )
 	{
-		ret = sqlite3_last_insert_rowid(db);
+		free(m.mime);
+		m.mime = strdup(song.mime);
 	}
+	m.channels = song.channels;
+	m.bitrate = song.bitrate;
+	m.frequency = song.samplerate;
+	m.disc = song.disc;
+	m.track = song.track;
+
+	memset(d, '\0', sizeof(*d));
+	d->type = DETAILS_AUDIO;
+	d->path = strdup(path);
+	d->size = file.st_size;
+	d->timestamp = file.st_mtime;
+	d->dev = file.st_dev;
+	d->ino = file.st_ino;
+	d->album_art = album_art_path(path, song.image, song.image_size);
+	own_metadata(&m, &free_flags);
+	d->m = m;
+	d->free_flags = free_flags;
         freetags(&song);
-	free_metadata(&m, free_flags);
 
-	return ret;
+	return 0;
 }
 
 /* For libjpeg error handling */
-jmp_buf setjmp_buffer;
+static __thread jmp_buf setjmp_buffer;
 static void
 libjpeg_error_handler(j_common_ptr cinfo)
 {
@@ -487,121 +527,33 @@ libjpeg_error_handler(j_common_ptr cinfo)
 	return;
 }
 
-int64_t
-GetImageMetadata(const char *path, char *name)
+int
+ReadImageMetadata(const char *path, char *name, struct file_details *d)
 {
-	ExifData *ed;
-	ExifEntry *e = NULL;
-	ExifLoader *l;
+	struct jpeg_info info;
 	struct jpeg_decompress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	FILE *infile;
 	int width=0, height=0, thumb=0;
-	char make[32], model[64] = {'\0'};
-	char b[1024];
+	char model[sizeof(info.make) + sizeof(info.model)];
 	struct stat file;
-	int64_t ret;
-	image_s *imsrc;
 	metadata_t m;
 	uint32_t free_flags = 0xFFFFFFFF;
 	memset(&m, '\0', sizeof(metadata_t));
 
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, "Parsing %s...\n", path);
 	if ( stat(path, &file) != 0 )
-		return 0;
+		return -1;
 	strip_ext(name);
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * size: %jd\n", file.st_size);
 
-	/* MIME hard-coded to JPEG for now, until we add PNG support */
-	m.mime = strdup("image/jpeg");
-
-	l = exif_loader_new();
-	exif_loader_write_file(l, path);
-	ed = exif_loader_get_data(l);
-	exif_loader_unref(l);
-	if( !ed )
-		goto no_exifdata;
-
-	e = exif_content_get_entry (ed->ifd[EXIF_IFD_EXIF], EXIF_TAG_DATE_TIME_ORIGINAL);
-	if( e || (e = exif_content_get_entry(ed->ifd[EXIF_IFD_EXIF], EXIF_TAG_DATE_TIME_DIGITIZED)) )
-	{
-		m.date = strdup(exif_entry_get_value(e, b, sizeof(b)));
-		if( strlen(m.date) > 10 )
-		{
-			m.date[4] = '-';
-			m.date[7] = '-';
-			m.date[10] = 'T';
-		}
-		else {
-			free(m.date);
-			m.date = NULL;
-		}
-	}
-	else {
-		/* One last effort to get the date from XMP */
-		image_get_jpeg_date_xmp(path, &m.date);
-	}
-	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * date: %s\n", m.date);
-
-	e = exif_content_get_entry(ed->ifd[EXIF_IFD_0], EXIF_TAG_MAKE);
-	if( e )
-	{
-		strncpyt(make, exif_entry_get_value(e, b, sizeof(b)), sizeof(make));
-		e = exif_content_get_entry(ed->ifd[EXIF_IFD_0], EXIF_TAG_MODEL);
-		if( e )
-		{
-			strncpyt(model, exif_entry_get_value(e, b, sizeof(b)), sizeof(model));
-			if( !strcasestr(model, make) )
-				snprintf(model, sizeof(model), "%s %s", make, exif_entry_get_value(e, b, sizeof(b)));
-			m.creator = escape_tag(trim(model), 1);
-		}
-	}
-	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * model: %s\n", model);
-
-	e = exif_content_get_entry(ed->ifd[EXIF_IFD_0], EXIF_TAG_ORIENTATION);
-	if( e )
-	{
-		switch( exif_get_short(e->data, exif_data_get_byte_order(ed)) )
-		{
-		case 3:
-			m.rotation = 180;
-			break;
-		case 6:
-			m.rotation = 90;
-			break;
-		case 8:
-			m.rotation = 270;
-			break;
-		default:
-			m.rotation = 0;
-			break;
-		}
-	}
-
-	if( ed->size )
-	{
-		/* We might need to verify that the thumbnail is 160x160 or smaller */
-		if( ed->size > 12000 )
-		{
-			imsrc = image_new_from_jpeg(NULL, 0, ed->data, ed->size, 1, ROTATE_NONE);
-			if( imsrc )
-			{
- 				if( (imsrc->width <= 160) && (imsrc->height <= 160) )
-					thumb = 1;
-				image_free(imsrc);
-			}
-		}
-		else
-			thumb = 1;
-	}
-	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * thumbnail: %d\n", thumb);
-
-	exif_data_unref(ed);
-
-no_exifdata:
+	image_get_jpeg_info(path, &info);
+	width = info.width;
+	height = info.height;
 	/* If SOF parsing fails, then fall through to reading the JPEG data with libjpeg to get the resolution */
-	if( image_get_jpeg_resolution(path, &width, &height) != 0 || !width || !height )
+	if( !width || !height )
 	{
+		DPRINTF(E_DEBUG, L_METADATA, "No frame size in the headers of %s; decoding it\n", path);
 		infile = fopen(path, "r");
 		if( infile )
 		{
@@ -622,11 +574,50 @@ no_exifdata:
 	}
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * resolution: %dx%d\n", width, height);
 
-	if( !width || !height )
+	/* MIME hard-coded to JPEG for now, until we add PNG support */
+	m.mime = strdup("image/jpeg");
+
+	if( info.date[0] )
+		m.date = strdup(info.date);
+	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * date: %s\n", m.date);
+
+	if( info.make[0] && info.model[0] )
 	{
-		free_metadata(&m, free_flags);
-		return 0;
+		if( strcasestr(info.model, info.make) )
+			strncpyt(model, info.model, sizeof(model));
+		else
+			snprintf(model, sizeof(model), "%s %s", info.make, info.model);
+		m.creator = escape_tag(trim(model), 1);
 	}
+	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * model: %s\n", model);
+
+	switch( info.orientation )
+	{
+	case 3:
+		m.rotation = 180;
+		break;
+	case 6:
+		m.rotation = 90;
+		break;
+	case 8:
+		m.rotation = 270;
+		break;
+	default:
+		m.rotation = 0;
+		break;
+	}
+
+	if( info.thumb_size )
+	{
+		/* We might need to verify that the thumbnail is 160x160 or smaller */
+		if( info.thumb_size > 12000 )
+			thumb = info.thumb_width && info.thumb_width <= 160 &&
+			        info.thumb_height && info.thumb_height <= 160;
+		else
+			thumb = 1;
+	}
+	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * thumbnail: %d\n", thumb);
+
 	if( width <= 640 && height <= 480 )
 		m.dlna_pn = strdup("JPEG_SM");
 	else if( width <= 1024 && height <= 768 )
@@ -634,40 +625,33 @@ no_exifdata:
 	else if( (width <= 4096 && height <= 4096) || !GETFLAG(DLNA_STRICT_MASK) )
 		m.dlna_pn = strdup("JPEG_LRG");
 	xasprintf(&m.resolution, "%dx%d", width, height);
+	m.title = strdup(name);
+
+	memset(d, '\0', sizeof(*d));
+	d->type = DETAILS_IMAGE;
+	d->path = strdup(path);
+	d->size = file.st_size;
+	d->timestamp = file.st_mtime;
+	d->dev = file.st_dev;
+	d->ino = file.st_ino;
+	d->thumb = thumb;
+	d->m = m;
+	d->free_flags = free_flags;
 
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
-	                    " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
-	                   "VALUES"
-	                   " (%Q, '%q', %lld, %lld, %Q, %Q, %u, %d, %Q, %Q, %Q);",
-	                   path, name, (long long)file.st_size, (long long)file.st_mtime, m.date,
-	                   m.resolution, m.rotation, thumb, m.creator, m.dlna_pn, m.mime);
-	if( ret != SQLITE_OK )
-	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
-	}
-	else
-	{
-		ret = sqlite3_last_insert_rowid(db);
-	}
-	free_metadata(&m, free_flags);
-
-	return ret;
+	return 0;
 }
 
-int64_t
-GetVideoMetadata(const char *path, char *name)
+int
+ReadVideoMetadata(const char *path, char *name, struct file_details *d)
 {
 	struct stat file;
 	int ret, i;
-	struct tm *modtime;
+	struct tm modtime;
 	AVFormatContext *ctx = NULL;
 	AVCodecContext *ac = NULL, *vc = NULL;
 	int audio_stream = -1, video_stream = -1;
 	enum audio_profiles audio_profile = PROFILE_AUDIO_UNKNOWN;
 	char fourcc[4];
-	int64_t album_art = 0;
 	char nfo[MAXPATHLEN], *ext;
 	struct song_metadata video;
 	metadata_t m;
@@ -679,7 +663,7 @@ GetVideoMetadata(const char *path, char *name)
 
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, "Parsing video %s...\n", name);
 	if ( stat(path, &file) != 0 )
-		return 0;
+		return -1;
 	strip_ext(name);
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * size: %jd\n", file.st_size);
 
@@ -689,7 +673,7 @@ GetVideoMetadata(const char *path, char *name)
 		char err[128];
 		av_strerror(ret, err, sizeof(err));
 		DPRINTF(E_WARN, L_METADATA, "Opening %s failed! [%s]\n", path, err);
-		return 0;
+		return -1;
 	}
 	//dump_format(ctx, 0, NULL, 0);
 	for( i=0; i<ctx->nb_streams; i++)
@@ -719,7 +703,7 @@ GetVideoMetadata(const char *path, char *name)
 		if( !is_audio(path) )
 			DPRINTF(E_DEBUG, L_METADATA, "File %s does not contain a video stream.\n", basepath);
 		free(path_cpy);
-		return 0;
+		return -1;
 	}
 
 	if( ac )
@@ -1530,38 +1514,372 @@ video_no_dlna:
 	if( !m.date )
 	{
 		m.date = malloc(20);
-		modtime = localtime(&file.st_mtime);
-		strftime(m.date, 20, "%FT%T", modtime);
+		localtime_r(&file.st_mtime, &modtime);
+		strftime(m.date, 20, "%FT%T", &modtime);
 	}
 
 	if( !m.title )
 		m.title = strdup(name);
 
-	album_art = find_album_art(path, m.thumb_data, m.thumb_size);
+	memset(d, '\0', sizeof(*d));
+	d->type = DETAILS_VIDEO;
+	d->path = strdup(path);
+	d->size = file.st_size;
+	d->timestamp = file.st_mtime;
+	d->dev = file.st_dev;
+	d->ino = file.st_ino;
+	d->album_art = album_art_path(path, m.thumb_data, m.thumb_size);
+	own_metadata(&m, &free_flags);
+	d->m = m;
+	d->free_flags = free_flags;
 	freetags(&video);
 	lav_close(ctx);
+	free(path_cpy);
 
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, SIZE, TIMESTAMP, DURATION, DATE, CHANNELS, BITRATE, SAMPLERATE, RESOLUTION,"
-	                   "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART) "
-	                   "VALUES"
-	                   " (%Q, %lld, %lld, %Q, %Q, %u, %u, %u, %Q, '%q', %Q, %Q, %Q, %Q, %Q, '%q', %lld);",
-	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration,
-	                   m.date, m.channels, m.bitrate, m.frequency, m.resolution,
-			   m.title, m.creator, m.artist, m.genre, m.comment, m.dlna_pn,
-                           m.mime, album_art);
+	return 0;
+}
+
+void
+free_details(struct file_details *d)
+{
+	free_metadata(&d->m, d->free_flags);
+	free(d->album_art);
+	free(d->path);
+	memset(d, '\0', sizeof(*d));
+}
+
+/* Insert the details read by one of the Read*Metadata functions, and
+ * release them.  With d->id set, they replace that row and keep its ID,
+ * which clients may already have in their URLs.  Returns the DETAILS ID,
+ * or 0 on failure. */
+int64_t
+store_details(struct file_details *d)
+{
+	metadata_t *m = &d->m;
+	int64_t album_art, ret;
+
+	album_art = album_art_id(d->album_art);
+	/* a delete and an insert, rather than an update, so that the
+	 * full-text index triggers see it */
+	if( d->id )
+		sql_exec_bind(db, "DELETE from DETAILS where ID = ?", "I", d->id);
+
+	switch( d->type )
+	{
+	case DETAILS_AUDIO:
+		ret = sql_exec_bind(db, "INSERT into DETAILS"
+		                   " (ID, PATH, SIZE, TIMESTAMP, DURATION, CHANNELS, BITRATE, SAMPLERATE, DATE,"
+		                   "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART) "
+		                   "VALUES"
+		                   " (nullif(?, 0), ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", "IsIIsiiisssssssiissI",
+		                   d->id, d->path, d->size, d->timestamp, m->duration, m->channels, m->bitrate,
+		                   m->frequency, m->date, m->title, m->creator, m->artist, m->album, m->genre, m->comment,
+		                   m->disc, m->track, m->dlna_pn, m->mime, album_art);
+		break;
+	case DETAILS_IMAGE:
+		ret = sql_exec_bind(db, "INSERT into DETAILS"
+		                   " (ID, PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
+		                    " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
+		                   "VALUES"
+		                   " (nullif(?, 0), ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", "IssIIssiisss",
+		                   d->id, d->path, m->title, d->size, d->timestamp, m->date,
+		                   m->resolution, m->rotation, d->thumb, m->creator, m->dlna_pn, m->mime);
+		break;
+	case DETAILS_VIDEO:
+		ret = sql_exec_bind(db, "INSERT into DETAILS"
+		                   " (ID, PATH, SIZE, TIMESTAMP, DURATION, DATE, CHANNELS, BITRATE, SAMPLERATE, RESOLUTION,"
+		                   "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART) "
+		                   "VALUES"
+		                   " (nullif(?, 0), ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", "IsIIssiiissssssssI",
+		                   d->id, d->path, d->size, d->timestamp, m->duration,
+		                   m->date, m->channels, m->bitrate, m->frequency, m->resolution,
+		                   m->title, m->creator, m->artist, m->genre, m->comment, m->dlna_pn,
+		                   m->mime, album_art);
+		break;
+	default:
+		ret = SQLITE_ERROR;
+		break;
+	}
 	if( ret != SQLITE_OK )
 	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
+		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", d->path);
 		ret = 0;
 	}
 	else
 	{
 		ret = sqlite3_last_insert_rowid(db);
-		check_for_captions(path, ret);
+		if( d->type == DETAILS_VIDEO )
+			check_for_captions(d->path, ret);
 	}
-	free_metadata(&m, free_flags);
-	free(path_cpy);
+	free_details(d);
 
 	return ret;
 }
+
+/* Bump this when Read*Metadata() start finding something different in
+ * the same file, so that old cache entries are dropped */
+#define DETAILS_CACHE_VERSION 1
+
+static char *details_cache = NULL;
+static sqlite3 *cache_writer = NULL;	/* the connection it is attached to */
+static __thread sqlite3 *cache_db = NULL;
+
+/* Attach metadata.db to the scanner's connection, where the scan writes
+ * to it in the same transactions as files.db */
+int
+open_details_cache(sqlite3 *db)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/metadata.db", db_path);
+	if( sql_exec(db, "ATTACH %Q as CACHE", path) != SQLITE_OK )
+		return -1;
+	sql_exec(db, "pragma CACHE.journal_mode = WAL");
+	sql_exec(db, "pragma CACHE.synchronous = NORMAL");
+	if( sql_get_int_field(db, "pragma CACHE.user_version") != DETAILS_CACHE_VERSION )
+	{
+		sql_exec(db, "DROP TABLE if exists CACHE.DETAILS_CACHE");
+		ret = sql_exec(db, "CREATE TABLE CACHE.DETAILS_CACHE ("
+		                   "DEV INTEGER NOT NULL, "
+		                   "INO INTEGER NOT NULL, "
+		                   "PATH TEXT NOT NULL, "
+		                   "SIZE INTEGER, "
+		                   "MTIME INTEGER, "
+		                   "TYPE INTEGER, "
+		                   "THUMB INTEGER, "
+		                   "ALBUM_ART TEXT, "
+		                   "TITLE TEXT, "
+		                   "ARTIST TEXT, "
+		                   "CREATOR TEXT, "
+		                   "ALBUM TEXT, "
+		                   "GENRE TEXT, "
+		                   "COMMENT TEXT, "
+		                   "DATE TEXT, "
+		                   "DURATION TEXT, "
+		                   "RESOLUTION TEXT, "
+		                   "MIME TEXT, "
+		                   "DLNA_PN TEXT, "
+		                   "DISC INTEGER, "
+		                   "TRACK INTEGER, "
+		                   "CHANNELS INTEGER, "
+		                   "BITRATE INTEGER, "
+		                   "FREQUENCY INTEGER, "
+		                   "ROTATION INTEGER, "
+		                   "PRIMARY KEY (DEV, INO, PATH))");
+		if( ret == SQLITE_OK )
+			ret = sql_exec(db, "pragma CACHE.user_version = %d", DETAILS_CACHE_VERSION);
+		if( ret != SQLITE_OK )
+		{
+			DPRINTF(E_WARN, L_METADATA, "Failed to create the details cache in %s\n", path);
+			sql_exec(db, "DETACH CACHE");
+			return -1;
+		}
+	}
+	details_cache = strdup(path);
+	cache_writer = db;
+
+	return 0;
+}
+
+/* Detach metadata.db.  After a complete scan, entries for files that are
+ * no longer in the library are pruned. */
+void
+close_details_cache(sqlite3 *db, int prune)
+{
+	if( !details_cache )
+		return;
+	if( prune )
+		sql_exec(db, "DELETE from CACHE.DETAILS_CACHE where PATH not in (SELECT PATH from main.DETAILS)");
+	sql_exec(db, "DETACH CACHE");
+	free(details_cache);
+	details_cache = NULL;
+	cache_writer = NULL;
+}
+
+/* Each thread looks entries up on a read-only connection of its own */
+void
+close_details_reader(void)
+{
+	if( !cache_db )
+		return;
+	sql_close(cache_db);
+	cache_db = NULL;
+}
+
+static char *
+column_strdup(sqlite3_stmt *stmt, int col)
+{
+	const unsigned char *str = sqlite3_column_text(stmt, col);
+
+	return str ? strdup((const char *)str) : NULL;
+}
+
+/* Fill d from the cache if path hasn't changed since it was last read.
+ * Like Read*Metadata(), this strips the extension from name on success. */
+int
+get_cached_details(enum details_type type, const char *path, char *name, struct file_details *d)
+{
+	sqlite3_stmt *stmt;
+	struct stat file;
+	metadata_t *m = &d->m;
+
+	if( !details_cache )
+		return -1;
+	if( !cache_db && !(cache_db = sql_open(details_cache, 1)) )
+		return -1;
+	if( stat(path, &file) != 0 )
+		return -1;
+	stmt = sql_prepare(cache_db, "SELECT THUMB, ALBUM_ART, TITLE, ARTIST, CREATOR, ALBUM, GENRE, COMMENT,"
+	                             " DATE, DURATION, RESOLUTION, MIME, DLNA_PN,"
+	                             " DISC, TRACK, CHANNELS, BITRATE, FREQUENCY, ROTATION "
+	                             "from DETAILS_CACHE where DEV = ? and INO = ? and PATH = ?"
+	                             " and SIZE = ? and MTIME = ? and TYPE = ?");
+	if( !stmt )
+		return -1;
+	if( sql_bind(stmt, "IIsIIi", (int64_t)file.st_dev, (int64_t)file.st_ino, path,
+	             (int64_t)file.st_size, (int64_t)file.st_mtime, type) != SQLITE_OK ||
+	    sql_step(stmt) != SQLITE_ROW )
+	{
+		sql_release(stmt);
+		return -1;
+	}
+
+	memset(d, '\0', sizeof(*d));
+	d->type = type;
+	d->path = strdup(path);
+	d->size = file.st_size;
+	d->timestamp = file.st_mtime;
+	d->dev = file.st_dev;
+	d->ino = file.st_ino;
+	d->cached = 1;
+	d->thumb = sqlite3_column_int(stmt, 0);
+	d->album_art = column_strdup(stmt, 1);
+	m->title = column_strdup(stmt, 2);
+	m->artist = column_strdup(stmt, 3);
+	m->creator = column_strdup(stmt, 4);
+	m->album = column_strdup(stmt, 5);
+	m->genre = column_strdup(stmt, 6);
+	m->comment = column_strdup(stmt, 7);
+	m->date = column_strdup(stmt, 8);
+	m->duration = column_strdup(stmt, 9);
+	m->resolution = column_strdup(stmt, 10);
+	m->mime = column_strdup(stmt, 11);
+	m->dlna_pn = column_strdup(stmt, 12);
+	m->disc = sqlite3_column_int(stmt, 13);
+	m->track = sqlite3_column_int(stmt, 14);
+	m->channels = sqlite3_column_int(stmt, 15);
+	m->bitrate = sqlite3_column_int(stmt, 16);
+	m->frequency = sqlite3_column_int(stmt, 17);
+	m->rotation = sqlite3_column_int(stmt, 18);
+	d->free_flags = 0xFFFFFFFF;
+	sql_release(stmt);
+
+	/* art extracted into art_cache may have been cleaned out since */
+	if( d->album_art && access(d->album_art, F_OK) != 0 )
+	{
+		free_details(d);
+		return -1;
+	}
+	/* and a cover may have been added next to the file */
+	if( !d->album_art && type != DETAILS_IMAGE )
+		d->album_art = album_art_path(path, NULL, 0);
+	strip_ext(name);
+
+	return 0;
+}
+
+/* Remember what was read from a file, unless it came from the cache
+ * or is only a placeholder */
+void
+cache_details(sqlite3 *db, const struct file_details *d)
+{
+	const metadata_t *m = &d->m;
+
+	if( !details_cache || d->cached || d->pending || db != cache_writer )
+		return;
+	sql_exec_bind(db, "INSERT OR REPLACE into CACHE.DETAILS_CACHE"
+	                  " (DEV, INO, PATH, SIZE, MTIME, TYPE, THUMB, ALBUM_ART, TITLE, ARTIST, CREATOR, ALBUM,"
+	                  "  GENRE, COMMENT, DATE, DURATION, RESOLUTION, MIME, DLNA_PN,"
+	                  "  DISC, TRACK, CHANNELS, BITRATE, FREQUENCY, ROTATION) "
+	                  "VALUES"
+	                  " (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+	                  "IIsIIiissssssssssssiiiiii",
+	                  d->dev, d->ino, d->path, d->size, d->timestamp, d->type, d->thumb, d->album_art,
+	                  m->title, m->artist, m->creator, m->album, m->genre, m->comment, m->date,
+	                  m->duration, m->resolution, m->mime, m->dlna_pn,
+	                  m->disc, m->track, m->channels, m->bitrate, m->frequency, m->rotation);
+}
+
+/* What a full read would most likely find the MIME type to be */
+static const struct {
+	enum details_type type;
+	const char *ext;
+	const char *mime;
+} placeholder_mimes[] = {
+	{ DETAILS_AUDIO, ".mp3", "audio/mpeg" },
+	{ DETAILS_AUDIO, ".m4a", "audio/mp4" },
+	{ DETAILS_AUDIO, ".mp4", "audio/mp4" },
+	{ DETAILS_AUDIO, ".aac", "audio/mp4" },
+	{ DETAILS_AUDIO, ".m4p", "audio/mp4" },
+	{ DETAILS_AUDIO, ".3gp", "audio/3gpp" },
+	{ DETAILS_AUDIO, ".wma", "audio/x-ms-wma" },
+	{ DETAILS_AUDIO, ".asf", "audio/x-ms-wma" },
+	{ DETAILS_AUDIO, ".flac", "audio/x-flac" },
+	{ DETAILS_AUDIO, ".fla", "audio/x-flac" },
+	{ DETAILS_AUDIO, ".flc", "audio/x-flac" },
+	{ DETAILS_AUDIO, ".wav", "audio/x-wav" },
+	{ DETAILS_AUDIO, ".ogg", "audio/ogg" },
+	{ DETAILS_AUDIO, ".pcm", "audio/L16" },
+	{ DETAILS_VIDEO, ".avi", "video/x-msvideo" },
+	{ DETAILS_VIDEO, ".divx", "video/x-msvideo" },
+	{ DETAILS_VIDEO, ".xvid", "video/x-msvideo" },
+	{ DETAILS_VIDEO, ".asf", "video/x-ms-wmv" },
+	{ DETAILS_VIDEO, ".wmv", "video/x-ms-wmv" },
+	{ DETAILS_VIDEO, ".mov", "video/quicktime" },
+	{ DETAILS_VIDEO, ".mp4", "video/mp4" },
+	{ DETAILS_VIDEO, ".m4v", "video/mp4" },
+	{ DETAILS_VIDEO, ".3gp", "video/3gpp" },
+	{ DETAILS_VIDEO, ".mkv", "video/x-matroska" },
+	{ DETAILS_VIDEO, ".flv", "video/x-flv" },
+	{ DETAILS_VIDEO, ".TiVo", "video/x-tivo-mpeg" },
+	{ DETAILS_VIDEO, "", "video/mpeg" },
+	{ DETAILS_IMAGE, "", "image/jpeg" },
+	{ DETAILS_AUDIO, NULL, NULL }
+};
+
+int
+get_placeholder_details(enum details_type type, const char *path, char *name, struct file_details *d)
+{
+	struct stat file;
+	const char *mime = NULL;
+	int i;
+
+	if( stat(path, &file) != 0 )
+		return -1;
+	for( i = 0; placeholder_mimes[i].ext; i++ )
+	{
+		if( placeholder_mimes[i].type == type && ends_with(path, placeholder_mimes[i].ext) )
+		{
+			mime = placeholder_mimes[i].mime;
+			break;
+		}
+	}
+	if( !mime )
+		return -1;
+	strip_ext(name);
+
+	memset(d, '\0', sizeof(*d));
+	d->type = type;
+	d->path = strdup(path);
+	d->size = file.st_size;
+	d->timestamp = file.st_mtime;
+	d->dev = file.st_dev;
+	d->ino = file.st_ino;
+	d->pending = 1;
+	d->m.title = strdup(name);
+	d->m.mime = strdup(mime);
+	d->free_flags = 0xFFFFFFFF;
+
+	return 0;
+}
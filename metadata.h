@@ -24,6 +24,8 @@
 #ifndef __METADATA_H__
 #define __METADATA_H__
 
+#include <sqlite3.h>
+
 typedef struct metadata_s {
 	char *       title;
 	char *       artist;
@@ -76,6 +78,29 @@ typedef enum {
   AAC_HE_L3     = 31, /* Reserved : seems to be HeAAC L3 */
 } aac_object_type_t;
 
+enum details_type {
+	DETAILS_AUDIO,
+	DETAILS_IMAGE,
+	DETAILS_VIDEO
+};
+
+/* Everything read from a media file, ready to be inserted into DETAILS */
+struct file_details {
+	enum details_type type;
+	char *path;
+	int64_t size;
+	int64_t timestamp;
+	int64_t dev;
+	int64_t ino;
+	int cached;		/* came from the details cache */
+	int pending;		/* only a placeholder, until the backfill reads it */
+	int64_t id;		/* the DETAILS row to replace, or 0 for a new one */
+	int thumb;
+	char *album_art;
+	metadata_t m;
+	uint32_t free_flags;
+};
+
 typedef enum {
 	NONE,
 	EMPTY,
@@ -91,13 +116,42 @@ check_for_captions(const char *path, int64_t detailID);
 int64_t
 GetFolderMetadata(const char *name, const char *path, const char *artist, const char *genre, int64_t album_art);
 
-int64_t
-GetAudioMetadata(const char *path, char *name);
+int
+ReadAudioMetadata(const char *path, char *name, struct file_details *d);
 
-int64_t
-GetImageMetadata(const char *path, char *name);
+int
+ReadImageMetadata(const char *path, char *name, struct file_details *d);
+
+int
+ReadVideoMetadata(const char *path, char *name, struct file_details *d);
 
 int64_t
-GetVideoMetadata(const char *path, char *name);
+store_details(struct file_details *d);
+
+void
+free_details(struct file_details *d);
+
+/* The details cache keeps what Read*Metadata() found in every file in
+ * metadata.db, which outlives files.db, so that a rebuild only has to
+ * read files that changed. */
+int
+open_details_cache(sqlite3 *db);
+
+void
+close_details_cache(sqlite3 *db, int prune);
+
+void
+close_details_reader(void);
+
+int
+get_cached_details(enum details_type type, const char *path, char *name, struct file_details *d);
+
+void
+cache_details(sqlite3 *db, const struct file_details *d);
+
+/* Fill d with what can be known without reading path: its size, a title
+ * from its name, and a MIME type from its extension */
+int
+get_placeholder_details(enum details_type type, const char *path, char *name, struct file_details *d);
 
 #endif
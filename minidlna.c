@@ -78,6 +78,7 @@
 
 #include "upnpglobalvars.h"
 #include "sql.h"
+#include "event.h"
 #include "upnphttp.h"
 #include "upnpdescgen.h"
 #include "minidlnapath.h"
@@ -99,7 +100,7 @@
 # warning "Your SQLite3 library appears to be too old!  Please use 3.5.1 or newer."
 # define sqlite3_threadsafe() 0
 #endif
- 
+
 /* OpenAndConfHTTPSocket() :
  * setup the socket used to handle incoming HTTP connections. */
 static int
@@ -266,19 +267,145 @@ open_db(sqlite3 **sq3)
 		new_db = 1;
 		make_dir(db_path, S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO);
 	}
-	if (sqlite3_open(path, &db) != SQLITE_OK)
+	if ((db = sql_open(path, 0)) == NULL)
 		DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to open sqlite database!  Exiting...\n");
 	if (sq3)
 		*sq3 = db;
-	sqlite3_busy_timeout(db, 5000);
-	sql_exec(db, "pragma page_size = 4096");
-	sql_exec(db, "pragma journal_mode = OFF");
-	sql_exec(db, "pragma synchronous = OFF;");
 	sql_exec(db, "pragma default_cache_size = 8192;");
 
 	return new_db;
 }
 
+/* Start a rebuild in files.db.new, so that files.db can be served
+ * until it is done */
+static sqlite3 *
+open_shadow_db(void)
+{
+	static const char *suffix[] = { "-wal", "-shm", "" };
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		snprintf(path, sizeof(path), "%s/files.db.new%s", db_path, suffix[i]);
+		if (unlink(path) != 0 && errno != ENOENT)
+			DPRINTF(E_WARN, L_GENERAL, "Failed to remove %s: %s\n", path, strerror(errno));
+	}
+	if ((db = sql_open(path, 0)) == NULL)
+		DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to open sqlite database!  Exiting...\n");
+	sql_exec(db, "pragma default_cache_size = 8192;");
+	if (CreateDatabase() != 0)
+		DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to create sqlite database!  Exiting...\n");
+
+	return db;
+}
+
+/* The scanner leaves files.db.new as a single file, with no WAL */
+static void
+close_shadow_db(void)
+{
+	sql_exec(db, "pragma journal_mode = DELETE");
+	sql_close(db);
+	db = NULL;
+}
+
+/* Replace files.db with the database the scanner built in files.db.new.
+ * Every connection to the old file is closed first, so that its WAL is
+ * folded in and removed before the new file takes its name. */
+static void
+finish_rebuild(void)
+{
+	char path[PATH_MAX], new_path[PATH_MAX], wal[PATH_MAX];
+	sqlite3 *new_db;
+	int version = -1;
+
+	snprintf(path, sizeof(path), "%s/files.db", db_path);
+	snprintf(new_path, sizeof(new_path), "%s/files.db.new", db_path);
+	snprintf(wal, sizeof(wal), "%s/files.db.new-wal", db_path);
+	if (access(new_path, F_OK) == 0 && (new_db = sql_open(new_path, 1)) != NULL)
+	{
+		version = sql_get_int_field(new_db, "PRAGMA user_version");
+		sql_close(new_db);
+	}
+	if (version != DB_VERSION || access(wal, F_OK) == 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Database rebuild did not finish; keeping the old one\n");
+		rebuilding = 0;
+		return;
+	}
+
+	upnpsoap_suspend_workers();
+	sql_close(db);
+	if (rename(new_path, path) != 0)
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to replace %s: %s\n", path, strerror(errno));
+	else
+		DPRINTF(E_WARN, L_GENERAL, "Database rebuild completed; now serving the new one\n");
+	open_db(NULL);
+	upnpsoap_resume_workers();
+	/* inotify waits for this before it opens files.db */
+	rebuilding = 0;
+
+	updateID++;
+	upnp_event_var_change_notify(EContentDirectory);
+	/* in case the scanner could not build it */
+	update_search_index();
+}
+
+/* Whether changed media_dirs can be reconciled in place: every media_dir
+ * must have had its own level in the ContentDirectory, and still will */
+static int
+can_rescan(sqlite3 *db)
+{
+	if (GETFLAG(MERGE_MEDIA_DIRS_MASK) || !media_dirs || !media_dirs->next)
+		return 0;
+	if (sql_get_int_field(db, "PRAGMA user_version") != DB_VERSION)
+		return 0;
+	return sql_get_int_field(db, "SELECT count(*) from SETTINGS s where KEY = 'media_dir'"
+	                             " and not exists (SELECT 1 from OBJECTS o join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                             " where d.PATH = s.VALUE and o.PARENT_ID = '%s')", BROWSEDIR_ID) == 0;
+}
+
+/* Whether the database holds a scan that was cut short, and that can
+ * pick up where it stopped with the current media_dirs */
+static int
+can_resume(sqlite3 *db)
+{
+	char **result;
+	struct media_dir_s *media_path;
+	int i, rows = 0, ret = 1;
+
+	if (!media_dirs || sql_get_int_field(db, "PRAGMA user_version") != 0 ||
+	    sql_get_int_field(db, "SELECT count(*) from SETTINGS where KEY = 'scan_checkpoint'") <= 0)
+		return 0;
+	/* a single media_dir is right in Browse Folders */
+	if (GETFLAG(MERGE_MEDIA_DIRS_MASK) || !media_dirs->next)
+	{
+		if (media_dirs->next)
+			return 0;
+		return sql_get_int_field(db, "SELECT count(*) from DETAILS where PATH = %Q and TIMESTAMP = %d",
+		                         media_dirs->path, media_dirs->types) > 0 &&
+		       sql_get_int_field(db, "SELECT count(*) from OBJECTS o join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                             " where o.PARENT_ID = '%s' and not (d.PATH > '%q/' and d.PATH < '%q0')",
+		                         BROWSEDIR_ID, media_dirs->path, media_dirs->path) == 0;
+	}
+	/* otherwise each one has its own level there */
+	if (sql_get_table(db, "SELECT d.PATH from OBJECTS o join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                      " where o.PARENT_ID = '" BROWSEDIR_ID "'", &result, &rows, NULL) != SQLITE_OK)
+		return 0;
+	for (i = 1; i <= rows && ret; i++)
+	{
+		for (media_path = media_dirs; media_path; media_path = media_path->next)
+			if (result[i] && strcmp(result[i], media_path->path) == 0)
+				break;
+		if (!media_path && (!result[i] ||
+		    sql_get_int_field(db, "SELECT count(*) from SETTINGS where KEY = 'media_dir' and VALUE = %Q", result[i]) <= 0))
+			ret = 0;
+	}
+	sqlite3_free_table(result);
+
+	return ret;
+}
+
 static void
 check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 {
@@ -286,7 +413,7 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 	char cmd[PATH_MAX*2];
 	char **result;
 	int i, rows = 0;
-	int ret;
+	int ret, incremental = 0;
 
 	if (!new_db)
 	{
@@ -327,6 +454,11 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 	if (ret != 0)
 	{
 rescan:
+		if (!new_db && can_resume(db))
+		{
+			incremental = 1;
+			goto scan;
+		}
 		if (ret < 0)
 			DPRINTF(E_WARN, L_GENERAL, "Creating new database at %s/files.db\n", db_path);
 		else if (ret == 1)
@@ -336,24 +468,54 @@ rescan:
 		else
 			DPRINTF(E_WARN, L_GENERAL, "Database version mismatch (%d=>%d); need to recreate...\n",
 				ret, DB_VERSION);
-		sqlite3_close(db);
+		if ((ret == 1 || ret == 2) && can_rescan(db))
+		{
+			incremental = 1;
+			goto scan;
+		}
+#if USE_FORK
+		/* Keep serving a database this version can read until the new one is ready */
+		if (sql_get_int_field(db, "PRAGMA user_version") == DB_VERSION)
+		{
+			DPRINTF(E_WARN, L_GENERAL, "Building the new database in %s/files.db.new\n", db_path);
+			rebuilding = 1;
+			goto scan;
+		}
+#endif
+		sql_close(db);
 
-		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+		/* art_cache and metadata.db are kept, so that files which have
+		 * not changed don't need to be read again; the scan prunes them */
+		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm",
+			db_path, db_path, db_path);
 		if (system(cmd) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache!  Exiting...\n");
 
 		open_db(&db);
 		if (CreateDatabase() != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to create sqlite database!  Exiting...\n");
+scan:
 #if USE_FORK
-		scanning = 1;
-		sqlite3_close(db);
+		if (!rebuilding)
+			scanning = 1;
+		sql_close(db);
 		*scanner_pid = fork();
 		open_db(&db);
 		if (*scanner_pid == 0) /* child (scanner) process */
 		{
-			start_scanner();
-			sqlite3_close(db);
+			if (rebuilding)
+			{
+				sql_close(db);
+				db = open_shadow_db();
+			}
+			if (incremental)
+				start_rescan();
+			else
+				start_scanner();
+			if (rebuilding)
+				close_shadow_db();
+			else
+				sql_close(db);
 			log_close();
 			freeoptions();
 			free(children);
@@ -361,12 +523,36 @@ rescan:
 		}
 		else if (*scanner_pid < 0)
 		{
-			start_scanner();
+			if (rebuilding)
+			{
+				sql_close(db);
+				db = open_shadow_db();
+			}
+			if (incremental)
+				start_rescan();
+			else
+				start_scanner();
+			if (rebuilding)
+			{
+				close_shadow_db();
+				finish_rebuild();
+			}
 		}
 #else
-		start_scanner();
+		if (incremental)
+			start_rescan();
+		else
+			start_scanner();
 #endif
 	}
+	else
+	{
+		/* Catch container child counts that have drifted */
+		ret = update_child_counts(NULL);
+		if (ret > 0)
+			DPRINTF(E_WARN, L_GENERAL, "Repaired the child count of %d containers\n", ret);
+		update_search_index();
+	}
 }
 
 static int
@@ -521,6 +707,12 @@ init(int argc, char **argv)
 	runtime_vars.root_container = NULL;
 	runtime_vars.ifaces[0] = NULL;
 	runtime_vars.password_length = 4;
+	runtime_vars.soap_threads = 4;
+	runtime_vars.browse_cache_size = 2048;
+	runtime_vars.scan_batch = 500;
+	runtime_vars.scan_threads = 0;
+	runtime_vars.scan_device_threads = 0;
+	runtime_vars.scan_io_budget = 5;
 
 	/* read options file first since
 	 * command line arguments have final say */
@@ -728,6 +920,24 @@ init(int argc, char **argv)
 		case MAX_CONNECTIONS:
 			runtime_vars.max_connections = atoi(ary_options[i].value);
 			break;
+		case SOAP_THREADS:
+			runtime_vars.soap_threads = atoi(ary_options[i].value);
+			break;
+		case BROWSE_CACHE_SIZE:
+			runtime_vars.browse_cache_size = atoi(ary_options[i].value);
+			break;
+		case SCAN_BATCH:
+			runtime_vars.scan_batch = atoi(ary_options[i].value);
+			break;
+		case SCAN_THREADS:
+			runtime_vars.scan_threads = atoi(ary_options[i].value);
+			break;
+		case SCAN_DEVICE_THREADS:
+			runtime_vars.scan_device_threads = atoi(ary_options[i].value);
+			break;
+		case SCAN_IO_BUDGET:
+			runtime_vars.scan_io_budget = atoi(ary_options[i].value);
+			break;
 		case MERGE_MEDIA_DIRS:
 			if (strtobool(ary_options[i].value))
 				SETFLAG(MERGE_MEDIA_DIRS_MASK);
@@ -736,6 +946,14 @@ init(int argc, char **argv)
 			if (strtobool(ary_options[i].value))
 				SETFLAG(WIDE_LINKS_MASK);
 			break;
+		case SEARCH_INDEX:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(SEARCH_INDEX_MASK);
+			break;
+		case LAZY_METADATA:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(LAZY_METADATA_MASK);
+			break;
 		default:
 			DPRINTF(E_ERROR, L_GENERAL, "Unknown option in file %s\n",
 				optionsfile);
@@ -836,7 +1054,13 @@ init(int argc, char **argv)
 			runtime_vars.port = -1; // triggers help display
 			break;
 		case 'R':
-			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm %s/art_cache",
+				db_path, db_path, db_path, db_path);
+			if (system(buf) != 0)
+				DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache. EXITING\n");
+			/* a forced rebuild reads every file again */
+			snprintf(buf, sizeof(buf), "rm -f %s/metadata.db %s/metadata.db-wal %s/metadata.db-shm",
+				db_path, db_path, db_path);
 			if (system(buf) != 0)
 				DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache. EXITING\n");
 			break;
@@ -987,10 +1211,63 @@ init(int argc, char **argv)
 		DPRINTF(E_ERROR, L_GENERAL, "Allocation failed\n");
 		return 1;
 	}
+	/* before any scanner is forked */
+	scan_io_init();
 
 	return 0;
 }
 
+/* Accept every pending connection; the listening socket is reported
+ * only once per burst when the backend is edge-triggered. */
+static void
+ProcessListen(struct event *ev)
+{
+	int shttp;
+	socklen_t clientnamelen;
+	struct sockaddr_in clientname;
+	struct upnphttp * tmp;
+
+	while (event_readable(ev->fd))
+	{
+		clientnamelen = sizeof(struct sockaddr_in);
+		shttp = accept(ev->fd, (struct sockaddr *)&clientname, &clientnamelen);
+		if (shttp < 0)
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
+			break;
+		}
+		DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
+			inet_ntoa(clientname.sin_addr),
+			ntohs(clientname.sin_port) );
+		/* Create a new upnphttp object and add it to
+		 * the active upnphttp object list */
+		tmp = New_upnphttp(shttp);
+		if (tmp)
+			tmp->clientaddr = clientname.sin_addr;
+		else
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
+			close(shttp);
+		}
+	}
+}
+
+static void
+ProcessMonitor(struct event *ev)
+{
+	while (event_readable(ev->fd))
+		ProcessMonitorEvent(ev->fd);
+}
+
+#ifdef TIVO_SUPPORT
+static void
+ProcessBeacon(struct event *ev)
+{
+	while (event_readable(ev->fd))
+		ProcessTiVoBeacon(ev->fd);
+}
+#endif
+
 /* === main === */
 /* process HTTP or SSDP requests */
 int
@@ -999,15 +1276,13 @@ main(int argc, char **argv)
 	int ret, i;
 	int shttpl = -1;
 	int smonitor = -1;
-	LIST_HEAD(httplisthead, upnphttp) upnphttphead;
-	struct upnphttp * e = 0;
-	struct upnphttp * next;
-	fd_set readset;	/* for select() */
-	fd_set writeset;
+	int nhttp;
+	struct event ev_http, ev_monitor;
 	struct timeval timeout, timeofday, lastnotifytime = {0, 0};
 	time_t lastupdatetime = 0;
-	int max_fd = -1;
-	int last_changecnt = 0;
+	int msec;
+	unsigned int last_changecnt = 0;
+	unsigned int last_checkpoint = 0;
 	pid_t scanner_pid = 0;
 	pthread_t inotify_thread = 0;
 #ifdef TIVO_SUPPORT
@@ -1015,6 +1290,7 @@ main(int argc, char **argv)
 	int sbeacon = -1;
 	struct sockaddr_in tivo_bcast;
 	struct timeval lastbeacontime = {0, 0};
+	struct event ev_beacon;
 #endif
 
 	for (i = 0; i < L_MAX; i++)
@@ -1031,8 +1307,6 @@ main(int argc, char **argv)
 		DPRINTF(E_WARN, L_GENERAL, "SQLite library is old.  Please use version 3.5.1 or newer.\n");
 	}
 
-	LIST_INIT(&upnphttphead);
-
 	ret = open_db(NULL);
 	if (ret == 0)
 	{
@@ -1041,6 +1315,8 @@ main(int argc, char **argv)
 			ret = -1;
 	}
 	check_db(db, ret, &scanner_pid);
+	if (!scanning && !rebuilding)
+		start_backfill();
 #ifdef HAVE_INOTIFY
 	if( GETFLAG(INOTIFY_MASK) )
 	{
@@ -1051,7 +1327,15 @@ main(int argc, char **argv)
 			DPRINTF(E_FATAL, L_GENERAL, "ERROR: pthread_create() failed for start_inotify. EXITING\n");
 	}
 #endif
+	if (event_module.init() != 0)
+		DPRINTF(E_FATAL, L_GENERAL, "Failed to initialize event module. EXITING\n");
+
 	smonitor = OpenAndConfMonitorSocket();
+	if (smonitor >= 0)
+	{
+		ev_monitor = (struct event){ .fd = smonitor, .rdwr = EVENT_READ, .process = ProcessMonitor };
+		event_module.add(&ev_monitor);
+	}
 
 	sssdp = OpenAndConfSSDPReceiveSocket();
 	if (sssdp < 0)
@@ -1066,6 +1350,11 @@ main(int argc, char **argv)
 	if (shttpl < 0)
 		DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
 	DPRINTF(E_WARN, L_GENERAL, "HTTP listening on port %d\n", runtime_vars.port);
+	ev_http = (struct event){ .fd = shttpl, .rdwr = EVENT_READ, .process = ProcessListen };
+	if (event_module.add(&ev_http) != 0)
+		DPRINTF(E_FATAL, L_GENERAL, "Failed to add HTTP socket to event module. EXITING\n");
+	if (upnpsoap_start_workers(runtime_vars.soap_threads) != 0)
+		DPRINTF(E_ERROR, L_GENERAL, "SOAP actions will run on the main thread.\n");
 
 #ifdef TIVO_SUPPORT
 	if (GETFLAG(TIVO_MASK))
@@ -1083,6 +1372,8 @@ main(int argc, char **argv)
 		tivo_bcast.sin_family = AF_INET;
 		tivo_bcast.sin_addr.s_addr = htonl(getBcastAddress());
 		tivo_bcast.sin_port = htons(2190);
+		ev_beacon = (struct event){ .fd = sbeacon, .rdwr = EVENT_READ, .process = ProcessBeacon };
+		event_module.add(&ev_beacon);
 	}
 #endif
 
@@ -1151,159 +1442,72 @@ main(int argc, char **argv)
 #endif
 		}
 
-		if (scanning)
+		if (scanning || rebuilding)
 		{
 			if (!scanner_pid || kill(scanner_pid, 0) != 0)
 			{
-				scanning = 0;
-				updateID++;
-			}
-		}
-
-		/* select open sockets (SSDP, HTTP listen, and all HTTP soap sockets) */
-		FD_ZERO(&readset);
-
-		if (sssdp >= 0) 
-		{
-			FD_SET(sssdp, &readset);
-			max_fd = MAX(max_fd, sssdp);
-		}
-		
-		if (shttpl >= 0) 
-		{
-			FD_SET(shttpl, &readset);
-			max_fd = MAX(max_fd, shttpl);
-		}
-#ifdef TIVO_SUPPORT
-		if (sbeacon >= 0) 
-		{
-			FD_SET(sbeacon, &readset);
-			max_fd = MAX(max_fd, sbeacon);
-		}
-#endif
-		if (smonitor >= 0) 
-		{
-			FD_SET(smonitor, &readset);
-			max_fd = MAX(max_fd, smonitor);
-		}
-
-		i = 0;	/* active HTTP connections count */
-		for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
-		{
-			if ((e->socket >= 0) && (e->state <= 2))
-			{
-				FD_SET(e->socket, &readset);
-				max_fd = MAX(max_fd, e->socket);
-				i++;
+				if (rebuilding)
+					finish_rebuild();
+				else
+				{
+					scanning = 0;
+					updateID++;
+					/* in case the scanner could not build it */
+					update_search_index();
+				}
+				start_backfill();
 			}
 		}
-		FD_ZERO(&writeset);
-		upnpevents_selectfds(&readset, &writeset, &max_fd);
 
-		ret = select(max_fd+1, &readset, &writeset, 0, &timeout);
-		if (ret < 0)
+		/* close idle persistent connections, and make sure we wake up
+		 * in time to close the ones still open */
+		nhttp = Expire_upnphttp(HTTP_KEEPALIVE_TIMEOUT);
+
+		/* wait for and dispatch socket events (SSDP, HTTP listen,
+		 * HTTP clients, event notifications) */
+		msec = timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
+		if (msec < 0)
+			msec = 0;
+		if (nhttp && msec > HTTP_KEEPALIVE_TIMEOUT * 1000)
+			msec = HTTP_KEEPALIVE_TIMEOUT * 1000;
+		if (event_module.process(msec) != 0)
 		{
 			if(quitting) goto shutdown;
 			if(errno == EINTR) continue;
-			DPRINTF(E_ERROR, L_GENERAL, "select(all): %s\n", strerror(errno));
-			DPRINTF(E_FATAL, L_GENERAL, "Failed to select open sockets. EXITING\n");
-		}
-		upnpevents_processfds(&readset, &writeset);
-		/* process SSDP packets */
-		if (sssdp >= 0 && FD_ISSET(sssdp, &readset))
-		{
-			/*DPRINTF(E_DEBUG, L_GENERAL, "Received SSDP Packet\n");*/
-			ProcessSSDPRequest(sssdp, (unsigned short)runtime_vars.port);
-		}
-#ifdef TIVO_SUPPORT
-		if (sbeacon >= 0 && FD_ISSET(sbeacon, &readset))
-		{
-			/*DPRINTF(E_DEBUG, L_GENERAL, "Received UDP Packet\n");*/
-			ProcessTiVoBeacon(sbeacon);
-		}
-#endif
-		if (smonitor >= 0 && FD_ISSET(smonitor, &readset))
-		{
-			ProcessMonitorEvent(smonitor);
+			DPRINTF(E_ERROR, L_GENERAL, "event_module.process(): %s\n", strerror(errno));
+			DPRINTF(E_FATAL, L_GENERAL, "Failed to wait for events. EXITING\n");
 		}
+		upnpevents_gc();
 		/* increment SystemUpdateID if the content database has changed,
 		 * and if there is an active HTTP connection, at most once every 2 seconds */
-		if (i && (timeofday.tv_sec >= (lastupdatetime + 2)))
+		if (nhttp && (timeofday.tv_sec >= (lastupdatetime + 2)))
 		{
-			if (scanning || sqlite3_total_changes(db) != last_changecnt)
+			if (scanning || sql_commits != last_changecnt)
 			{
 				updateID++;
-				last_changecnt = sqlite3_total_changes(db);
+				last_changecnt = sql_commits;
 				upnp_event_var_change_notify(EContentDirectory);
 				lastupdatetime = timeofday.tv_sec;
 			}
 		}
-		/* process active HTTP connections */
-		for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
+		/* fold inotify's updates back into files.db while nobody is browsing */
+		else if (!nhttp && !scanning && sql_commits != last_checkpoint)
 		{
-			if ((e->socket >= 0) && (e->state <= 2) && (FD_ISSET(e->socket, &readset)))
-				Process_upnphttp(e);
-		}
-		/* process incoming HTTP connections */
-		if (shttpl >= 0 && FD_ISSET(shttpl, &readset))
-		{
-			int shttp;
-			socklen_t clientnamelen;
-			struct sockaddr_in clientname;
-			clientnamelen = sizeof(struct sockaddr_in);
-			shttp = accept(shttpl, (struct sockaddr *)&clientname, &clientnamelen);
-			if (shttp<0)
-			{
-				DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
-			}
-			else
-			{
-				struct upnphttp * tmp = 0;
-				DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
-					inet_ntoa(clientname.sin_addr),
-					ntohs(clientname.sin_port) );
-				/*if (fcntl(shttp, F_SETFL, O_NONBLOCK) < 0) {
-					DPRINTF(E_ERROR, L_GENERAL, "fcntl F_SETFL, O_NONBLOCK\n");
-				}*/
-				/* Create a new upnphttp object and add it to
-				 * the active upnphttp object list */
-				tmp = New_upnphttp(shttp);
-				if (tmp)
-				{
-					tmp->clientaddr = clientname.sin_addr;
-					LIST_INSERT_HEAD(&upnphttphead, tmp, entries);
-				}
-				else
-				{
-					DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
-					close(shttp);
-				}
-			}
-		}
-		/* delete finished HTTP connections */
-		for (e = upnphttphead.lh_first; e != NULL; e = next)
-		{
-			next = e->entries.le_next;
-			if(e->state >= 100)
-			{
-				LIST_REMOVE(e, entries);
-				Delete_upnphttp(e);
-			}
+			last_checkpoint = sql_commits;
+			sql_checkpoint(db, 0);
 		}
 	}
 
 shutdown:
 	/* kill the scanner */
-	if (scanning && scanner_pid)
+	if ((scanning || rebuilding) && scanner_pid)
 		kill(scanner_pid, SIGKILL);
 
+	/* wait for running SOAP actions before closing their connections */
+	upnpsoap_stop_workers();
+
 	/* close out open sockets */
-	while (upnphttphead.lh_first != NULL)
-	{
-		e = upnphttphead.lh_first;
-		LIST_REMOVE(e, entries);
-		Delete_upnphttp(e);
-	}
+	Expire_upnphttp(0);
 	if (sssdp >= 0)
 		close(sssdp);
 	if (shttpl >= 0)
@@ -1314,6 +1518,7 @@ shutdown:
 #endif
 	if (smonitor >= 0)
 		close(smonitor);
+	event_module.fini();
 	
 	for (i = 0; i < n_lan_addr; i++)
 	{
@@ -1323,13 +1528,14 @@ shutdown:
 
 	if (inotify_thread)
 		pthread_join(inotify_thread, NULL);
+	stop_backfill();
 
 	/* kill other child processes */
 	process_reap_children();
 	free(children);
 
 	sql_exec(db, "UPDATE SETTINGS set VALUE = '%u' where KEY = 'UPDATE_ID'", updateID);
-	sqlite3_close(db);
+	sql_close(db);
 
 	upnpevents_removeSubscribers();
 
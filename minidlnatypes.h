@@ -50,6 +50,12 @@ struct runtime_vars_s {
 	int notify_interval;	/* seconds between SSDP announces */
 	int max_connections;	/* max number of simultaneous conenctions */
 	int password_length;	/* Password Length */
+	int soap_threads;	/* Browse/Search worker threads */
+	int browse_cache_size;	/* Browse/Search response cache, in KiB */
+	int scan_batch;	/* files per scanner transaction */
+	int scan_threads;	/* scanner metadata threads, 0 for one per CPU */
+	int scan_device_threads;	/* files read at once from each disk, 0 for no limit */
+	int scan_io_budget;	/* files read a second while streaming, 0 to wait */
 	const char *root_container;	/* root ObjectID (instead of "0") */
 	const char *ifaces[MAX_LAN_ADDR];	/* list of configured network interfaces */
 };
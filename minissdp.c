@@ -42,6 +42,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 
+#include "event.h"
 #include "minidlnapath.h"
 #include "upnphttp.h"
 #include "upnpglobalvars.h"
@@ -88,6 +89,15 @@ AddMulticastMembership(int s, struct lan_addr_s *iface)
 	return 0;
 }
 
+static struct event ssdpev;
+
+static void
+ProcessSSDPEvent(struct event *ev)
+{
+	while (event_readable(ev->fd))
+		ProcessSSDPRequest(ev->fd, (unsigned short)runtime_vars.port);
+}
+
 /* Open and configure the socket listening for 
  * SSDP udp packets sent on 239.255.255.250 port 1900 */
 int
@@ -126,6 +136,13 @@ OpenAndConfSSDPReceiveSocket(void)
 		return -1;
 	}
 
+	ssdpev = (struct event){ .fd = s, .rdwr = EVENT_READ, .process = ProcessSSDPEvent };
+	if (event_module.add(&ssdpev) != 0)
+	{
+		close(s);
+		return -1;
+	}
+
 	return s;
 }
 
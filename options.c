@@ -66,7 +66,15 @@ static const struct {
 	{ MAX_CONNECTIONS, "max_connections" },
 	{ MERGE_MEDIA_DIRS, "merge_media_dirs" },
 	{ WIDE_LINKS, "wide_links" },
-	{ PASSWORD_LENGTH, "password_length" }
+	{ PASSWORD_LENGTH, "password_length" },
+	{ SOAP_THREADS, "soap_threads" },
+	{ BROWSE_CACHE_SIZE, "browse_cache_size" },
+	{ SEARCH_INDEX, "search_index" },
+	{ SCAN_BATCH, "scan_batch" },
+	{ SCAN_THREADS, "scan_threads" },
+	{ SCAN_DEVICE_THREADS, "scan_device_threads" },
+	{ LAZY_METADATA, "lazy_metadata" },
+	{ SCAN_IO_BUDGET, "scan_io_budget" }
 };
 
 int
@@ -59,7 +59,15 @@ enum upnpconfigoptions {
 	MAX_CONNECTIONS,		/* maximum number of simultaneous connections */
 	MERGE_MEDIA_DIRS,		/* don't add an extra directory level when there are multiple media dirs */
 	WIDE_LINKS,			/* allow following symlinks outside the defined media_dirs */
-	PASSWORD_LENGTH			/* Password */
+	PASSWORD_LENGTH,		/* Password */
+	SOAP_THREADS,			/* number of threads answering Browse and Search */
+	BROWSE_CACHE_SIZE,		/* kilobytes of Browse and Search responses to cache */
+	SEARCH_INDEX,			/* keep a full-text index for Search */
+	SCAN_BATCH,			/* files the scanner inserts per transaction */
+	SCAN_THREADS,			/* threads reading metadata during the scan */
+	SCAN_DEVICE_THREADS,		/* files read at once from each disk during the scan */
+	LAZY_METADATA,			/* list files first, and read their metadata afterwards */
+	SCAN_IO_BUDGET			/* files the scanner reads a second while streaming */
 };
 
 /* readoptionsfile()
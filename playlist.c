@@ -214,10 +214,10 @@ found:
 				             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME, REF_ID) "
 				             "SELECT"
 				             " '%s$%llX$%d', '%s$%llX', CLASS, DETAIL_ID, NAME, OBJECT_ID from OBJECTS"
-				             " where DETAIL_ID = %lld and OBJECT_ID glob '" BROWSEDIR_ID "$*'",
+				             " where DETAIL_ID = %lld and " SUBTREE_SQL,
 				             MUSIC_PLIST_ID, plID, plist.track,
 				             MUSIC_PLIST_ID, plID,
-				             detailID);
+				             detailID, BROWSEDIR_ID, BROWSEDIR_ID);
 				if( !last_dir )
 				{
 					last_dir = sql_get_text_field(db, "SELECT PATH from DETAILS where ID = %lld", detailID);
@@ -254,6 +254,7 @@ found:
 		}
 		sql_exec(db, "UPDATE PLAYLISTS set FOUND = %d where ID = %lld", found, plID);
 	}
+	update_child_counts(MUSIC_PLIST_ID);
 done:
 	sqlite3_free_table(result);
 	DPRINTF(E_WARN, L_SCANNER, "Finished parsing playlists.\n");
@@ -18,7 +18,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <errno.h>
 #include <dirent.h>
 #include <locale.h>
 #include <libgen.h>
@@ -27,6 +29,10 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "config.h"
 
@@ -45,6 +51,7 @@
 #include "scanner.h"
 #include "albumart.h"
 #include "containers.h"
+#include "uuid.h"
 #include "log.h"
 
 #if SCANDIR_CONST
@@ -58,6 +65,15 @@ typedef struct dirent scan_filter;
 
 int valid_cache = 0;
 
+/* A media file read by read_file(), waiting for store_file() */
+struct file_entry
+{
+	char class[32];
+	char base[8];
+	int playlist;
+	struct file_details details;
+};
+
 struct virtual_item
 {
 	int64_t objectID;
@@ -65,15 +81,235 @@ struct virtual_item
 	char name[256];
 };
 
+/* While the initial scan runs, the next free child index of every parent
+ * and the index of every container are kept in memory, so that
+ * get_next_available_id() and insert_container() don't query the database
+ * for each file.  Both maps are seeded from the database when the scan
+ * starts, and insert_object() keeps them up to date. */
+struct scan_map_entry
+{
+	struct scan_map_entry *next;
+	unsigned int hash;
+	size_t keylen;
+	int64_t value;
+	char key[];
+};
+
+struct scan_map
+{
+	struct scan_map_entry **buckets;
+	unsigned int size;
+	unsigned int count;
+};
+
+static struct scan_map next_ids;	/* parent ObjectID => next child index */
+static struct scan_map container_ids;	/* container_key() => container index */
+static int scan_maps = 0;
+
+static unsigned int
+scan_map_hash(const char *key, size_t len)
+{
+	unsigned int hash = 2166136261u;
+
+	while( len-- )
+		hash = (hash ^ (unsigned char)*key++) * 16777619u;
+
+	return hash;
+}
+
+static void
+scan_map_grow(struct scan_map *map)
+{
+	struct scan_map_entry **buckets, *e, *next;
+	unsigned int size, i;
+
+	size = map->size ? map->size * 2 : 1024;
+	buckets = calloc(size, sizeof(*buckets));
+	if( !buckets )
+		return;
+	for( i = 0; i < map->size; i++ )
+	{
+		for( e = map->buckets[i]; e; e = next )
+		{
+			next = e->next;
+			e->next = buckets[e->hash % size];
+			buckets[e->hash % size] = e;
+		}
+	}
+	free(map->buckets);
+	map->buckets = buckets;
+	map->size = size;
+}
+
+static struct scan_map_entry *
+scan_map_find(struct scan_map *map, const char *key, size_t len)
+{
+	struct scan_map_entry *e;
+	unsigned int hash;
+
+	if( !map->size )
+		return NULL;
+	hash = scan_map_hash(key, len);
+	for( e = map->buckets[hash % map->size]; e; e = e->next )
+		if( e->hash == hash && e->keylen == len && memcmp(e->key, key, len) == 0 )
+			return e;
+
+	return NULL;
+}
+
+static void
+scan_map_set(struct scan_map *map, const char *key, size_t len, int64_t value)
+{
+	struct scan_map_entry *e;
+	unsigned int hash;
+
+	if( (e = scan_map_find(map, key, len)) )
+	{
+		e->value = value;
+		return;
+	}
+	if( map->count >= map->size * 2 )
+		scan_map_grow(map);
+	if( !map->size || !(e = malloc(sizeof(*e) + len)) )
+	{
+		/* the database still has it; stop trusting the maps */
+		scan_maps = 0;
+		return;
+	}
+	hash = scan_map_hash(key, len);
+	e->hash = hash;
+	e->keylen = len;
+	e->value = value;
+	memcpy(e->key, key, len);
+	e->next = map->buckets[hash % map->size];
+	map->buckets[hash % map->size] = e;
+	map->count++;
+}
+
+static void
+scan_map_clear(struct scan_map *map)
+{
+	struct scan_map_entry *e, *next;
+	unsigned int i;
+
+	for( i = 0; i < map->size; i++ )
+	{
+		for( e = map->buckets[i]; e; e = next )
+		{
+			next = e->next;
+			free(e);
+		}
+	}
+	free(map->buckets);
+	memset(map, 0, sizeof(*map));
+}
+
+/* insert_container() matches names and artists with LIKE, so the key folds
+ * ASCII case the way LIKE does.  Returns 0 if the key doesn't fit. */
+static size_t
+container_key(char *buf, size_t size, const char *parent, const char *name,
+              const char *artist, const char *class)
+{
+	const char *fields[4] = { class, parent, name, artist };
+	size_t len = 0;
+	int i;
+
+	for( i = 0; i < 4; i++ )
+	{
+		const char *p = fields[i];
+
+		if( !p )
+			p = "\x01";	/* NULL artist */
+		do {
+			if( len >= size )
+				return 0;
+			buf[len++] = (i >= 2 && *p >= 'A' && *p <= 'Z') ? *p + 'a' - 'A' : *p;
+		} while( *p++ );
+	}
+
+	return len;
+}
+
+static int64_t
+child_index(const char *objectID)
+{
+	const char *base = strrchr(objectID, '$');
+
+	return base ? strtoll(base+1, NULL, 16) : -1;
+}
+
+static void
+scan_maps_start(void)
+{
+	sqlite3_stmt *stmt;
+	char key[1024];
+	size_t len;
+	const char *id;
+
+	scan_maps = 1;
+	if( sqlite3_prepare_v2(db, "SELECT PARENT_ID, OBJECT_ID from OBJECTS where ID in"
+	                           " (SELECT max(ID) from OBJECTS group by PARENT_ID)",
+	                       -1, &stmt, NULL) != SQLITE_OK )
+		goto error;
+	while( sqlite3_step(stmt) == SQLITE_ROW )
+	{
+		id = (const char *)sqlite3_column_text(stmt, 0);
+		if( id )
+			scan_map_set(&next_ids, id, strlen(id) + 1,
+			             child_index((const char *)sqlite3_column_text(stmt, 1)) + 1);
+	}
+	sqlite3_finalize(stmt);
+
+	if( sqlite3_prepare_v2(db, "SELECT o.PARENT_ID, o.NAME, d.ARTIST, o.CLASS, o.OBJECT_ID"
+	                           " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+	                           " where o.CLASS glob 'container.*'",
+	                       -1, &stmt, NULL) != SQLITE_OK )
+		goto error;
+	while( sqlite3_step(stmt) == SQLITE_ROW )
+	{
+		len = container_key(key, sizeof(key),
+		                    (const char *)sqlite3_column_text(stmt, 0),
+		                    (const char *)sqlite3_column_text(stmt, 1),
+		                    (const char *)sqlite3_column_text(stmt, 2),
+		                    (const char *)sqlite3_column_text(stmt, 3));
+		if( len )
+			scan_map_set(&container_ids, key, len,
+			             child_index((const char *)sqlite3_column_text(stmt, 4)));
+	}
+	sqlite3_finalize(stmt);
+	DPRINTF(E_DEBUG, L_SCANNER, "Scanning with %u parents and %u containers in memory\n",
+		next_ids.count, container_ids.count);
+	return;
+error:
+	DPRINTF(E_ERROR, L_SCANNER, "Failed to load object IDs: %s\n", sqlite3_errmsg(db));
+	scan_maps = 0;
+}
+
+static void
+scan_maps_stop(void)
+{
+	scan_maps = 0;
+	scan_map_clear(&next_ids);
+	scan_map_clear(&container_ids);
+}
+
 int64_t
 get_next_available_id(const char *table, const char *parentID)
 {
-		char *ret, *base;
+		char *ret, *base, sql[128];
 		int64_t objectID = 0;
 
-		ret = sql_get_text_field(db, "SELECT OBJECT_ID from %s where ID = "
-		                             "(SELECT max(ID) from %s where PARENT_ID = '%s')",
-		                             table, table, parentID);
+		if( scan_maps && strcmp(table, "OBJECTS") == 0 )
+		{
+			struct scan_map_entry *e;
+
+			e = scan_map_find(&next_ids, parentID, strlen(parentID) + 1);
+			return e ? e->value : 0;
+		}
+		sqlite3_snprintf(sizeof(sql), sql, "SELECT OBJECT_ID from %s where ID = "
+		                                   "(SELECT max(ID) from %s where PARENT_ID = ?)",
+		                                   table, table);
+		ret = sql_get_text_bind(db, sql, "s", parentID);
 		if( ret )
 		{
 			base = strrchr(ret, '$');
@@ -85,21 +321,182 @@ get_next_available_id(const char *table, const char *parentID)
 		return objectID;
 }
 
+/* CHILD_COUNT holds the number of children a container has that need no
+ * password.  The initial scan fills it in once at the end instead of
+ * updating it for every row. */
+#define PUBLIC_CHILDREN "(SELECT count(*) from OBJECTS c where c.PARENT_ID = OBJECTS.OBJECT_ID" \
+                        " and (c.PASSWORD is null or c.PASSWORD = ''))"
+
+static int defer_child_counts = 0;
+
+/* DETAILS columns in the optional full-text index, DETAILS_FTS */
+#define FTS_COLUMNS "TITLE, ARTIST, ALBUM, CREATOR"
+#define FTS_VALUES(row) row".TITLE, "row".ARTIST, "row".ALBUM, "row".CREATOR"
+
+static int
+insert_object(const char *objectID, const char *parentID, const char *refID, const char *class,
+              int64_t detailID, const char *name, const char *password)
+{
+	int ret;
+
+	ret = sql_exec_bind(db, "INSERT into OBJECTS"
+	                        " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
+	                        "VALUES (?, ?, ?, ?, ?, ?, ?)",
+	                        "ssssIss", objectID, parentID, refID, class, detailID, name, password);
+	if( ret == SQLITE_OK && scan_maps )
+		scan_map_set(&next_ids, parentID, strlen(parentID) + 1, child_index(objectID) + 1);
+	if( ret == SQLITE_OK && !defer_child_counts && (!password || !*password) )
+		sql_exec_bind(db, "UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + 1 where OBJECT_ID = ?",
+		              "s", parentID);
+
+	return ret;
+}
+
+int
+delete_objects(const char *fmt, ...)
+{
+	va_list ap;
+	char *where;
+	int ret;
+
+	va_start(ap, fmt);
+	where = sqlite3_vmprintf(fmt, ap);
+	va_end(ap);
+	sql_exec(db, "UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT - "
+	             "(SELECT count(*) from OBJECTS c where c.PARENT_ID = OBJECTS.OBJECT_ID"
+	             " and (c.PASSWORD is null or c.PASSWORD = '') and (%s))"
+	             " where OBJECT_ID in (SELECT PARENT_ID from OBJECTS where %s)",
+	             where, where);
+	ret = sql_exec(db, "DELETE from OBJECTS where %s", where);
+	sqlite3_free(where);
+
+	return ret;
+}
+
+int
+update_child_counts(const char *parentID)
+{
+	int ret;
+
+	if( parentID )
+		ret = sql_exec(db, "UPDATE OBJECTS set CHILD_COUNT = " PUBLIC_CHILDREN
+		                   " where (OBJECT_ID = %Q or (" SUBTREE_SQL "))"
+		                   " and CLASS glob 'container*'"
+		                   " and CHILD_COUNT is not " PUBLIC_CHILDREN,
+		                   parentID, parentID, parentID);
+	else
+		ret = sql_exec(db, "UPDATE OBJECTS set CHILD_COUNT = " PUBLIC_CHILDREN
+		                   " where CLASS glob 'container*'"
+		                   " and CHILD_COUNT is not " PUBLIC_CHILDREN);
+
+	return (ret == SQLITE_OK) ? sqlite3_changes(db) : -1;
+}
+
+int
+update_search_index(void)
+{
+	int exists;
+
+	exists = sql_get_int_field(db, "SELECT count(*) from SQLITE_MASTER"
+	                               " where TYPE = 'table' and NAME = 'DETAILS_FTS'");
+	if( !GETFLAG(SEARCH_INDEX_MASK) )
+	{
+		if( exists > 0 )
+		{
+			DPRINTF(E_WARN, L_DB_SQL, "Dropping full-text search index\n");
+			sql_exec(db, "DROP TRIGGER if exists DETAILS_FTS_INSERT");
+			sql_exec(db, "DROP TRIGGER if exists DETAILS_FTS_DELETE");
+			sql_exec(db, "DROP TRIGGER if exists DETAILS_FTS_UPDATE");
+			sql_exec(db, "DROP TABLE if exists DETAILS_FTS");
+		}
+		return 0;
+	}
+	if( exists > 0 )
+		return 0;
+
+	/* trigrams let MATCH find any substring, like the LIKE it replaces */
+	if( sql_exec(db, "CREATE VIRTUAL TABLE DETAILS_FTS using fts5("
+	                 FTS_COLUMNS ", content = 'DETAILS', content_rowid = 'ID',"
+	                 " tokenize = 'trigram')") != SQLITE_OK )
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "SQLite lacks FTS5 trigram support; "
+		                          "searches will not use a full-text index\n");
+		CLEARFLAG(SEARCH_INDEX_MASK);
+		return -1;
+	}
+	DPRINTF(E_WARN, L_DB_SQL, "Building full-text search index...\n");
+	if( sql_exec(db, "CREATE TRIGGER DETAILS_FTS_INSERT after insert on DETAILS begin"
+	                 " INSERT into DETAILS_FTS (rowid, " FTS_COLUMNS ")"
+	                 " values (new.ID, " FTS_VALUES("new") ");"
+	                 " end") != SQLITE_OK ||
+	    sql_exec(db, "CREATE TRIGGER DETAILS_FTS_DELETE after delete on DETAILS begin"
+	                 " INSERT into DETAILS_FTS (DETAILS_FTS, rowid, " FTS_COLUMNS ")"
+	                 " values ('delete', old.ID, " FTS_VALUES("old") ");"
+	                 " end") != SQLITE_OK ||
+	    sql_exec(db, "CREATE TRIGGER DETAILS_FTS_UPDATE after update of " FTS_COLUMNS
+	                 " on DETAILS begin"
+	                 " INSERT into DETAILS_FTS (DETAILS_FTS, rowid, " FTS_COLUMNS ")"
+	                 " values ('delete', old.ID, " FTS_VALUES("old") ");"
+	                 " INSERT into DETAILS_FTS (rowid, " FTS_COLUMNS ")"
+	                 " values (new.ID, " FTS_VALUES("new") ");"
+	                 " end") != SQLITE_OK ||
+	    sql_exec(db, "INSERT into DETAILS_FTS (DETAILS_FTS) values ('rebuild')") != SQLITE_OK )
+	{
+		CLEARFLAG(SEARCH_INDEX_MASK);
+		update_search_index();
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Insert item objectID of container parentID, as a reference to refID */
+static int
+insert_ref(const char *parentID, long long objectID, const char *refID, const char *class,
+           int64_t detailID, const char *name, const char *password)
+{
+	char id[128];
+
+	snprintf(id, sizeof(id), "%s$%llX", parentID, objectID);
+	return insert_object(id, parentID, refID, class, detailID, name, password);
+}
+
 int
 insert_container(const char *item, const char *rootParent, const char *refID, const char *class,
                  const char *artist, const char *genre, const char *album_art, int64_t *objectID, int64_t *parentID, const char *password)
 {
-	char *result;
+	char *result = NULL;
 	char *base;
+	char container[64];
+	char key[1024];
+	size_t keylen = 0;
 	int ret = 0;
 
-	result = sql_get_text_field(db, "SELECT OBJECT_ID from OBJECTS o "
-	                                "left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                " where o.PARENT_ID = '%s'"
-			                " and o.NAME like '%q'"
-			                " and d.ARTIST %s %Q"
-	                                " and o.CLASS = 'container.%s' limit 1",
-	                                rootParent, item, artist?"like":"is", artist, class);
+	snprintf(container, sizeof(container), "container.%s", class);
+	if( scan_maps )
+		keylen = container_key(key, sizeof(key), rootParent, item, artist, container);
+	if( keylen )
+	{
+		struct scan_map_entry *e = scan_map_find(&container_ids, key, keylen);
+
+		if( e )
+			result = sqlite3_mprintf("%s$%llX", rootParent, (long long)e->value);
+	}
+	else
+		result = sql_get_text_bind(db, artist ?
+		                               "SELECT OBJECT_ID from OBJECTS o "
+		                               "left join DETAILS d on (o.DETAIL_ID = d.ID)"
+		                               " where o.PARENT_ID = ?"
+		                               " and o.NAME like ?"
+		                               " and d.ARTIST like ?"
+		                               " and o.CLASS = ? limit 1" :
+		                               "SELECT OBJECT_ID from OBJECTS o "
+		                               "left join DETAILS d on (o.DETAIL_ID = d.ID)"
+		                               " where o.PARENT_ID = ?"
+		                               " and o.NAME like ?"
+		                               " and d.ARTIST is ?"
+		                               " and o.CLASS = ? limit 1",
+		                               "ssss", rootParent, item, artist, container);
 	if( result )
 	{
 		base = strrchr(result, '$');
@@ -116,7 +513,7 @@ insert_container(const char *item, const char *rootParent, const char *refID, co
 		*parentID = get_next_available_id("OBJECTS", rootParent);
 		if( refID )
 		{
-			result = sql_get_text_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = %Q", refID);
+			result = sql_get_text_bind(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = ?", "s", refID);
 			if( result )
 				detailID = strtoll(result, NULL, 10);
 		}
@@ -124,12 +521,22 @@ insert_container(const char *item, const char *rootParent, const char *refID, co
 		{
 			detailID = GetFolderMetadata(item, NULL, artist, genre, (album_art ? strtoll(album_art, NULL, 10) : 0));
 		}
-		ret = sql_exec(db, "INSERT into OBJECTS"
-		                   " (OBJECT_ID, PARENT_ID, REF_ID, DETAIL_ID, CLASS, NAME, PASSWORD) "
-		                   "VALUES"
-		                   " ('%s$%llX', '%s', %Q, %lld, 'container.%s', '%q', '%s')",
-		                   rootParent, (long long)*parentID, rootParent,
-		                   refID, (long long)detailID, class, item, password);
+		ret = insert_ref(rootParent, *parentID, refID, container, detailID, item, password);
+		if( ret == SQLITE_OK && keylen && scan_maps )
+		{
+			/* A reference shares the details of the container it points
+			 * to, which may be another artist's: key it the way the
+			 * query above would find it. */
+			if( result )
+			{
+				char *ref_artist = sql_get_text_bind(db, "SELECT ARTIST from DETAILS where ID = ?",
+				                                     "I", detailID);
+				keylen = container_key(key, sizeof(key), rootParent, item, ref_artist, container);
+				sqlite3_free(ref_artist);
+			}
+			if( keylen )
+				scan_map_set(&container_ids, key, keylen, *parentID);
+		}
 	}
 	sqlite3_free(result);
 
@@ -180,11 +587,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 			strncpyt(last_date.name, date_taken, sizeof(last_date.name));
 			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached date item: %s/%s/%X\n", last_date.name, last_date.parentID, last_date.objectID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-		             "VALUES"
-		             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q, '%s')",
-		             last_date.parentID, (long long)last_date.objectID, last_date.parentID, refID, class, (long long)detailID, name, password);
+		insert_ref(last_date.parentID, last_date.objectID, refID, class, detailID, name, password);
 
 		if( !valid_cache || strcmp(camera, last_cam.name) != 0 )
 		{
@@ -207,21 +610,13 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 			strncpyt(last_camdate.name, date_taken, sizeof(last_camdate.name));
 			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached camdate item: %s/%s/%s/%X\n", camera, last_camdate.name, last_camdate.parentID, last_camdate.objectID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-		             "VALUES"
-		             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q, '%s')",
-		             last_camdate.parentID, last_camdate.objectID, last_camdate.parentID, refID, class, (long long)detailID, name, password);
+		insert_ref(last_camdate.parentID, last_camdate.objectID, refID, class, detailID, name, password);
 		/* All Images */
 		if( !last_all_objectID )
 		{
 			last_all_objectID = get_next_available_id("OBJECTS", IMAGE_ALL_ID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-		             "VALUES"
-		             " ('"IMAGE_ALL_ID"$%llX', '"IMAGE_ALL_ID"', '%s', '%s', %lld, %Q, '%s')",
-		             last_all_objectID++, refID, class, (long long)detailID, name, password);
+		insert_ref(IMAGE_ALL_ID, last_all_objectID++, refID, class, detailID, name, password);
 	}
 	else if( strstr(class, "audioItem") )
 	{
@@ -260,11 +655,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 				last_album.objectID = objectID;
 				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached album item: %s/%s/%X\n", last_album.name, last_album.parentID, last_album.objectID);
 			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q, '%s')",
-			             last_album.parentID, last_album.objectID, last_album.parentID, refID, class, (long long)detailID, name, password);
+			insert_ref(last_album.parentID, last_album.objectID, refID, class, detailID, name, password);
 		}
 		if( artist )
 		{
@@ -297,16 +688,8 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 				strncpyt(last_artistAlbum.name, album ? album : _("Unknown Album"), sizeof(last_artistAlbum.name));
 				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached artist/album item: %s/%s/%X\n", last_artist.name, last_artist.parentID, last_artist.objectID);
 			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q, '%s')",
-			             last_artistAlbum.parentID, last_artistAlbum.objectID, last_artistAlbum.parentID, refID, class, (long long)detailID, name, password);
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q, '%s')",
-			             last_artistAlbumAll.parentID, last_artistAlbumAll.objectID, last_artistAlbumAll.parentID, refID, class, (long long)detailID, name, password);
+			insert_ref(last_artistAlbum.parentID, last_artistAlbum.objectID, refID, class, detailID, name, password);
+			insert_ref(last_artistAlbumAll.parentID, last_artistAlbumAll.objectID, refID, class, detailID, name, password);
 		}
 		if( genre )
 		{
@@ -337,27 +720,15 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 				strncpyt(last_genreArtist.name, artist ? artist : _("Unknown Artist"), sizeof(last_genreArtist.name));
 				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached genre/artist item: %s/%s/%X\n", last_genreArtist.name, last_genreArtist.parentID, last_genreArtist.objectID);
 			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q, '%s')",
-			             last_genreArtist.parentID, last_genreArtist.objectID, last_genreArtist.parentID, refID, class, (long long)detailID, name, password);
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q, '%s')",
-			             last_genreArtistAll.parentID, last_genreArtistAll.objectID, last_genreArtistAll.parentID, refID, class, (long long)detailID, name, password);
+			insert_ref(last_genreArtist.parentID, last_genreArtist.objectID, refID, class, detailID, name, password);
+			insert_ref(last_genreArtistAll.parentID, last_genreArtistAll.objectID, refID, class, detailID, name, password);
 		}
 		/* All Music */
 		if( !last_all_objectID )
 		{
 			last_all_objectID = get_next_available_id("OBJECTS", MUSIC_ALL_ID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-		             "VALUES"
-		             " ('"MUSIC_ALL_ID"$%llX', '"MUSIC_ALL_ID"', '%s', '%s', %lld, %Q, '%s')",
-		             last_all_objectID++, refID, class, (long long)detailID, name, password);
+		insert_ref(MUSIC_ALL_ID, last_all_objectID++, refID, class, detailID, name, password);
 	}
 	else if( strstr(class, "videoItem") )
 	{
@@ -368,11 +739,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		{
 			last_all_objectID = get_next_available_id("OBJECTS", VIDEO_ALL_ID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-		             "VALUES"
-		             " ('"VIDEO_ALL_ID"$%llX', '"VIDEO_ALL_ID"', '%s', '%s', %lld, %Q, '%s')",
-		             last_all_objectID++, refID, class, (long long)detailID, name, password);
+		insert_ref(VIDEO_ALL_ID, last_all_objectID++, refID, class, detailID, name, password);
 		return;
 	}
 	else
@@ -389,12 +756,13 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 	int64_t detailID = 0;
 	char class[] = "container.storageFolder";
 	char *result, *p;
+	char parent_buf[128];
 	static char last_found[256] = "-1";
 
 	if( strcmp(base, BROWSEDIR_ID) != 0 )
 	{
 		int found = 0;
-		char id_buf[64], parent_buf[64], refID[64];
+		char id_buf[64], refID[64];
 		char *dir_buf, *dir;
 
  		dir_buf = strdup(path);
@@ -406,23 +774,19 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 		{
 			if( valid_cache && strcmp(id_buf, last_found) == 0 )
 				break;
-			if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%s'", id_buf) > 0 )
+			if( sql_get_int_bind(db, "SELECT count(*) from OBJECTS where OBJECT_ID = ?", "s", id_buf) > 0 )
 			{
 				strcpy(last_found, id_buf);
 				break;
 			}
 			/* Does not exist.  Need to create, and may need to create parents also */
-			result = sql_get_text_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s'", refID);
+			result = sql_get_text_bind(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = ?", "s", refID);
 			if( result )
 			{
 				detailID = strtoll(result, NULL, 10);
 				sqlite3_free(result);
 			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, DETAIL_ID, CLASS, NAME, PASSWORD) "
-			             "VALUES"
-			             " ('%s', '%s', %Q, %lld, '%s', '%q', '%s')",
-			             id_buf, parent_buf, refID, detailID, class, strrchr(dir, '/')+1, password);
+			insert_object(id_buf, parent_buf, refID, class, detailID, strrchr(dir, '/')+1, password);
 			if( (p = strrchr(id_buf, '$')) )
 				*p = '\0';
 			if( (p = strrchr(parent_buf, '$')) )
@@ -436,68 +800,179 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 	}
 
 	detailID = GetFolderMetadata(name, path, NULL, NULL, find_album_art(path, NULL, 0));
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME, PASSWORD) "
-	             "VALUES"
-	             " ('%s%s$%X', '%s%s', %lld, '%s', '%q', '%s')",
-	             base, parentID, objectID, base, parentID, detailID, class, name, password);
+	snprintf(parent_buf, sizeof(parent_buf), "%s%s", base, parentID);
+	insert_ref(parent_buf, objectID, NULL, class, detailID, name, password);
 
 	return detailID;
 }
 
+/* Set while a scan with lazy_metadata stores placeholders for the
+ * files it has no cached details for */
+static int scan_lazy = 0;
+
+/* The number of files being streamed, kept by the server in memory it
+ * shares with the scanner process */
+static volatile int *io_streams = NULL;
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long io_window;	/* when the current second began */
+static int io_reads;			/* files read in it */
+
 int
-insert_file(char *name, const char *path, const char *parentID, int object, media_types types, const char *password)
+scan_io_init(void)
+{
+	void *p;
+
+	p = mmap(NULL, sizeof(*io_streams), PROT_READ|PROT_WRITE,
+	         MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if( p == MAP_FAILED )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "mmap: %s; the scanner won't yield to streams\n", strerror(errno));
+		return -1;
+	}
+	io_streams = p;
+	*io_streams = 0;
+
+	return 0;
+}
+
+void
+scan_io_streaming(int delta)
+{
+	if( io_streams )
+		*io_streams += delta;
+}
+
+/* Wait until this process may read another file: right away when nothing
+ * is being streamed, otherwise at most scan_io_budget files a second */
+static void
+scan_io_wait(void)
+{
+	unsigned long long now;
+
+	if( !io_streams )
+		return;
+	pthread_mutex_lock(&io_lock);
+	while( *io_streams > 0 && !quitting )
+	{
+		now = monotonic_us();
+		if( now - io_window >= 1000000 )
+		{
+			io_window = now;
+			io_reads = 0;
+		}
+		if( io_reads < runtime_vars.scan_io_budget )
+		{
+			io_reads++;
+			break;
+		}
+		/* check again soon, in case the stream ended */
+		pthread_mutex_unlock(&io_lock);
+		usleep(100000);
+		pthread_mutex_lock(&io_lock);
+	}
+	pthread_mutex_unlock(&io_lock);
+}
+
+static int
+read_details(enum details_type type, const char *path, char *name, struct file_details *d)
+{
+	if( get_cached_details(type, path, name, d) == 0 )
+		return 0;
+	if( scan_lazy )
+		return get_placeholder_details(type, path, name, d);
+	scan_io_wait();
+	switch( type )
+	{
+	case DETAILS_AUDIO:
+		return ReadAudioMetadata(path, name, d);
+	case DETAILS_IMAGE:
+		return ReadImageMetadata(path, name, d);
+	case DETAILS_VIDEO:
+		return ReadVideoMetadata(path, name, d);
+	}
+	return -1;
+}
+
+/* Work out what kind of media file name is, and read its metadata.  This
+ * doesn't touch the database, so it may run on a scanner worker thread. */
+static int
+read_file(char *name, const char *path, media_types types, struct file_entry *f)
 {
-	char class[32];
-	char objectID[64];
-	int64_t detailID = 0;
-	char base[8];
-	char *typedir_parentID;
-	char *baseid;
 	char *orig_name = NULL;
+	int ret = -1;
 
+	f->playlist = 0;
 	if( (types & TYPE_IMAGES) && is_image(name) )
 	{
 		if( is_album_art(name) )
 			return -1;
-		strcpy(base, IMAGE_DIR_ID);
-		strcpy(class, "item.imageItem.photo");
-		detailID = GetImageMetadata(path, name);
+		strcpy(f->base, IMAGE_DIR_ID);
+		strcpy(f->class, "item.imageItem.photo");
+		ret = read_details(DETAILS_IMAGE, path, name, &f->details);
 	}
 	else if( (types & TYPE_VIDEO) && is_video(name) )
 	{
  		orig_name = strdup(name);
-		strcpy(base, VIDEO_DIR_ID);
-		strcpy(class, "item.videoItem");
-		detailID = GetVideoMetadata(path, name);
-		if( !detailID )
+		strcpy(f->base, VIDEO_DIR_ID);
+		strcpy(f->class, "item.videoItem");
+		ret = read_details(DETAILS_VIDEO, path, name, &f->details);
+		if( ret != 0 )
 			strcpy(name, orig_name);
 	}
 	else if( is_playlist(name) )
 	{
-		if( insert_playlist(path, name) == 0 )
-			return 1;
+		f->playlist = 1;
+		return 0;
 	}
-	if( !detailID && (types & TYPE_AUDIO) && is_audio(name) )
+	if( ret != 0 && (types & TYPE_AUDIO) && is_audio(name) )
 	{
-		strcpy(base, MUSIC_DIR_ID);
-		strcpy(class, "item.audioItem.musicTrack");
-		detailID = GetAudioMetadata(path, name);
+		strcpy(f->base, MUSIC_DIR_ID);
+		strcpy(f->class, "item.audioItem.musicTrack");
+		ret = read_details(DETAILS_AUDIO, path, name, &f->details);
 	}
 	free(orig_name);
+	if( ret != 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Unsuccessful getting details for %s!\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Insert a file read by read_file() */
+static int
+store_file(char *name, const char *path, const char *parentID, int object, const char *password, struct file_entry *f)
+{
+	char objectID[64];
+	char parent_buf[128];
+	int64_t detailID;
+	char *typedir_parentID;
+	char *baseid;
+	int pending = f->details.pending;
+
+	if( f->playlist )
+	{
+		if( insert_playlist(path, name) == 0 )
+			return 1;
+		DPRINTF(E_WARN, L_SCANNER, "Unsuccessful getting details for %s!\n", path);
+		return -1;
+	}
+	cache_details(db, &f->details);
+	detailID = store_details(&f->details);
 	if( !detailID )
 	{
 		DPRINTF(E_WARN, L_SCANNER, "Unsuccessful getting details for %s!\n", path);
 		return -1;
 	}
+	if( pending )
+		sql_exec_bind(db, "INSERT into PENDING values (?)", "I", detailID);
 
 	sprintf(objectID, "%s%s$%X", BROWSEDIR_ID, parentID, object);
 
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-	             "VALUES"
-	             " ('%s', '%s%s', '%s', %lld, '%q', '%s')",
-	             objectID, BROWSEDIR_ID, parentID, class, detailID, name, password);
+	snprintf(parent_buf, sizeof(parent_buf), "%s%s", BROWSEDIR_ID, parentID);
+	insert_object(objectID, parent_buf, NULL, f->class, detailID, name, password);
 
 	if( *parentID )
 	{
@@ -509,19 +984,29 @@ insert_file(char *name, const char *path, const char *parentID, int object, medi
 			typedir_objectID = strtol(baseid+1, NULL, 16);
 			*baseid = '\0';
 		}
-		insert_directory(name, path, base, typedir_parentID, typedir_objectID, password);
+		insert_directory(name, path, f->base, typedir_parentID, typedir_objectID, password);
 		free(typedir_parentID);
 	}
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, PASSWORD) "
-	             "VALUES"
-	             " ('%s%s$%X', '%s%s', '%s', '%s', %lld, '%q', '%s')",
-	             base, parentID, object, base, parentID, objectID, class, detailID, name, password);
+	snprintf(parent_buf, sizeof(parent_buf), "%s%s", f->base, parentID);
+	insert_ref(parent_buf, object, objectID, f->class, detailID, name, password);
 
-	insert_containers(name, path, objectID, class, detailID, password);
+	/* the backfill files it by album, date and so on, once it's read */
+	if( !pending )
+		insert_containers(name, path, objectID, f->class, detailID, password);
 	return 0;
 }
 
+int
+insert_file(char *name, const char *path, const char *parentID, int object, media_types types, const char *password)
+{
+	struct file_entry f;
+
+	if( read_file(name, path, types, &f) != 0 )
+		return -1;
+
+	return store_file(name, path, parentID, object, password, &f);
+}
+
 int
 CreateDatabase(void)
 {
@@ -567,6 +1052,9 @@ CreateDatabase(void)
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_settingsTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_pendingTable_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, "INSERT into SETTINGS values ('UPDATE_ID', '0')");
@@ -601,12 +1089,10 @@ CreateDatabase(void)
 				goto sql_failed;
 		}
 	}
-	sql_exec(db, "create INDEX IDX_OBJECTS_OBJECT_ID ON OBJECTS(OBJECT_ID);");
 	sql_exec(db, "create INDEX IDX_OBJECTS_PARENT_ID ON OBJECTS(PARENT_ID);");
 	sql_exec(db, "create INDEX IDX_OBJECTS_DETAIL_ID ON OBJECTS(DETAIL_ID);");
 	sql_exec(db, "create INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS);");
 	sql_exec(db, "create INDEX IDX_DETAILS_PATH ON DETAILS(PATH);");
-	sql_exec(db, "create INDEX IDX_DETAILS_ID ON DETAILS(ID);");
 	sql_exec(db, "create INDEX IDX_ALBUM_ART ON ALBUM_ART(ID);");
 	sql_exec(db, "create INDEX IDX_SCANNER_OPT ON OBJECTS(PARENT_ID, NAME, OBJECT_ID);");
 
@@ -758,115 +1244,663 @@ readPassword(const char *dir, char *password, int size)
 
 }
 
+/* The initial scan commits every runtime_vars.scan_batch files, and at
+ * least every SCAN_BATCH_MSEC so that clients see the library fill in,
+ * rather than once per statement. */
+#define SCAN_BATCH_MSEC 1000
+
+static long long unsigned int scan_files = 0;
+static int batch_open = 0;
+static int batch_files;
+static unsigned long long batch_start;
+
 static void
-ScanDirectory(const char *dir, const char *parent, media_types dir_types, const char *currentPassword)
+scan_batch_begin(void)
 {
-	struct dirent **namelist;
-	int i, n, startID = 0;
-	char *full_path;
-	char *name = NULL;
-	char password[11];
-	static long long unsigned int fileno = 0;
+	if( runtime_vars.scan_batch <= 1 )
+		return;
+	if( sql_exec(db, "BEGIN") != SQLITE_OK )
+		return;
+	batch_open = 1;
+	batch_files = 0;
+	batch_start = monotonic_us();
+}
+
+static void
+scan_batch_end(void)
+{
+	if( !batch_open )
+		return;
+	batch_open = 0;
+	/* a failed statement may already have rolled the batch back */
+	if( sqlite3_get_autocommit(db) )
+		return;
+	if( sql_exec(db, "COMMIT") != SQLITE_OK )
+		sql_exec(db, "ROLLBACK");
+}
+
+static void
+scan_batch_step(void)
+{
+	if( !batch_open )
+		return;
+	if( ++batch_files < runtime_vars.scan_batch &&
+	    monotonic_us() - batch_start < SCAN_BATCH_MSEC * 1000ULL )
+		return;
+	scan_batch_end();
+	scan_batch_begin();
+}
+
+/* With scan_threads > 1, ScanDirectory() queues what it finds in walk
+ * order, a pool of workers reads the metadata of the queued files, and
+ * the scanner thread stores each entry once everything ahead of it has
+ * been stored.  Only the scanner thread uses the database, and entries are
+ * stored in the same order as a serial scan would store them.
+ *
+ * Each disk has a queue of its own.  When the media_dirs are on several
+ * disks, each disk is walked by a thread of its own, so that they are all
+ * read at once.  Their entries are still stored one media_dir after the
+ * other, in the order of media_dirs, so that the shared containers come
+ * out the same whichever disk is quicker. */
+struct scan_dev;
+
+struct scan_job
+{
+	struct scan_job *next;		/* walk order */
+	struct scan_job *work_next;	/* files waiting for a worker */
+	struct scan_dev *dev;
+	int root;			/* in scan_roots */
 	enum file_types type;
+	int done;
+	int ret;
+	char *name;
+	char *path;
+	char *parent;
+	int object;
+	int64_t mtime;
+	media_types types;
+	char password[11];
+	struct file_entry f;
+};
 
+struct scan_dev
+{
+	dev_t dev;
+	struct scan_job *head, *tail;		/* walk order */
+	struct scan_job *work_head, *work_tail;	/* files waiting for a worker */
+	int jobs;
+	int reading;
+	int root;		/* being walked */
+	pthread_t walker;
+	int walking;		/* on a walker thread */
+};
 
-	DPRINTF(parent?E_INFO:E_WARN, L_SCANNER, _("Scanning %s\n"), dir);
-	switch( dir_types )
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scan_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scan_room = PTHREAD_COND_INITIALIZER;
+static struct scan_dev *scan_devs;
+static int scan_ndevs;
+static int scan_jobs;			/* queued on all disks */
+static int scan_jobs_max;		/* per disk */
+static int scan_walkers;		/* walker threads still running */
+static int scan_stop;
+static int scan_nthreads;
+static pthread_t *scan_tids;
+static __thread struct scan_dev *scan_cur;	/* the disk this thread walks */
+static __thread int scan_walking;		/* a walker thread, which can't store */
+
+/* The media_dirs, and the disk each one is on, while the disks are walked
+ * at once */
+struct scan_root
+{
+	struct media_dir_s *media;
+	struct scan_dev *dev;
+	char parent[12];
+	int walked;
+};
+
+static struct scan_root *scan_roots;
+static int scan_nroots;
+static int scan_next;			/* the media_dir being stored */
+
+/* The next file to read, from a disk that has fewer than
+ * scan_device_threads of its files being read */
+static struct scan_job *
+scan_next_work(void)
+{
+	static int next = 0;
+	struct scan_dev *d;
+	struct scan_job *job;
+	int i;
+
+	for( i = 0; i < scan_ndevs; i++ )
 	{
-		case ALL_MEDIA:
-			n = scandir(dir, &namelist, filter_avp, alphasort);
-			break;
-		case TYPE_AUDIO:
-			n = scandir(dir, &namelist, filter_a, alphasort);
+		d = &scan_devs[(next + i) % scan_ndevs];
+		if( !d->work_head )
+			continue;
+		if( runtime_vars.scan_device_threads > 0 &&
+		    d->reading >= runtime_vars.scan_device_threads )
+			continue;
+		job = d->work_head;
+		d->work_head = job->work_next;
+		if( !d->work_head )
+			d->work_tail = NULL;
+		d->reading++;
+		next = (next + i + 1) % scan_ndevs;
+		return job;
+	}
+
+	return NULL;
+}
+
+static void *
+scan_worker(void *arg)
+{
+	struct scan_job *job;
+
+	pthread_mutex_lock(&scan_lock);
+	for (;;)
+	{
+		while( !(job = scan_next_work()) && !scan_stop )
+			pthread_cond_wait(&scan_work, &scan_lock);
+		if( !job )
+			break;
+		pthread_mutex_unlock(&scan_lock);
+
+		job->ret = read_file(job->name, job->path, job->types, &job->f);
+
+		pthread_mutex_lock(&scan_lock);
+		job->done = 1;
+		if( job->dev->reading-- == runtime_vars.scan_device_threads )
+			pthread_cond_signal(&scan_work);
+		if( job == job->dev->head )
+			pthread_cond_signal(&scan_done);
+	}
+	pthread_mutex_unlock(&scan_lock);
+	close_details_reader();
+
+	return NULL;
+}
+
+static void
+scan_pool_start(void)
+{
+	struct media_dir_s *media_path;
+	int i, n = runtime_vars.scan_threads;
+
+	/* one queue for each media_dir at most, and one for the rest */
+	for( i = 1, media_path = media_dirs; media_path; media_path = media_path->next )
+		i++;
+	scan_devs = calloc(i, sizeof(struct scan_dev));
+	if( !scan_devs )
+		DPRINTF(E_FATAL, L_SCANNER, "Out of memory!\n");
+	scan_ndevs = 1;
+	scan_cur = &scan_devs[0];
+
+	if( n <= 0 )
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	scan_nthreads = 0;
+	if( n <= 1 )
+		return;
+	if( !lav_threads_init() )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "libavcodec is not thread-safe, scanning with a single thread\n");
+		return;
+	}
+	scan_tids = calloc(n, sizeof(pthread_t));
+	if( !scan_tids )
+		return;
+	scan_stop = 0;
+	for( i = 0; i < n; i++ )
+	{
+		if( pthread_create(&scan_tids[i], NULL, scan_worker, NULL) != 0 )
+		{
+			DPRINTF(E_ERROR, L_SCANNER, "pthread_create() failed for scanner thread %d\n", i);
+			break;
+		}
+	}
+	scan_nthreads = i;
+	scan_jobs_max = 4 * scan_nthreads + 256;
+	DPRINTF(E_INFO, L_SCANNER, "Reading metadata with %d threads\n", scan_nthreads);
+}
+
+static void
+scan_pool_stop(void)
+{
+	int i;
+
+	if( scan_tids )
+	{
+		pthread_mutex_lock(&scan_lock);
+		scan_stop = 1;
+		pthread_cond_broadcast(&scan_work);
+		pthread_mutex_unlock(&scan_lock);
+		for( i = 0; i < scan_nthreads; i++ )
+			pthread_join(scan_tids[i], NULL);
+		free(scan_tids);
+		scan_tids = NULL;
+		scan_nthreads = 0;
+	}
+	free(scan_devs);
+	scan_devs = NULL;
+	scan_ndevs = 0;
+	scan_cur = NULL;
+}
+
+/* A directory without a name marks the end of that directory: everything
+ * below it has been stored.  Only then does it get its mtime in TIMESTAMP,
+ * which tells a rescan whether its entries may have changed, and a resumed
+ * scan that it is complete.  The checkpoint commits with the same batch. */
+static void
+scan_store(enum file_types type, char *name, const char *path, const char *parent,
+           int object, int64_t mtime, const char *password, int ret, struct file_entry *f)
+{
+	if( type == TYPE_DIR && !name )
+	{
+		sql_exec_bind(db, "UPDATE DETAILS set TIMESTAMP = ? where PATH = ?", "Is", mtime, path);
+		sql_exec_bind(db, "UPDATE SETTINGS set VALUE = ? where KEY = 'scan_checkpoint'", "s", path);
+		return;
+	}
+	if( type == TYPE_DIR )
+		insert_directory(name, path, BROWSEDIR_ID, parent, object, password);
+	else if( ret == 0 && store_file(name, path, parent, object, password, f) == 0 )
+		scan_files++;
+	scan_batch_step();
+}
+
+/* The queue to store from next: the disk of the media_dir being stored,
+ * once everything before it has been.  Without walker threads there is
+ * only the one queue. */
+static struct scan_dev *
+scan_next_dev(void)
+{
+	struct scan_dev *d;
+
+	if( !scan_nroots )
+		return &scan_devs[0];
+	while( scan_next < scan_nroots )
+	{
+		d = scan_roots[scan_next].dev;
+		if( d->head && d->head->root == scan_next )
+			return d;
+		if( !scan_roots[scan_next].walked )
+			return NULL;
+		scan_next++;
+	}
+
+	return NULL;
+}
+
+/* Store finished jobs from the head of the next queue, waiting for them
+ * while more than max are queued, or while walker threads are still
+ * running */
+static void
+scan_drain(int max)
+{
+	struct scan_dev *d;
+	struct scan_job *job;
+	int stored;
+
+	pthread_mutex_lock(&scan_lock);
+	for (;;)
+	{
+		stored = 0;
+		while( (d = scan_next_dev()) && (job = d->head) && job->done )
+		{
+			d->head = job->next;
+			if( !job->next )
+				d->tail = NULL;
+			if( d->jobs-- > scan_jobs_max )
+				pthread_cond_broadcast(&scan_room);
+			scan_jobs--;
+			pthread_mutex_unlock(&scan_lock);
+
+			scan_store(job->type, job->name, job->path, job->parent, job->object,
+			           job->mtime, job->password, job->ret, &job->f);
+			free(job->name);
+			free(job->path);
+			free(job->parent);
+			free(job);
+			stored = 1;
+
+			pthread_mutex_lock(&scan_lock);
+		}
+		if( stored )
+			continue;
+		if( scan_jobs <= max && !(max == 0 && scan_walkers) )
+			break;
+		pthread_cond_wait(&scan_done, &scan_lock);
+	}
+	pthread_mutex_unlock(&scan_lock);
+}
+
+/* Hand an entry found by ScanDirectory() to the pool, or read and store
+ * it right away when there is no pool */
+static void
+scan_entry(enum file_types type, char *name, const char *path, const char *parent,
+           int object, int64_t mtime, media_types types, const char *password)
+{
+	struct scan_dev *d = scan_cur;
+	struct scan_job *job;
+	struct file_entry f;
+
+	if( scan_nthreads )
+	{
+		job = calloc(1, sizeof(*job));
+		if( job )
+		{
+			job->dev = d;
+			job->root = d->root;
+			job->type = type;
+			job->name = name ? strdup(name) : NULL;
+			job->path = strdup(path);
+			job->parent = strdup(parent);
+			job->object = object;
+			job->mtime = mtime;
+			job->types = types;
+			strncpyt(job->password, password, sizeof(job->password));
+			if( (name && !job->name) || !job->path || !job->parent )
+			{
+				free(job->name);
+				free(job->path);
+				free(job->parent);
+				free(job);
+				job = NULL;
+			}
+		}
+		if( job )
+		{
+			pthread_mutex_lock(&scan_lock);
+			if( type == TYPE_DIR )
+				job->done = 1;
+			else
+			{
+				if( d->work_tail )
+					d->work_tail->work_next = job;
+				else
+					d->work_head = job;
+				d->work_tail = job;
+				pthread_cond_signal(&scan_work);
+			}
+			if( d->tail )
+				d->tail->next = job;
+			else
+				d->head = job;
+			d->tail = job;
+			d->jobs++;
+			scan_jobs++;
+			if( scan_walking )
+			{
+				/* the scanner thread stores it; wait for room */
+				if( job == d->head )
+					pthread_cond_signal(&scan_done);
+				while( d->jobs > scan_jobs_max )
+					pthread_cond_wait(&scan_room, &scan_lock);
+				pthread_mutex_unlock(&scan_lock);
+				return;
+			}
+			pthread_mutex_unlock(&scan_lock);
+			scan_drain(scan_jobs_max);
+			return;
+		}
+		if( scan_walking )
+		{
+			DPRINTF(E_ERROR, L_SCANNER, "Out of memory; skipping %s\n", path);
+			return;
+		}
+		/* keep the walk order */
+		scan_drain(0);
+	}
+	if( type == TYPE_DIR )
+		scan_store(type, name, path, parent, object, mtime, password, 0, NULL);
+	else
+		scan_store(type, name, path, parent, object, 0, password,
+		           read_file(name, path, types, &f), &f);
+}
+
+/* Queue the end of a directory, behind everything found below it */
+static void
+scan_dir_done(const char *path, int64_t mtime)
+{
+#if !USE_FORK
+	/* the walk was cut short */
+	if( quitting )
+		return;
+#endif
+	scan_entry(TYPE_DIR, NULL, path, "", 0, mtime, 0, "");
+}
+
+/* A directory read by read_dir(): the names and their strxfrm() sort keys
+ * are packed into one buffer, instead of one allocation per entry */
+struct dir_entry
+{
+	size_t off;		/* of the name in dir_list.buf, while reading */
+	const char *name;
+	const char *key;
+	enum file_types type;
+};
+
+struct dir_list
+{
+	char *buf;
+	size_t len, size;
+	struct dir_entry *entries;
+	int count, alloc;
+};
+
+static int
+dir_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct dir_entry *)a)->key,
+	              ((const struct dir_entry *)b)->key);
+}
+
+static int
+dir_list_reserve(struct dir_list *list, size_t len)
+{
+	size_t size;
+	char *buf;
+
+	if( list->len + len <= list->size )
+		return 0;
+	size = list->size ? list->size : 4096;
+	while( size < list->len + len )
+		size *= 2;
+	buf = realloc(list->buf, size);
+	if( !buf )
+		return -1;
+	list->buf = buf;
+	list->size = size;
+	return 0;
+}
+
+/* Read the entries of the directory open at dirp that pass filter, sorted
+ * the same way as alphasort(), with the type given by d_type when there is
+ * one.  Entries that need a stat() are left as TYPE_UNKNOWN. */
+static int
+read_dir(DIR *dirp, int (*filter)(scan_filter *), struct dir_list *list)
+{
+	struct dirent *d;
+	struct dir_entry *e;
+	size_t name_len, key_len;
+	int i;
+
+	memset(list, '\0', sizeof(*list));
+	while( (d = readdir(dirp)) )
+	{
+		if( !filter(d) )
+			continue;
+		if( list->count == list->alloc )
+		{
+			int alloc = list->alloc ? list->alloc * 2 : 64;
+			e = realloc(list->entries, alloc * sizeof(*e));
+			if( !e )
+				return -1;
+			list->entries = e;
+			list->alloc = alloc;
+		}
+		name_len = strlen(d->d_name) + 1;
+		key_len = strxfrm(NULL, d->d_name, 0) + 1;
+		if( dir_list_reserve(list, name_len + key_len) != 0 )
+			return -1;
+		e = &list->entries[list->count++];
+		e->off = list->len;
+		memcpy(list->buf + e->off, d->d_name, name_len);
+		strxfrm(list->buf + e->off + name_len, d->d_name, key_len);
+		list->len += name_len + key_len;
+		if( is_dir(d) == 1 )
+			e->type = TYPE_DIR;
+		else if( is_reg(d) == 1 )
+			e->type = TYPE_FILE;
+		else
+			e->type = TYPE_UNKNOWN;
+	}
+	for( i = 0; i < list->count; i++ )
+	{
+		e = &list->entries[i];
+		e->name = list->buf + e->off;
+		e->key = e->name + strlen(e->name) + 1;
+	}
+	if( list->count )
+		qsort(list->entries, list->count, sizeof(struct dir_entry), dir_entry_cmp);
+
+	return 0;
+}
+
+static void
+free_dir(struct dir_list *list)
+{
+	free(list->entries);
+	free(list->buf);
+}
+
+/* Scan dir, which is open at atfd (or is an absolute path, with AT_FDCWD).
+ * Subdirectories are opened relative to their parent, so that each entry
+ * costs no more than one *at() call on its name. */
+static void
+ScanDirectory(int atfd, const char *dir, const char *parent, media_types dir_types, const char *currentPassword, int startID)
+{
+	struct dir_list list;
+	int (*filter)(scan_filter *);
+	int i, fd, ret;
+	DIR *dirp;
+	char *full_path;
+	size_t dir_len;
+	char *name = NULL;
+	char password[11];
+	enum file_types type;
+
+
+	DPRINTF(parent?E_INFO:E_WARN, L_SCANNER, _("Scanning %s\n"), dir);
+	switch( dir_types )
+	{
+		case ALL_MEDIA:
+			filter = filter_avp;
+			break;
+		case TYPE_AUDIO:
+			filter = filter_a;
 			break;
 		case TYPE_AUDIO|TYPE_VIDEO:
-			n = scandir(dir, &namelist, filter_av, alphasort);
+			filter = filter_av;
 			break;
 		case TYPE_AUDIO|TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_ap, alphasort);
+			filter = filter_ap;
 			break;
 		case TYPE_VIDEO:
-			n = scandir(dir, &namelist, filter_v, alphasort);
+			filter = filter_v;
 			break;
 		case TYPE_VIDEO|TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_vp, alphasort);
+			filter = filter_vp;
 			break;
 		case TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_p, alphasort);
+			filter = filter_p;
 			break;
 		default:
-			n = -1;
-			errno = EINVAL;
+			filter = NULL;
 			break;
 	}
-	if( n < 0 )
+	fd = -1;
+	dirp = NULL;
+	if( !filter )
+		errno = EINVAL;
+	else if( (fd = openat(atfd, atfd == AT_FDCWD ? dir : strrchr(dir, '/') + 1,
+	                      O_RDONLY|O_DIRECTORY|O_CLOEXEC)) >= 0 )
+		dirp = fdopendir(fd);
+	ret = dirp ? read_dir(dirp, filter, &list) : -1;
+	if( ret != 0 )
 	{
 		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s [%s]\n",
 			dir, strerror(errno));
+		if( dirp )
+		{
+			free_dir(&list);
+			closedir(dirp);
+		}
+		else if( fd >= 0 )
+			close(fd);
 		return;
 	}
+	fd = dirfd(dirp);
 
 	full_path = malloc(PATH_MAX);
 	if (!full_path)
 	{
 		DPRINTF(E_ERROR, L_SCANNER, "Memory allocation failed scanning %s\n", dir);
+		free_dir(&list);
+		closedir(dirp);
 		return;
 	}
+	dir_len = snprintf(full_path, PATH_MAX, "%s/", dir);
+	if( dir_len >= PATH_MAX )
+		dir_len = PATH_MAX - 1;
 
-	if( !parent )
-	{
-		startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
-	}
-
-	snprintf(full_path, PATH_MAX, "%s/.password", dir);
-	if (access(full_path, 0) == 0) {
+	if (faccessat(fd, ".password", F_OK, 0) == 0) {
+	    strncpyt(full_path + dir_len, ".password", PATH_MAX - dir_len);
 	    readPassword(full_path, password, 11);
 	} else {
 	    strcpy(password, currentPassword);
 	}
 
-	for (i=0; i < n; i++)
+	for (i=0; i < list.count; i++)
 	{
+		const char *d_name = list.entries[i].name;
 #if !USE_FORK
 		if( quitting )
 			break;
 #endif
-		type = TYPE_UNKNOWN;
-		snprintf(full_path, PATH_MAX, "%s/%s", dir, namelist[i]->d_name);
-		name = escape_tag(namelist[i]->d_name, 1);
-		if( is_dir(namelist[i]) == 1 )
+		strncpyt(full_path + dir_len, d_name, PATH_MAX - dir_len);
+		name = escape_tag(d_name, 1);
+		type = list.entries[i].type;
+		if( type == TYPE_UNKNOWN )
 		{
-			type = TYPE_DIR;
+			type = resolve_unknown_type_at(fd, d_name, full_path, dir_types);
 		}
-		else if( is_reg(namelist[i]) == 1 )
-		{
-			type = TYPE_FILE;
-		}
-		else
-		{
-			type = resolve_unknown_type(full_path, dir_types);
-		}
-		if( (type == TYPE_DIR) && (access(full_path, R_OK|X_OK) == 0) )
+		if( (type == TYPE_DIR) && (faccessat(fd, d_name, R_OK|X_OK, 0) == 0) )
 		{
 			char *parent_id;
-			insert_directory(name, full_path, BROWSEDIR_ID, THISORNUL(parent), i+startID, password);
+			struct stat st;
+			if( fstatat(fd, d_name, &st, 0) != 0 )
+				st.st_mtime = 0;
+			scan_entry(TYPE_DIR, name, full_path, THISORNUL(parent), i+startID, 0, dir_types, password);
 			xasprintf(&parent_id, "%s$%X", THISORNUL(parent), i+startID);
-			ScanDirectory(full_path, parent_id, dir_types, password);
+			ScanDirectory(fd, full_path, parent_id, dir_types, password, 0);
+			scan_dir_done(full_path, st.st_mtime);
 			free(parent_id);
 		}
-		else if( type == TYPE_FILE && (access(full_path, R_OK) == 0) )
+		else if( type == TYPE_FILE && (faccessat(fd, d_name, R_OK, 0) == 0) )
 		{
-			if( insert_file(name, full_path, THISORNUL(parent), i+startID, dir_types, password) == 0 )
-				fileno++;
+			scan_entry(TYPE_FILE, name, full_path, THISORNUL(parent), i+startID, 0, dir_types, password);
 		}
 		free(name);
-		free(namelist[i]);
 	}
-	free(namelist);
+	free_dir(&list);
+	closedir(dirp);
 	free(full_path);
 	if( !parent )
 	{
-		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, fileno);
+		scan_drain(0);
+		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, scan_files);
 	}
 }
 
@@ -890,47 +1924,224 @@ _notify_stop(void)
 #endif
 }
 
-void
-start_scanner()
-{
-	struct media_dir_s *media_path;
-	char path[MAXPATHLEN];
+static unsigned long long scan_start_us;
+static int scan_io_prio = -1;	/* to restore, if the scan runs in the server */
 
+static void
+scan_begin(void)
+{
+	scan_start_us = monotonic_us();
 	if (setpriority(PRIO_PROCESS, 0, 15) == -1)
 		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce scanner thread priority\n");
+	/* the worker threads inherit it */
+	if ((scan_io_prio = set_io_priority(IO_PRIO_IDLE)) == -1)
+		DPRINTF(E_INFO, L_SCANNER, "Failed to reduce scanner I/O priority\n");
 	_notify_start();
 
 	setlocale(LC_COLLATE, "");
+	defer_child_counts = 1;
 
 	av_register_all();
 	av_log_set_level(AV_LOG_PANIC);
-	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+	scan_lazy = GETFLAG(LAZY_METADATA_MASK) ? 1 : 0;
+	/* where a scan that is cut short can be resumed */
+	if( sql_get_int_field(db, "SELECT count(*) from SETTINGS where KEY = 'scan_checkpoint'") <= 0 )
+		sql_exec(db, "INSERT into SETTINGS values ('scan_checkpoint', '')");
+	if( open_details_cache(db) != 0 )
+		DPRINTF(E_WARN, L_SCANNER, "Reading every file, without the details cache\n");
+	scan_pool_start();
+	scan_batch_begin();
+	scan_maps_start();
+}
+
+/* Add the container of a media_dir.  parent gets its ObjectID below
+ * Browse Folders, or is NULL when its entries go right in Browse Folders. */
+static char *
+scan_media_root(struct media_dir_s *media_path, char parent[12])
+{
+	char path[MAXPATHLEN];
+	int64_t id;
+	char *bname;
+
+	strncpyt(path, media_path->path, sizeof(path));
+	bname = basename(path);
+	/* If there are multiple media locations, add a level to the ContentDirectory */
+	if( !GETFLAG(MERGE_MEDIA_DIRS_MASK) && media_dirs->next )
+	{
+		int startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
+		id = insert_directory(bname, path, BROWSEDIR_ID, "", startID, "");
+		sprintf(parent, "$%X", startID);
+	}
+	else
+	{
+		id = GetFolderMetadata(bname, media_path->path, NULL, NULL, 0);
+		parent = NULL;
+	}
+	/* Use TIMESTAMP to store the media type */
+	sql_exec(db, "UPDATE DETAILS set TIMESTAMP = %d where ID = %lld", media_path->types, (long long)id);
+
+	return parent;
+}
+
+static void
+scan_media_dir(struct media_dir_s *media_path)
+{
+	char buf[12], *parent;
+
+	parent = scan_media_root(media_path, buf);
+	ScanDirectory(AT_FDCWD, media_path->path, parent, media_path->types, "",
+	              parent ? 0 : get_next_available_id("OBJECTS", BROWSEDIR_ID));
+	scan_drain(0);
+#if !USE_FORK
+	if( quitting )
+		return;
+#endif
+	sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
+}
+
+/* Walk one media_dir, then let the scanner thread move on to the next */
+static void
+walk_root(int i)
+{
+	scan_cur = scan_roots[i].dev;
+	scan_cur->root = i;
+	ScanDirectory(AT_FDCWD, scan_roots[i].media->path, scan_roots[i].parent,
+	              scan_roots[i].media->types, "", 0);
+
+	pthread_mutex_lock(&scan_lock);
+	scan_roots[i].walked = 1;
+	pthread_cond_signal(&scan_done);
+	pthread_mutex_unlock(&scan_lock);
+}
+
+static void *
+walk_device(void *arg)
+{
+	struct scan_dev *d = arg;
+	int i;
+
+	scan_walking = 1;
+	for( i = 0; i < scan_nroots; i++ )
+	{
+		if( scan_roots[i].dev == d )
+			walk_root(i);
+	}
+
+	pthread_mutex_lock(&scan_lock);
+	scan_walkers--;
+	pthread_cond_signal(&scan_done);
+	pthread_mutex_unlock(&scan_lock);
+
+	return NULL;
+}
+
+/* With media_dirs on several disks, walk each disk on a thread of its own
+ * while this thread stores what they find, one media_dir after the other.
+ * Only done when each media_dir has a container of its own. */
+static int
+scan_by_device(void)
+{
+	struct media_dir_s *media_path;
+	struct stat st;
+	int i, j, n = 0, ndevs = 0;
+
+	if( !scan_nthreads || GETFLAG(MERGE_MEDIA_DIRS_MASK) || !media_dirs->next )
+		return -1;
+	for( media_path = media_dirs; media_path; media_path = media_path->next )
+		n++;
+	scan_roots = calloc(n, sizeof(struct scan_root));
+	if( !scan_roots )
+		return -1;
+	for( i = 0, media_path = media_dirs; media_path; media_path = media_path->next, i++ )
+	{
+		if( stat(media_path->path, &st) != 0 )
+			st.st_dev = 0;
+		for( j = 0; j < ndevs; j++ )
+			if( scan_devs[j].dev == st.st_dev )
+				break;
+		if( j == ndevs )
+			scan_devs[ndevs++].dev = st.st_dev;
+		scan_roots[i].media = media_path;
+		scan_roots[i].dev = &scan_devs[j];
+	}
+	if( ndevs < 2 )
 	{
-		int64_t id;
-		char *bname, *parent = NULL;
-		char buf[8];
-		strncpyt(path, media_path->path, sizeof(path));
-		bname = basename(path);
-		/* If there are multiple media locations, add a level to the ContentDirectory */
-		if( !GETFLAG(MERGE_MEDIA_DIRS_MASK) && media_dirs->next )
+		free(scan_roots);
+		scan_roots = NULL;
+		return -1;
+	}
+	scan_nroots = n;
+	scan_next = 0;
+	for( i = 0; i < n; i++ )
+		scan_media_root(scan_roots[i].media, scan_roots[i].parent);
+
+	DPRINTF(E_WARN, L_SCANNER, "Scanning %d disks at once\n", ndevs);
+	pthread_mutex_lock(&scan_lock);
+	scan_ndevs = ndevs;
+	scan_walkers = ndevs;
+	pthread_mutex_unlock(&scan_lock);
+	for( j = 0; j < ndevs; j++ )
+	{
+		if( pthread_create(&scan_devs[j].walker, NULL, walk_device, &scan_devs[j]) == 0 )
 		{
-			int startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
-			id = insert_directory(bname, path, BROWSEDIR_ID, "", startID, "");
-			sprintf(buf, "$%X", startID);
-			parent = buf;
+			scan_devs[j].walking = 1;
+			continue;
 		}
-		else
-			id = GetFolderMetadata(bname, media_path->path, NULL, NULL, 0);
-		/* Use TIMESTAMP to store the media type */
-		sql_exec(db, "UPDATE DETAILS set TIMESTAMP = %d where ID = %lld", media_path->types, (long long)id);
-		ScanDirectory(media_path->path, parent, media_path->types, "");
-		sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
+		DPRINTF(E_ERROR, L_SCANNER, "pthread_create() failed for walker thread %d\n", j);
+		pthread_mutex_lock(&scan_lock);
+		scan_walkers--;
+		pthread_mutex_unlock(&scan_lock);
+	}
+	/* walk the rest here, in order, storing as it goes */
+	for( i = 0; i < n; i++ )
+		if( !scan_roots[i].dev->walking )
+			walk_root(i);
+	scan_cur = &scan_devs[0];
+	scan_drain(0);
+	for( j = 0; j < ndevs; j++ )
+		if( scan_devs[j].walking )
+			pthread_join(scan_devs[j].walker, NULL);
+
+	for( i = 0; i < n; i++ )
+	{
+#if !USE_FORK
+		if( quitting )
+			break;
+#endif
+		sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", scan_roots[i].media->path);
 	}
+	free(scan_roots);
+	scan_roots = NULL;
+	scan_nroots = 0;
+
+	return 0;
+}
+
+static void
+scan_end(const char *what)
+{
+	unsigned long long elapsed;
+	int complete = 1;
+
+#if !USE_FORK
+	complete = !quitting;
+#endif
+	scan_pool_stop();
+	scan_maps_stop();
+	scan_batch_end();
+	scan_lazy = 0;
+	close_details_reader();
+	close_details_cache(db, complete);
+	if( complete )
+		prune_art_cache();
+	if( scan_io_prio != -1 )
+		set_io_priority(scan_io_prio);
 	_notify_stop();
 	/* Create this index after scanning, so it doesn't slow down the scanning process.
 	 * This index is very useful for large libraries used with an XBox360 (or any
 	 * client that uses UPnPSearch on large containers). */
-	sql_exec(db, "create INDEX IDX_SEARCH_OPT ON OBJECTS(OBJECT_ID, CLASS, DETAIL_ID);");
+	sql_exec(db, "create INDEX if not exists IDX_SEARCH_OPT ON OBJECTS(OBJECT_ID, CLASS, DETAIL_ID);");
+	update_search_index();
 
 	if( GETFLAG(NO_PLAYLIST_MASK) )
 	{
@@ -940,8 +2151,732 @@ start_scanner()
 	{
 		fill_playlists();
 	}
+	defer_child_counts = 0;
+	update_child_counts(NULL);
+
+	/* a scan that was cut short keeps its checkpoint, and no version */
+	if( complete )
+	{
+		sql_exec(db, "DELETE from SETTINGS where KEY = 'scan_checkpoint'");
+		//JM: Set up a db version number, so we know if we need to rebuild due to a new structure.
+		sql_exec(db, "pragma user_version = %d;", DB_VERSION);
+	}
+	/* the scan leaves a WAL the size of the library behind */
+	sql_checkpoint(db, 1);
+
+	elapsed = monotonic_us() - scan_start_us;
+	DPRINTF(E_WARN, L_SCANNER, "%s completed: %llu files in %.1f seconds (%.0f files/s)\n",
+		what, scan_files, elapsed / 1e6, elapsed ? scan_files * 1e6 / elapsed : 0.0);
+}
 
-	DPRINTF(E_DEBUG, L_SCANNER, "Initial file scan completed\n");
-	//JM: Set up a db version number, so we know if we need to rebuild due to a new structure.
-	sql_exec(db, "pragma user_version = %d;", DB_VERSION);
+void
+start_scanner()
+{
+	struct media_dir_s *media_path;
+
+	scan_begin();
+	if( scan_by_device() != 0 )
+	{
+		for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+			scan_media_dir(media_path);
+	}
+	scan_end("Initial file scan");
+}
+
+/* Delete the DETAILS matching where, and every object that uses them */
+static void
+remove_details(const char *fmt, ...)
+{
+	va_list ap;
+	char *where;
+
+	va_start(ap, fmt);
+	where = sqlite3_vmprintf(fmt, ap);
+	va_end(ap);
+	if( !where )
+		return;
+	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
+	valid_cache = 0;
+	delete_objects("DETAIL_ID in (SELECT ID from DETAILS where %s)", where);
+	sql_exec(db, "DELETE from DETAILS where %s", where);
+	sqlite3_free(where);
+}
+
+static void
+remove_tree(const char *path)
+{
+	remove_details("PATH = %Q or (PATH > '%q/' and PATH < '%q0')", path, path, path);
+	sql_exec(db, "DELETE from ALBUM_ART where (PATH > '%q/' and PATH < '%q0')", path, path);
+}
+
+/* Drop the artist, album, genre and folder containers that lost their last
+ * child, along with the details only they used.  The fixed containers from
+ * CreateDatabase() are at most one level below their top container. */
+static void
+remove_empty_containers(void)
+{
+	do
+		delete_objects("CLASS glob 'container*' and OBJECT_ID glob '*$*$*'"
+		               " and OBJECT_ID not glob '" BROWSEDIR_ID "$*'"
+		               " and OBJECT_ID not glob '" MUSIC_PLIST_ID "$*'"
+		               " and OBJECT_ID not in (SELECT PARENT_ID from OBJECTS)");
+	while( sqlite3_changes(db) > 0 );
+	sql_exec(db, "DELETE from DETAILS where PATH is NULL"
+	             " and ID not in (SELECT DETAIL_ID from OBJECTS where DETAIL_ID is not NULL)");
+}
+
+/* The objects a directory held at the last scan */
+struct old_entry
+{
+	char *name;
+	char *objectID;
+	int64_t detailID;
+	int64_t size;
+	int64_t timestamp;
+	int container;
+	int seen;
+};
+
+static int
+load_children(const char *objectID, struct old_entry **entries, struct scan_map *names)
+{
+	sqlite3_stmt *stmt;
+	struct old_entry *e;
+	int n = 0, alloc = 0;
+	const char *path, *id;
+
+	*entries = NULL;
+	stmt = sql_prepare(db, "SELECT o.OBJECT_ID, o.CLASS, d.ID, d.PATH, d.SIZE, d.TIMESTAMP"
+	                       " from OBJECTS o join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                       " where o.PARENT_ID = ? and o.REF_ID is NULL");
+	if( !stmt )
+		return -1;
+	if( sql_bind(stmt, "s", objectID) != SQLITE_OK )
+	{
+		sql_release(stmt);
+		return -1;
+	}
+	while( sql_step(stmt) == SQLITE_ROW )
+	{
+		path = (const char *)sqlite3_column_text(stmt, 3);
+		id = (const char *)sqlite3_column_text(stmt, 0);
+		if( !path || !id || !strrchr(path, '/') )
+			continue;
+		if( n == alloc )
+		{
+			alloc = alloc ? alloc * 2 : 64;
+			e = realloc(*entries, alloc * sizeof(*e));
+			if( !e )
+				break;
+			*entries = e;
+		}
+		e = &(*entries)[n];
+		e->name = strdup(strrchr(path, '/') + 1);
+		e->objectID = strdup(id);
+		if( !e->name || !e->objectID )
+		{
+			free(e->name);
+			free(e->objectID);
+			break;
+		}
+		e->container = (strncmp((const char *)sqlite3_column_text(stmt, 1), "container", 9) == 0);
+		e->detailID = sqlite3_column_int64(stmt, 2);
+		e->size = sqlite3_column_int64(stmt, 4);
+		e->timestamp = sqlite3_column_int64(stmt, 5);
+		e->seen = 0;
+		scan_map_set(names, e->name, strlen(e->name), n++);
+	}
+	sql_release(stmt);
+
+	return n;
+}
+
+/* Set while resuming a scan that was cut short: a directory that has
+ * its TIMESTAMP was completed before, so it is not looked at again */
+static int resuming = 0;
+
+/* Bring the objects below parent, scanned from dir at the last scan, up
+ * to date with what dir holds now.  Files whose size and mtime haven't
+ * changed are left alone.  If the directory's own mtime hasn't changed
+ * either, no entries were added or removed, so it isn't even listed.
+ * Returns 0 once all of dir has been looked at. */
+static int
+RescanDirectory(int atfd, const char *dir, const char *parent, int64_t mtime,
+                media_types dir_types, const char *currentPassword)
+{
+	struct dir_list list;
+	struct old_entry *old = NULL, *e;
+	struct scan_map names;
+	struct scan_map_entry *m;
+	struct stat st;
+	char objectID[128];
+	char *full_path = NULL, *name, *sub;
+	const char *d_name;
+	char password[11];
+	int (*filter)(scan_filter *);
+	enum file_types type;
+	int i, n = 0, fd, count, next, unchanged, complete = 0;
+	size_t dir_len;
+	DIR *dirp;
+
+	memset(&names, '\0', sizeof(names));
+	memset(&list, '\0', sizeof(list));
+	snprintf(objectID, sizeof(objectID), "%s%s", BROWSEDIR_ID, parent);
+	switch( dir_types )
+	{
+		case ALL_MEDIA: filter = filter_avp; break;
+		case TYPE_AUDIO: filter = filter_a; break;
+		case TYPE_AUDIO|TYPE_VIDEO: filter = filter_av; break;
+		case TYPE_AUDIO|TYPE_IMAGES: filter = filter_ap; break;
+		case TYPE_VIDEO: filter = filter_v; break;
+		case TYPE_VIDEO|TYPE_IMAGES: filter = filter_vp; break;
+		case TYPE_IMAGES: filter = filter_p; break;
+		default: return -1;
+	}
+	fd = openat(atfd, atfd == AT_FDCWD ? dir : strrchr(dir, '/') + 1, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if( fd < 0 || !(dirp = fdopendir(fd)) )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s [%s]\n", dir, strerror(errno));
+		if( fd >= 0 )
+			close(fd);
+		return -1;
+	}
+	unchanged = (mtime && fstat(fd, &st) == 0 && st.st_mtime == mtime);
+	DPRINTF(E_DEBUG, L_SCANNER, "Rescanning %s%s\n", dir, unchanged ? " (unchanged)" : "");
+
+	n = load_children(objectID, &old, &names);
+	if( n < 0 || !(full_path = malloc(PATH_MAX)) )
+		goto done;
+	dir_len = snprintf(full_path, PATH_MAX, "%s/", dir);
+	if( dir_len >= PATH_MAX )
+		goto done;
+	if (faccessat(fd, ".password", F_OK, 0) == 0) {
+	    strncpyt(full_path + dir_len, ".password", PATH_MAX - dir_len);
+	    readPassword(full_path, password, 11);
+	} else {
+	    strcpy(password, currentPassword);
+	}
+	next = get_next_available_id("OBJECTS", objectID);
+
+	/* An unchanged directory holds the same names as last time, so only
+	 * what we already have needs a look */
+	if( unchanged )
+		count = n;
+	else if( read_dir(dirp, filter, &list) == 0 )
+		count = list.count;
+	else
+		goto done;
+
+	for( i = 0; i < count; i++ )
+	{
+#if !USE_FORK
+		if( quitting )
+			goto done;
+#endif
+		if( unchanged )
+		{
+			e = &old[i];
+			d_name = e->name;
+			type = TYPE_UNKNOWN;
+		}
+		else
+		{
+			d_name = list.entries[i].name;
+			type = list.entries[i].type;
+			m = scan_map_find(&names, d_name, strlen(d_name));
+			e = m ? &old[m->value] : NULL;
+		}
+		strncpyt(full_path + dir_len, d_name, PATH_MAX - dir_len);
+		if( type == TYPE_UNKNOWN )
+			type = resolve_unknown_type_at(fd, d_name, full_path, dir_types);
+		/* an entry that was replaced by something else is new */
+		if( e && e->container == (type == TYPE_DIR) )
+			e->seen = 1;
+		else
+			e = NULL;
+
+		if( (type == TYPE_DIR) && (faccessat(fd, d_name, R_OK|X_OK, 0) == 0) )
+		{
+			if( e && resuming && e->timestamp )
+				continue;
+			if( fstatat(fd, d_name, &st, 0) != 0 )
+				st.st_mtime = 0;
+			if( e )
+			{
+				if( RescanDirectory(fd, full_path, e->objectID + strlen(BROWSEDIR_ID),
+				                    e->timestamp, dir_types, password) == 0 )
+					scan_dir_done(full_path, st.st_mtime);
+				continue;
+			}
+			name = escape_tag(d_name, 1);
+			scan_entry(TYPE_DIR, name, full_path, parent, next, 0, dir_types, password);
+			xasprintf(&sub, "%s$%X", parent, next++);
+			ScanDirectory(fd, full_path, sub, dir_types, password, 0);
+			scan_dir_done(full_path, st.st_mtime);
+			free(sub);
+			free(name);
+		}
+		else if( type == TYPE_FILE && (faccessat(fd, d_name, R_OK, 0) == 0) )
+		{
+			if( e )
+			{
+				if( fstatat(fd, d_name, &st, 0) == 0 &&
+				    st.st_size == e->size && st.st_mtime == e->timestamp )
+					continue;
+				DPRINTF(E_DEBUG, L_SCANNER, "%s changed since the last scan\n", full_path);
+				remove_details("ID = %lld", (long long)e->detailID);
+			}
+			else if( is_playlist(d_name) &&
+			         sql_get_int_bind(db, "SELECT count(*) from PLAYLISTS where PATH = ?", "s", full_path) > 0 )
+				continue;
+			name = escape_tag(d_name, 1);
+			scan_entry(TYPE_FILE, name, full_path, parent, next++, 0, dir_types, password);
+			free(name);
+		}
+		else if( e )
+			e->seen = 0;
+	}
+	complete = 1;
+
+done:
+	/* whatever wasn't found again is gone */
+	for( i = 0; i < n; i++ )
+	{
+		if( complete && !old[i].seen )
+		{
+			strncpyt(full_path + dir_len, old[i].name, PATH_MAX - dir_len);
+			DPRINTF(E_DEBUG, L_SCANNER, "%s removed since the last scan\n", full_path);
+			if( old[i].container )
+				remove_tree(full_path);
+			else
+				remove_details("ID = %lld", (long long)old[i].detailID);
+		}
+		free(old[i].name);
+		free(old[i].objectID);
+	}
+	free(old);
+	scan_map_clear(&names);
+	free_dir(&list);
+	free(full_path);
+	closedir(dirp);
+
+	return complete ? 0 : -1;
+}
+
+static int
+media_dir_scanned(const char *path)
+{
+	return sql_get_int_field(db, "SELECT count(*) from SETTINGS where KEY = 'media_dir' and VALUE = %Q", path) > 0;
+}
+
+void
+start_rescan(void)
+{
+	struct media_dir_s *media_path;
+	char **result;
+	char *objectID, *checkpoint;
+	int i, ret, rows = 0;
+
+	/* A database that never got its version is a scan that was cut short */
+	resuming = (sql_get_int_field(db, "PRAGMA user_version") == 0);
+	if( resuming )
+	{
+		checkpoint = sql_get_text_field(db, "SELECT VALUE from SETTINGS where KEY = 'scan_checkpoint'");
+		DPRINTF(E_WARN, L_SCANNER, "Resuming the interrupted scan after %s\n",
+			checkpoint && *checkpoint ? checkpoint : "the start");
+		sqlite3_free(checkpoint);
+	}
+	scan_begin();
+
+	/* With a single media_dir, its entries sit right in Browse Folders */
+	if( GETFLAG(MERGE_MEDIA_DIRS_MASK) || !media_dirs->next )
+	{
+		media_path = media_dirs;
+		if( sql_get_int_field(db, "SELECT count(*) from DETAILS where PATH = %Q and TIMESTAMP = %d",
+		                      media_path->path, media_path->types) > 0 )
+		{
+			ret = RescanDirectory(AT_FDCWD, media_path->path, "", 0, media_path->types, "");
+			scan_drain(0);
+			if( ret == 0 && !media_dir_scanned(media_path->path) )
+				sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
+		}
+		else
+			scan_media_dir(media_path);
+		goto done;
+	}
+
+	/* Drop the media_dirs that are gone, or that now hold other types */
+	if( sql_get_table(db, "SELECT d.PATH from OBJECTS o join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                      " where o.PARENT_ID = '" BROWSEDIR_ID "' and d.PATH is not NULL",
+	                  &result, &rows, NULL) == SQLITE_OK )
+	{
+		for( i = 1; i <= rows; i++ )
+		{
+			for( media_path = media_dirs; media_path; media_path = media_path->next )
+				if( strcmp(result[i], media_path->path) == 0 )
+					break;
+			if( media_path &&
+			    sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = %Q", result[i]) == media_path->types )
+				continue;
+			DPRINTF(E_WARN, L_SCANNER, "Removing %s from the database\n", result[i]);
+			remove_tree(result[i]);
+			sql_exec(db, "DELETE from SETTINGS where KEY = 'media_dir' and VALUE = %Q", result[i]);
+		}
+		sqlite3_free_table(result);
+	}
+
+	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+	{
+#if !USE_FORK
+		if( quitting )
+			break;
+#endif
+		objectID = sql_get_text_field(db, "SELECT o.OBJECT_ID from OBJECTS o join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                                  " where d.PATH = %Q and o.PARENT_ID = '%s'", media_path->path, BROWSEDIR_ID);
+		if( !objectID )
+		{
+			scan_media_dir(media_path);
+			continue;
+		}
+		/* The root TIMESTAMP holds the media type, so always list it */
+		if( !resuming || !media_dir_scanned(media_path->path) )
+		{
+			ret = RescanDirectory(AT_FDCWD, media_path->path, objectID + strlen(BROWSEDIR_ID), 0,
+			                      media_path->types, "");
+			scan_drain(0);
+			if( ret == 0 && !media_dir_scanned(media_path->path) )
+				sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
+		}
+		sqlite3_free(objectID);
+	}
+
+done:
+	remove_empty_containers();
+	scan_end(resuming ? "Resumed file scan" : "Rescan");
+	resuming = 0;
+}
+
+/* With lazy_metadata, the scan stores a placeholder for each file it has
+ * no cached details for, and lists it in PENDING.  Once the scan is done,
+ * a thread of the server reads their metadata in the background, and
+ * files them by album, date and so on.  The files clients browse or play
+ * are read ahead of the rest. */
+#define BACKFILL_WANTED 256
+#define BACKFILL_BATCH 64
+
+pthread_mutex_t library_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile int backfilling = 0;
+static pthread_mutex_t wanted_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t wanted[BACKFILL_WANTED];
+static int wanted_head, wanted_count;
+static pthread_t backfill_tid;
+static int backfill_started = 0;
+
+struct backfill_item
+{
+	int64_t id;
+	char *name;
+	char *path;
+	int ret;
+	int moved;		/* read as another type than its placeholder */
+	struct file_entry f;
+};
+
+void
+backfill_want(int64_t detailID)
+{
+	if( !backfilling )
+		return;
+	pthread_mutex_lock(&wanted_lock);
+	/* when full, the oldest request gives way */
+	wanted[(wanted_head + wanted_count) % BACKFILL_WANTED] = detailID;
+	if( wanted_count < BACKFILL_WANTED )
+		wanted_count++;
+	else
+		wanted_head = (wanted_head + 1) % BACKFILL_WANTED;
+	pthread_mutex_unlock(&wanted_lock);
+}
+
+static int64_t
+next_wanted(void)
+{
+	int64_t id = 0;
+
+	pthread_mutex_lock(&wanted_lock);
+	if( wanted_count )
+	{
+		id = wanted[wanted_head];
+		wanted_head = (wanted_head + 1) % BACKFILL_WANTED;
+		wanted_count--;
+	}
+	pthread_mutex_unlock(&wanted_lock);
+
+	return id;
+}
+
+static media_types
+media_dir_types(const char *path)
+{
+	struct media_dir_s *media_path;
+	size_t len;
+
+	for( media_path = media_dirs; media_path; media_path = media_path->next )
+	{
+		len = strlen(media_path->path);
+		if( strncmp(path, media_path->path, len) == 0 && path[len] == '/' )
+			return media_path->types;
+	}
+
+	return ALL_MEDIA;
+}
+
+/* Read the metadata of a pending file, without holding library_lock.
+ * If it can't even be looked up, item->path is left NULL. */
+static int
+backfill_read(int64_t id, struct backfill_item *item)
+{
+	sqlite3_stmt *stmt;
+	const char *class;
+	enum details_type type;
+	char *name;
+
+	memset(item, '\0', sizeof(*item));
+	item->id = id;
+	stmt = sql_prepare(db, "SELECT d.PATH, o.CLASS from PENDING p join DETAILS d on (d.ID = p.ID)"
+	                       " join OBJECTS o on (o.DETAIL_ID = p.ID)"
+	                       " where p.ID = ? and o.REF_ID is NULL");
+	if( !stmt )
+		return -1;
+	if( sql_bind(stmt, "I", id) != SQLITE_OK || sql_step(stmt) != SQLITE_ROW )
+	{
+		sql_release(stmt);
+		return -1;
+	}
+	item->path = strdup((const char *)sqlite3_column_text(stmt, 0));
+	class = (const char *)sqlite3_column_text(stmt, 1);
+	strncpyt(item->f.class, class, sizeof(item->f.class));
+	sql_release(stmt);
+	if( !item->path || !(name = strrchr(item->path, '/')) ||
+	    !(item->name = escape_tag(name + 1, 1)) )
+	{
+		free(item->path);
+		item->path = NULL;
+		return -1;
+	}
+
+	if( strstr(item->f.class, "imageItem") )
+		type = DETAILS_IMAGE;
+	else if( strstr(item->f.class, "videoItem") )
+		type = DETAILS_VIDEO;
+	else
+		type = DETAILS_AUDIO;
+	name = strdup(item->name);
+	item->ret = name ? read_details(type, item->path, item->name, &item->f.details) : -1;
+	/* as read_file() does, an audio file in a video container */
+	if( item->ret != 0 && type == DETAILS_VIDEO && name && is_audio(name) &&
+	    (media_dir_types(item->path) & TYPE_AUDIO) )
+	{
+		strcpy(item->name, name);
+		item->ret = read_details(DETAILS_AUDIO, item->path, item->name, &item->f.details);
+		if( item->ret == 0 )
+		{
+			item->moved = 1;
+			strcpy(item->f.base, MUSIC_DIR_ID);
+			strcpy(item->f.class, "item.audioItem.musicTrack");
+		}
+	}
+	free(name);
+
+	return 0;
+}
+
+/* Store what backfill_read() found, unless the file changed meanwhile */
+static void
+backfill_store(struct backfill_item *item)
+{
+	char objectID[64], password[11], parent[64];
+	char *p;
+
+	if( !item->path )
+	{
+		/* tried, and there is nothing more to be done for it */
+		sql_exec_bind(db, "DELETE from PENDING where ID = ?", "I", item->id);
+		return;
+	}
+	p = sql_get_text_bind(db, "SELECT o.OBJECT_ID from PENDING p join OBJECTS o on (o.DETAIL_ID = p.ID)"
+	                          " where p.ID = ? and o.REF_ID is NULL", "I", item->id);
+	if( !p )
+	{
+		if( item->ret == 0 )
+			free_details(&item->f.details);
+		return;
+	}
+	strncpyt(objectID, p, sizeof(objectID));
+	sqlite3_free(p);
+	p = sql_get_text_bind(db, "SELECT PASSWORD from OBJECTS where OBJECT_ID = ?", "s", objectID);
+	strncpyt(password, p ? p : "", sizeof(password));
+	sqlite3_free(p);
+	sql_exec_bind(db, "DELETE from PENDING where ID = ?", "I", item->id);
+
+	if( item->ret != 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Unsuccessful getting details for %s!\n", item->path);
+		remove_details("ID = %lld", (long long)item->id);
+	}
+	else if( item->moved )
+	{
+		/* another type goes in other containers; keep its ObjectID */
+		remove_details("ID = %lld", (long long)item->id);
+		strncpyt(parent, objectID + strlen(BROWSEDIR_ID), sizeof(parent));
+		p = strrchr(parent, '$');
+		*p = '\0';
+		store_file(item->name, item->path, parent, strtol(p + 1, NULL, 16), password, &item->f);
+	}
+	else
+	{
+		item->f.details.id = item->id;
+		cache_details(db, &item->f.details);
+		if( store_details(&item->f.details) )
+			insert_containers(item->name, item->path, objectID, item->f.class, item->id, password);
+		else
+			delete_objects("DETAIL_ID = %lld", (long long)item->id);
+	}
+}
+
+static void *
+backfill_thread(void *arg)
+{
+	struct backfill_item *items;
+	char path[PATH_MAX];
+	unsigned long long start;
+	int64_t next = 0, id;
+	int i, n, count, done = 0, was_wanted, lav_shared, ret, end = 0;
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	snprintf(path, sizeof(path), "%s/files.db", db_path);
+	items = calloc(BACKFILL_BATCH, sizeof(*items));
+	if( !items || !(db = sql_open(path, 0)) )
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Failed to start reading metadata in the background\n");
+		free(items);
+		backfilling = 0;
+		return NULL;
+	}
+	if (setpriority(PRIO_PROCESS, 0, 19) == -1)
+		DPRINTF(E_WARN, L_SCANNER, "Failed to reduce backfill thread priority\n");
+	if (set_io_priority(IO_PRIO_IDLE) == -1)
+		DPRINTF(E_INFO, L_SCANNER, "Failed to reduce backfill I/O priority\n");
+	av_register_all();
+	av_log_set_level(AV_LOG_PANIC);
+	/* otherwise inotify must not read a file at the same time */
+	lav_shared = lav_threads_init();
+	pthread_mutex_lock(&library_lock);
+	open_details_cache(db);
+	pthread_mutex_unlock(&library_lock);
+	count = sql_get_int_field(db, "SELECT count(*) from PENDING");
+	DPRINTF(E_WARN, L_SCANNER, "Reading the metadata of %d files in the background\n", count);
+
+	while( !quitting )
+	{
+		/* read for up to a second, stopping early for a wanted file */
+		start = monotonic_us();
+		n = 0;
+		while( n < BACKFILL_BATCH && !quitting &&
+		       monotonic_us() - start < SCAN_BATCH_MSEC * 1000ULL )
+		{
+			was_wanted = ((id = next_wanted()) != 0);
+			if( !was_wanted )
+			{
+				id = sql_get_int64_bind(db, "SELECT ID from PENDING where ID > ? order by ID limit 1", "I", next);
+				if( id <= 0 )
+				{
+					end = 1;
+					break;
+				}
+				next = id;
+			}
+			if( !lav_shared )
+				pthread_mutex_lock(&library_lock);
+			ret = backfill_read(id, &items[n++]);
+			if( !lav_shared )
+				pthread_mutex_unlock(&library_lock);
+			if( was_wanted && ret == 0 )
+				break;
+		}
+		if( !n )
+		{
+			if( end )
+				break;
+			continue;
+		}
+
+		pthread_mutex_lock(&library_lock);
+		if( sql_exec(db, "BEGIN IMMEDIATE") != SQLITE_OK )
+			DPRINTF(E_WARN, L_SCANNER, "Storing metadata without a transaction\n");
+		for( i = 0; i < n; i++ )
+		{
+			if( items[i].path )
+				done++;
+			backfill_store(&items[i]);
+			free(items[i].name);
+			free(items[i].path);
+		}
+		if( !sqlite3_get_autocommit(db) && sql_exec(db, "COMMIT") != SQLITE_OK )
+			sql_exec(db, "ROLLBACK");
+		pthread_mutex_unlock(&library_lock);
+		if( end )
+			break;
+	}
+
+	pthread_mutex_lock(&library_lock);
+	if( !quitting )
+		remove_empty_containers();
+	/* inotify looks the cache up while it holds library_lock */
+	close_details_cache(db, 0);
+	pthread_mutex_unlock(&library_lock);
+	if( !quitting )
+		DPRINTF(E_WARN, L_SCANNER, "Background metadata reading completed: %d files\n", done);
+	close_details_reader();
+	sql_close(db);
+	db = NULL;
+	free(items);
+	backfilling = 0;
+
+	return NULL;
+}
+
+int
+start_backfill(void)
+{
+	if( backfilling )
+		return 0;
+	if( backfill_started )
+	{
+		pthread_join(backfill_tid, NULL);
+		backfill_started = 0;
+	}
+	if( sql_get_int_field(db, "SELECT count(*) from PENDING") <= 0 )
+		return 0;
+	backfilling = 1;
+	if( pthread_create(&backfill_tid, NULL, backfill_thread, NULL) != 0 )
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "pthread_create() failed for the backfill thread\n");
+		backfilling = 0;
+		return -1;
+	}
+	backfill_started = 1;
+
+	return 0;
+}
+
+void
+stop_backfill(void)
+{
+	if( !backfill_started )
+		return;
+	pthread_join(backfill_tid, NULL);
+	backfill_started = 0;
 }
@@ -24,6 +24,8 @@
 #ifndef __SCANNER_H__
 #define __SCANNER_H__
 
+#include <pthread.h>
+
 /* Try to be generally PlaysForSure compatible by using similar IDs */
 #define BROWSEDIR_ID		"64"
 
@@ -77,10 +79,66 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 int
 insert_file(char *name, const char *path, const char *parentID, int object, media_types dir_types, const char *password);
 
+/* delete_objects()
+ * delete the objects matching a WHERE clause, keeping
+ * their containers' CHILD_COUNT up to date */
+int
+delete_objects(const char *fmt, ...);
+
+/* update_child_counts()
+ * recompute CHILD_COUNT for every container, or those under parentID,
+ * and return how many were out of date */
+int
+update_child_counts(const char *parentID);
+
+/* update_search_index()
+ * create or drop the full-text index used by Search, to match
+ * the search_index setting */
+int
+update_search_index(void);
+
 int
 CreateDatabase(void);
 
 void
 start_scanner();
 
+/* start_rescan()
+ * bring an existing database up to date after media_dirs were added,
+ * removed or changed, reading only what changed on disk */
+void
+start_rescan(void);
+
+/* scan_io_init()
+ * set up the stream count that the scanner process sees, before it is
+ * forked.  scan_io_streaming() adds or removes a stream, and while there
+ * are any, files are read at most scan_io_budget a second. */
+int
+scan_io_init(void);
+
+void
+scan_io_streaming(int delta);
+
+/* Held while the library is being changed, by the inotify thread and
+ * by the backfill thread in turn */
+extern pthread_mutex_t library_lock;
+
+/* Set while the metadata that a lazy_metadata scan skipped is read */
+extern volatile int backfilling;
+
+/* start_backfill()
+ * start reading the metadata of the files listed in PENDING on a thread
+ * of its own, if there are any */
+int
+start_backfill(void);
+
+void
+stop_backfill(void);
+
+/* backfill_want()
+ * read detailID before the other pending files, because a client is
+ * looking at it */
+void
+backfill_want(int64_t detailID);
+
 #endif
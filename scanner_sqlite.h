@@ -30,7 +30,8 @@ char create_objectTable_sqlite[] = "CREATE TABLE OBJECTS ("
 					"CLASS TEXT NOT NULL, "
 					"DETAIL_ID INTEGER DEFAULT NULL, "
                                         "NAME TEXT DEFAULT NULL, "
-					"PASSWORD CHAR(10) DEFAULT '');";
+					"PASSWORD CHAR(10) DEFAULT '', "
+					"CHILD_COUNT INTEGER DEFAULT 0);";
 
 char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
@@ -85,4 +86,9 @@ char create_settingsTable_sqlite[] = "CREATE TABLE SETTINGS ("
 					"VALUE TEXT"
 					");";
 
+/* DETAILS rows that only hold what the lazy scan could tell
+ * without reading the file */
+char create_pendingTable_sqlite[] = "CREATE TABLE PENDING ("
+					"ID INTEGER PRIMARY KEY"
+					");";
 
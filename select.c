@@ -0,0 +1,177 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#ifndef HAVE_EPOLL
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "log.h"
+
+static fd_set master_read_fd_set;
+static fd_set master_write_fd_set;
+static int max_fd = -1;
+static int nevents;
+static struct event **events;
+
+static int
+select_init(void)
+{
+	events = calloc(FD_SETSIZE, sizeof(struct event *));
+	if (events == NULL)
+		return -1;
+
+	FD_ZERO(&master_read_fd_set);
+	FD_ZERO(&master_write_fd_set);
+	max_fd = -1;
+	nevents = 0;
+
+	return 0;
+}
+
+static void
+select_fini(void)
+{
+	free(events);
+	events = NULL;
+}
+
+static void
+select_set(struct event *ev)
+{
+	FD_CLR(ev->fd, &master_read_fd_set);
+	FD_CLR(ev->fd, &master_write_fd_set);
+	if (ev->rdwr == EVENT_WRITE)
+		FD_SET(ev->fd, &master_write_fd_set);
+	else
+		FD_SET(ev->fd, &master_read_fd_set);
+}
+
+static int
+select_add(struct event *ev)
+{
+	if (ev->fd >= FD_SETSIZE || nevents >= FD_SETSIZE)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "select(): descriptor %d out of range\n", ev->fd);
+		return -1;
+	}
+
+	select_set(ev);
+	if (max_fd != -1 && max_fd < ev->fd)
+		max_fd = ev->fd;
+
+	events[nevents] = ev;
+	ev->index = nevents++;
+
+	return 0;
+}
+
+static int
+select_mod(struct event *ev)
+{
+	if (ev->index < 0)
+		return -1;
+	select_set(ev);
+
+	return 0;
+}
+
+static int
+select_del(struct event *ev)
+{
+	if (ev->index < 0)
+		return 0;
+
+	FD_CLR(ev->fd, &master_read_fd_set);
+	FD_CLR(ev->fd, &master_write_fd_set);
+	if (max_fd == ev->fd)
+		max_fd = -1;
+
+	if (ev->index < --nevents)
+	{
+		events[ev->index] = events[nevents];
+		events[ev->index]->index = ev->index;
+	}
+	ev->index = -1;
+
+	return 0;
+}
+
+static int
+select_process(int msec)
+{
+	struct timeval tv, *tp;
+	fd_set readset, writeset;
+	struct event *ev;
+	int i, ready;
+
+	if (max_fd == -1)
+	{
+		for (i = 0; i < nevents; i++)
+		{
+			if (max_fd < events[i]->fd)
+				max_fd = events[i]->fd;
+		}
+	}
+
+	if (msec >= 0)
+	{
+		tv.tv_sec = msec / 1000;
+		tv.tv_usec = (msec % 1000) * 1000;
+		tp = &tv;
+	}
+	else
+		tp = NULL;
+
+	readset = master_read_fd_set;
+	writeset = master_write_fd_set;
+
+	ready = select(max_fd + 1, &readset, &writeset, NULL, tp);
+	if (ready < 0)
+		return -1;
+
+	/* A handler may delete its own event, which moves the last entry
+	 * into its slot; that entry is simply picked up on the next pass. */
+	for (i = 0; i < nevents && ready > 0; i++)
+	{
+		ev = events[i];
+		if (FD_ISSET(ev->fd, ev->rdwr == EVENT_WRITE ? &writeset : &readset))
+		{
+			ready--;
+			ev->process(ev);
+		}
+	}
+
+	return 0;
+}
+
+struct event_module event_module = {
+	.init =		select_init,
+	.fini =		select_fini,
+	.add =		select_add,
+	.mod =		select_mod,
+	.del =		select_del,
+	.process =	select_process,
+};
+#endif /* !HAVE_EPOLL */
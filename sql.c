@@ -16,9 +16,12 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
+#include "config.h"
 #include "sql.h"
 #include "upnpglobalvars.h"
 #include "log.h"
@@ -259,6 +262,343 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 	return str;
 }
 
+/* Prepared statements, cached per connection and keyed by their SQL text.
+ * A statement is handed to one caller at a time; if it is already in use
+ * (a nested query), or the cache is full, the caller gets a private one
+ * that sql_release() finalizes. */
+#define STMT_CACHE_BUCKETS 64
+#define STMT_CACHE_MAX 256
+
+struct stmt_cache_s {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	unsigned int hash;
+	int busy;
+	struct stmt_cache_s *next;
+};
+
+static struct stmt_cache_s *stmt_cache[STMT_CACHE_BUCKETS];
+static int stmt_cached = 0;
+static pthread_mutex_t stmt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+stmt_hash(sqlite3 *db, const char *sql)
+{
+	unsigned int hash = (unsigned int)(uintptr_t)db;
+
+	while (*sql)
+		hash = hash * 33 + (unsigned char)*sql++;
+
+	return hash;
+}
+
+sqlite3_stmt *
+sql_prepare(sqlite3 *db, const char *sql)
+{
+	struct stmt_cache_s *entry;
+	sqlite3_stmt *stmt;
+	unsigned int hash;
+
+	hash = stmt_hash(db, sql);
+	pthread_mutex_lock(&stmt_lock);
+	for (entry = stmt_cache[hash % STMT_CACHE_BUCKETS]; entry; entry = entry->next)
+	{
+		if (entry->hash == hash && entry->db == db && !entry->busy &&
+		    strcmp(sqlite3_sql(entry->stmt), sql) == 0)
+		{
+			entry->busy = 1;
+			pthread_mutex_unlock(&stmt_lock);
+			return entry->stmt;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		sqlite3_finalize(stmt);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&stmt_lock);
+	if (stmt_cached < STMT_CACHE_MAX && (entry = malloc(sizeof(*entry))))
+	{
+		entry->db = db;
+		entry->stmt = stmt;
+		entry->hash = hash;
+		entry->busy = 1;
+		entry->next = stmt_cache[hash % STMT_CACHE_BUCKETS];
+		stmt_cache[hash % STMT_CACHE_BUCKETS] = entry;
+		stmt_cached++;
+	}
+	pthread_mutex_unlock(&stmt_lock);
+
+	return stmt;
+}
+
+/* Bind one parameter per letter of types, in order:
+ * i int, I int64_t, s const char * (NULL binds NULL) */
+static int
+sql_vbind(sqlite3_stmt *stmt, const char *types, va_list ap)
+{
+	const char *text;
+	int i, ret = SQLITE_OK;
+
+	for (i = 1; types[i-1] && ret == SQLITE_OK; i++)
+	{
+		switch (types[i-1])
+		{
+		case 'i':
+			ret = sqlite3_bind_int(stmt, i, va_arg(ap, int));
+			break;
+		case 'I':
+			ret = sqlite3_bind_int64(stmt, i, va_arg(ap, int64_t));
+			break;
+		case 's':
+			text = va_arg(ap, const char *);
+			if (text)
+				ret = sqlite3_bind_text(stmt, i, text, -1, SQLITE_STATIC);
+			else
+				ret = sqlite3_bind_null(stmt, i);
+			break;
+		default:
+			DPRINTF(E_ERROR, L_DB_SQL, "Unknown bind type '%c'\n", types[i-1]);
+			ret = SQLITE_MISUSE;
+			break;
+		}
+	}
+	if (ret != SQLITE_OK)
+		DPRINTF(E_ERROR, L_DB_SQL, "bind failed: %s\n%s\n",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)), sqlite3_sql(stmt));
+
+	return ret;
+}
+
+int
+sql_bind(sqlite3_stmt *stmt, const char *types, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, types);
+	ret = sql_vbind(stmt, types, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+int
+sql_step(sqlite3_stmt *stmt)
+{
+	int counter, result;
+
+	for (counter = 0;
+	     ((result = sqlite3_step(stmt)) == SQLITE_BUSY || result == SQLITE_LOCKED) && counter < 2;
+	     counter++)
+	{
+		/* While SQLITE_BUSY has a built in timeout,
+		 * SQLITE_LOCKED does not, so sleep */
+		if (result == SQLITE_LOCKED)
+			sleep(1);
+		sqlite3_reset(stmt);
+	}
+	if (result != SQLITE_ROW && result != SQLITE_DONE)
+		DPRINTF(E_WARN, L_DB_SQL, "step failed: %s\n%s\n",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)), sqlite3_sql(stmt));
+
+	return result;
+}
+
+void
+sql_release(sqlite3_stmt *stmt)
+{
+	struct stmt_cache_s *entry;
+	unsigned int hash;
+
+	if (!stmt)
+		return;
+	hash = stmt_hash(sqlite3_db_handle(stmt), sqlite3_sql(stmt));
+	pthread_mutex_lock(&stmt_lock);
+	for (entry = stmt_cache[hash % STMT_CACHE_BUCKETS]; entry; entry = entry->next)
+	{
+		if (entry->stmt == stmt)
+		{
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			entry->busy = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+	if (!entry)
+		sqlite3_finalize(stmt);
+}
+
+/* Prepare (or reuse), bind, and run a statement to its first row */
+static sqlite3_stmt *
+sql_vrun(sqlite3 *db, const char *sql, const char *types, va_list ap, int *result)
+{
+	sqlite3_stmt *stmt;
+
+	*result = SQLITE_ERROR;
+	stmt = sql_prepare(db, sql);
+	if (!stmt)
+		return NULL;
+	if (sql_vbind(stmt, types, ap) == SQLITE_OK)
+		*result = sql_step(stmt);
+
+	return stmt;
+}
+
+int
+sql_exec_bind(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	int result;
+
+	va_start(ap, types);
+	stmt = sql_vrun(db, sql, types, ap, &result);
+	va_end(ap);
+	sql_release(stmt);
+
+	return (result == SQLITE_DONE || result == SQLITE_ROW) ? SQLITE_OK : result;
+}
+
+int
+sql_get_int_bind(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	int result, ret;
+
+	va_start(ap, types);
+	stmt = sql_vrun(db, sql, types, ap, &result);
+	va_end(ap);
+	if (result == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+	else
+		ret = (result == SQLITE_DONE) ? 0 : -1;
+	sql_release(stmt);
+
+	return ret;
+}
+
+int64_t
+sql_get_int64_bind(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	int result;
+	int64_t ret;
+
+	va_start(ap, types);
+	stmt = sql_vrun(db, sql, types, ap, &result);
+	va_end(ap);
+	if (result == SQLITE_ROW)
+		ret = sqlite3_column_int64(stmt, 0);
+	else
+		ret = (result == SQLITE_DONE) ? 0 : -1;
+	sql_release(stmt);
+
+	return ret;
+}
+
+char *
+sql_get_text_bind(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	int result;
+	char *str = NULL;
+
+	va_start(ap, types);
+	stmt = sql_vrun(db, sql, types, ap, &result);
+	va_end(ap);
+	if (result == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+		str = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 0));
+	sql_release(stmt);
+
+	return str;
+}
+
+/* Drop the cached statements of a connection, then close it */
+int
+sql_close(sqlite3 *db)
+{
+	struct stmt_cache_s **prev, *entry;
+	int i;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < STMT_CACHE_BUCKETS; i++)
+	{
+		prev = &stmt_cache[i];
+		while ((entry = *prev))
+		{
+			if (entry->db != db)
+			{
+				prev = &entry->next;
+				continue;
+			}
+			*prev = entry->next;
+			sqlite3_finalize(entry->stmt);
+			free(entry);
+			stmt_cached--;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+
+	return sqlite3_close(db);
+}
+
+volatile unsigned int sql_commits = 0;
+
+static int
+sql_commit_hook(void *arg)
+{
+	__sync_fetch_and_add(&sql_commits, 1);
+	return 0;
+}
+
+sqlite3 *
+sql_open(const char *path, int readonly)
+{
+	sqlite3 *db;
+	char *mode;
+	int flags;
+
+	flags = readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE;
+	if (sqlite3_open_v2(path, &db, flags, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "Failed to open %s: %s\n", path, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+	sqlite3_busy_timeout(db, 5000);
+	if (readonly)
+		return db;
+
+	/* page_size has to come first: it can't change once in WAL mode */
+	sql_exec(db, "pragma page_size = 4096");
+	mode = sql_get_text_field(db, "pragma journal_mode = WAL");
+	if (!mode || strcmp(mode, "wal") != 0)
+		DPRINTF(E_WARN, L_DB_SQL, "%s is not in WAL mode; readers will wait for writers\n", path);
+	sqlite3_free(mode);
+	/* a crash can lose the last commits, but not corrupt the database */
+	sql_exec(db, "pragma synchronous = NORMAL");
+	sqlite3_commit_hook(db, sql_commit_hook, NULL);
+
+	return db;
+}
+
+/* Copy the WAL back into files.db.  A passive checkpoint never waits;
+ * a truncating one waits for readers to finish, then empties the WAL. */
+int
+sql_checkpoint(sqlite3 *db, int truncate)
+{
+	return sql_exec(db, "pragma wal_checkpoint(%s)", truncate ? "TRUNCATE" : "PASSIVE");
+}
+
 int
 db_upgrade(sqlite3 *db)
 {
@@ -279,6 +619,21 @@ db_upgrade(sqlite3 *db)
 	    ret = sql_exec(db, "ALTER TABLE OBJECTS ADD COLUMN PASSWORD CHAR(10) DEFAULT NULL");
 	    if (ret != SQLITE_OK) return -1;
 	}
+	if (db_vers <= 10) {
+	    /* filled in by the child count check at startup */
+	    ret = sql_exec(db, "ALTER TABLE OBJECTS ADD COLUMN CHILD_COUNT INTEGER DEFAULT 0");
+	    if (ret != SQLITE_OK) return -1;
+	}
+	if (db_vers <= 11) {
+	    /* copies of the OBJECT_ID unique index and the DETAILS rowid */
+	    sql_exec(db, "DROP INDEX if exists IDX_OBJECTS_OBJECT_ID");
+	    sql_exec(db, "DROP INDEX if exists IDX_DETAILS_ID");
+	}
+	if (db_vers <= 12) {
+	    /* files whose metadata the backfill hasn't read yet */
+	    ret = sql_exec(db, "CREATE TABLE PENDING (ID INTEGER PRIMARY KEY)");
+	    if (ret != SQLITE_OK) return -1;
+	}
 
 	sql_exec(db, "PRAGMA user_version = %d", DB_VERSION);
 
@@ -34,6 +34,11 @@
 #define sqlite3_prepare_v2 sqlite3_prepare
 #endif
 
+/* The objects below an ObjectID, as a range on the OBJECT_ID index.
+ * Unlike "OBJECT_ID glob 'id$*'", this stays a range scan whatever
+ * characters the id holds.  The format takes the id twice. */
+#define SUBTREE_SQL "OBJECT_ID >= '%q$' and OBJECT_ID < '%q%%'"
+
 int sql_exec(sqlite3 *db, const char *fmt, ...);
 int sql_get_table(sqlite3 *db, const char *zSql, char ***pazResult, int *pnRow, int *pnColumn);
 int sql_get_int_field(sqlite3 *db, const char *fmt, ...);
@@ -41,4 +46,26 @@ int64_t sql_get_int64_field(sqlite3 *db, const char *fmt, ...);
 char * sql_get_text_field(sqlite3 *db, const char *fmt, ...);
 int db_upgrade(sqlite3 *db);
 
+/* Cached prepared statements, for queries run often.  The SQL uses ?
+ * placeholders, bound from one type letter per parameter:
+ * i int, I int64_t, s const char * (NULL binds NULL).
+ * Statements from sql_prepare() go back with sql_release(). */
+sqlite3_stmt *sql_prepare(sqlite3 *db, const char *sql);
+int sql_bind(sqlite3_stmt *stmt, const char *types, ...);
+int sql_step(sqlite3_stmt *stmt);
+void sql_release(sqlite3_stmt *stmt);
+int sql_exec_bind(sqlite3 *db, const char *sql, const char *types, ...);
+int sql_get_int_bind(sqlite3 *db, const char *sql, const char *types, ...);
+int64_t sql_get_int64_bind(sqlite3 *db, const char *sql, const char *types, ...);
+char * sql_get_text_bind(sqlite3 *db, const char *sql, const char *types, ...);
+int sql_close(sqlite3 *db);
+
+/* Connections to files.db.  Writers run in WAL mode, so that readers
+ * keep going on their own connections while the scanner or inotify
+ * writes.  Every commit through a writer bumps sql_commits, which lets
+ * other threads notice that the library changed. */
+extern volatile unsigned int sql_commits;
+sqlite3 *sql_open(const char *path, int readonly);
+int sql_checkpoint(sqlite3 *db, int truncate);
+
 #endif
@@ -402,7 +402,7 @@ SendContainer(struct upnphttp *h, const char *objectID, int itemStart, int itemC
 
 	if( recurse )
 	{
-		which = sqlite3_mprintf("OBJECT_ID glob '%q$*'", objectID);
+		which = sqlite3_mprintf(SUBTREE_SQL, objectID, objectID);
 		strcpy(groupBy, "group by DETAIL_ID");
 	}
 	else
@@ -780,6 +780,6 @@ ProcessTiVoCommand(struct upnphttp *h, const char *orig_path)
 		}
 	}
 	free(path);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 #endif // TIVO_SUPPORT
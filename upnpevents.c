@@ -62,6 +62,7 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#include "event.h"
 #include "upnpevents.h"
 #include "minidlnapath.h"
 #include "upnpglobalvars.h"
@@ -83,6 +84,7 @@ struct subscriber {
 
 struct upnp_event_notify {
 	LIST_ENTRY(upnp_event_notify) entries;
+	struct event ev;
     int s;  /* socket */
     enum { ECreated=1,
 	       EConnecting,
@@ -103,6 +105,10 @@ struct upnp_event_notify {
 /* prototypes */
 static void
 upnp_event_create_notify(struct subscriber * sub);
+static void
+upnp_event_notify_connect(struct upnp_event_notify * obj);
+static void
+upnp_event_process(struct event *ev);
 
 /* Subscriber list */
 LIST_HEAD(listhead, subscriber) subscriberlist = { NULL };
@@ -230,6 +236,7 @@ upnp_event_create_notify(struct subscriber * sub)
 	}
 	obj->sub = sub;
 	obj->state = ECreated;
+	obj->ev.index = -1;
 	obj->s = socket(PF_INET, SOCK_STREAM, 0);
 	if(obj->s<0) {
 		DPRINTF(E_ERROR, L_HTTP, "%s: socket(): %s\n", "upnp_event_create_notify", strerror(errno));
@@ -248,6 +255,16 @@ upnp_event_create_notify(struct subscriber * sub)
 	if(sub)
 		sub->notify = obj;
 	LIST_INSERT_HEAD(&notifylist, obj, entries);
+	/* The socket is registered once, for writing, and switched over to
+	 * reading when the NOTIFY has gone out.  Failures are reaped by
+	 * upnpevents_gc(). */
+	upnp_event_notify_connect(obj);
+	if(obj->state == EConnecting) {
+		obj->ev = (struct event){ .fd = obj->s, .rdwr = EVENT_WRITE,
+		                          .process = upnp_event_process, .data = obj };
+		if(event_module.add(&obj->ev) != 0)
+			obj->state = EError;
+	}
 	return;
 error:
 	if(obj->s >= 0)
@@ -405,6 +422,7 @@ upnp_event_process_notify(struct upnp_event_notify * obj)
 		upnp_event_recv(obj);
 		break;
 	case EFinished:
+		event_module.del(&obj->ev);
 		close(obj->s);
 		obj->s = -1;
 		break;
@@ -413,57 +431,35 @@ upnp_event_process_notify(struct upnp_event_notify * obj)
 	}
 }
 
-void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int * max_fd)
+static void
+upnp_event_process(struct event *ev)
 {
-	struct upnp_event_notify * obj;
-	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
-		DPRINTF(E_DEBUG, L_HTTP, "upnpevents_selectfds: %p %d %d\n",
-		       obj, obj->state, obj->s);
-		if(obj->s >= 0) {
-			switch(obj->state) {
-			case ECreated:
-				upnp_event_notify_connect(obj);
-				if(obj->state != EConnecting)
-					break;
-			case EConnecting:
-			case ESending:
-				FD_SET(obj->s, writeset);
-				if(obj->s > *max_fd)
-					*max_fd = obj->s;
-				break;
-			case EWaitingForResponse:
-				FD_SET(obj->s, readset);
-				if(obj->s > *max_fd)
-					*max_fd = obj->s;
-				break;
-			default:
-				break;
-			}
-		}
+	struct upnp_event_notify * obj = ev->data;
+
+	DPRINTF(E_DEBUG, L_HTTP, "%s: %p %d %d\n",
+	       "upnp_event_process", obj, obj->state, obj->s);
+	upnp_event_process_notify(obj);
+	if(obj->state == EWaitingForResponse && ev->rdwr != EVENT_READ) {
+		ev->rdwr = EVENT_READ;
+		if(event_module.mod(ev) != 0)
+			obj->state = EError;
 	}
 }
 
-void upnpevents_processfds(fd_set *readset, fd_set *writeset)
+/* free finished notifications and expired subscribers */
+void upnpevents_gc(void)
 {
 	struct upnp_event_notify * obj;
 	struct upnp_event_notify * next;
 	struct subscriber * sub;
 	struct subscriber * subnext;
 	time_t curtime;
-	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
-		DPRINTF(E_DEBUG, L_HTTP, "%s: %p %d %d %d %d\n",
-		       "upnpevents_processfds", obj, obj->state, obj->s,
-		       FD_ISSET(obj->s, readset), FD_ISSET(obj->s, writeset));
-		if(obj->s >= 0) {
-			if(FD_ISSET(obj->s, readset) || FD_ISSET(obj->s, writeset))
-				upnp_event_process_notify(obj);
-		}
-	}
 	obj = notifylist.lh_first;
 	while(obj != NULL) {
 		next = obj->entries.le_next;
 		if(obj->state == EError || obj->state == EFinished) {
 			if(obj->s >= 0) {
+				event_module.del(&obj->ev);
 				close(obj->s);
 			}
 			if(obj->sub)
@@ -66,7 +66,7 @@
 #endif
 
 #define USE_FORK 1
-#define DB_VERSION 10
+#define DB_VERSION 13
 
 #ifdef ENABLE_NLS
 #define _(string) gettext(string)
@@ -188,6 +188,8 @@ extern uint32_t runtime_flags;
 #define SYSTEMD_MASK          0x0010
 #define MERGE_MEDIA_DIRS_MASK 0x0020
 #define WIDE_LINKS_MASK       0x0040
+#define SEARCH_INDEX_MASK     0x0080
+#define LAZY_METADATA_MASK    0x0100
 
 #define SETFLAG(mask)	runtime_flags |= mask
 #define GETFLAG(mask)	(runtime_flags & mask)
@@ -217,7 +219,9 @@ extern int sssdp;
 extern const char *minissdpdsocketpath;
 
 /* UPnP-A/V [DLNA] */
-extern sqlite3 *db;
+/* each thread's own connection: the main thread's and the inotify
+ * thread's write, the SOAP workers' only read */
+extern __thread sqlite3 *db;
 #define FRIENDLYNAME_MAX_LEN 64
 extern char friendly_name[];
 extern char db_path[];
@@ -225,6 +229,8 @@ extern char log_path[];
 extern struct media_dir_s *media_dirs;
 extern struct album_art_name_s *album_art_names;
 extern short int scanning;
+/* the scanner is filling files.db.new, while files.db is still served */
+extern short int rebuilding;
 extern volatile short int quitting;
 extern volatile uint32_t updateID;
 extern const char *force_sort_criteria;
@@ -60,8 +60,8 @@
 #include <errno.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
-#include <sys/resource.h>
 #include <limits.h>
+#include <stddef.h>
 
 #include "config.h"
 #include "upnpglobalvars.h"
@@ -75,11 +75,11 @@
 #include "image_utils.h"
 #include "log.h"
 #include "sql.h"
+#include "scanner.h"
 #include <libexif/exif-loader.h>
 #include "tivo_utils.h"
 #include "tivo_commands.h"
 #include "clients.h"
-#include "process.h"
 #include "sendfile.h"
 
 #define MAX_BUFFER_SIZE 2147483647
@@ -101,11 +101,88 @@ static void SendResp_caption(struct upnphttp *, char * url);
 static void SendResp_resizedimg(struct upnphttp *, char * url);
 static void SendResp_thumbnail(struct upnphttp *, char * url);
 static void SendResp_dlnafile(struct upnphttp *, char * url);
+static int Reserve_upnphttp(struct upnphttp *, int);
+static int send_xfer(struct upnphttp *);
+static void start_xfer(struct upnphttp *, int, off_t, off_t);
+static void continue_xfer(struct upnphttp *);
+static void end_xfer(struct upnphttp *);
+
+/* Open connections, least recently active first.  Transfers are
+ * exempt from the idle timeout, since DLNA clients may stall them,
+ * and so are requests a SOAP worker is still answering. */
+static TAILQ_HEAD(httplisthead, upnphttp) upnphttphead =
+	TAILQ_HEAD_INITIALIZER(upnphttphead);
+/* Finished connections.  The event module may still hold events for
+ * them from the same batch, so they are only freed by the next
+ * Expire_upnphttp(), never from inside a handler. */
+static struct httplisthead upnphttpdead =
+	TAILQ_HEAD_INITIALIZER(upnphttpdead);
+static int n_upnphttp = 0;
+static int n_xfer = 0;
+
+/* Read handler for client connections.  Finished connections are
+ * retired here, so the main loop never has to walk them. */
+static void
+upnphttp_process(struct event *ev)
+{
+	struct upnphttp *h = ev->data;
+
+	if(h->state == 4)
+		continue_xfer(h);
+	/* the socket is edge-triggered, so read until it would block */
+	while(h->state <= 3)
+		if(Process_upnphttp(h) != 0)
+			break;
+	if(h->state >= 100)
+	{
+		if(h->socket >= 0)
+			CloseSocket_upnphttp(h);
+		TAILQ_REMOVE(&upnphttphead, h, entries);
+		TAILQ_INSERT_TAIL(&upnphttpdead, h, entries);
+		n_upnphttp--;
+		return;
+	}
+	h->timestamp = time(NULL);
+	TAILQ_REMOVE(&upnphttphead, h, entries);
+	TAILQ_INSERT_TAIL(&upnphttphead, h, entries);
+}
+
+int
+Expire_upnphttp(int timeout)
+{
+	struct upnphttp *h, *next;
+	time_t now = time(NULL);
+
+	while((h = TAILQ_FIRST(&upnphttpdead)) != NULL)
+	{
+		TAILQ_REMOVE(&upnphttpdead, h, entries);
+		free(h->req_buf);
+		free(h->res_buf);
+		free(h->req_password);
+		free(h->res_password);
+		free(h);
+	}
+
+	for(h = TAILQ_FIRST(&upnphttphead); h != NULL; h = next)
+	{
+		next = TAILQ_NEXT(h, entries);
+		if(timeout && (now - h->timestamp) < timeout)
+			break;
+		if(timeout && (h->state == 4 || h->state == 5))
+			continue;
+		if(timeout)
+			DPRINTF(E_DEBUG, L_HTTP, "Closing idle HTTP connection %d\n", h->socket);
+		Delete_upnphttp(h);
+	}
+
+	return n_upnphttp;
+}
 
 struct upnphttp * 
 New_upnphttp(int s)
 {
 	struct upnphttp * ret;
+	int flags;
 	if(s<0)
 		return NULL;
 	ret = (struct upnphttp *)malloc(sizeof(struct upnphttp));
@@ -113,12 +190,31 @@ New_upnphttp(int s)
 		return NULL;
 	memset(ret, 0, sizeof(struct upnphttp));
 	ret->socket = s;
+	ret->xfer_fd = -1;
+	ret->timestamp = time(NULL);
+	ret->ev = (struct event){ .fd = s, .rdwr = EVENT_READ,
+	                          .process = upnphttp_process, .data = ret };
+	flags = fcntl(s, F_GETFL);
+	if(flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "fcntl(O_NONBLOCK): %s\n", strerror(errno));
+		free(ret);
+		return NULL;
+	}
+	if(event_module.add(&ret->ev) != 0)
+	{
+		free(ret);
+		return NULL;
+	}
+	TAILQ_INSERT_TAIL(&upnphttphead, ret, entries);
+	n_upnphttp++;
 	return ret;
 }
 
 void
 CloseSocket_upnphttp(struct upnphttp * h)
 {
+	event_module.del(&h->ev);
 	if(close(h->socket) < 0)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "CloseSocket_upnphttp: close(%d): %s\n", h->socket, strerror(errno));
@@ -132,10 +228,16 @@ Delete_upnphttp(struct upnphttp * h)
 {
 	if(h)
 	{
+		TAILQ_REMOVE(&upnphttphead, h, entries);
+		n_upnphttp--;
+		if(h->state == 4)
+			end_xfer(h);
 		if(h->socket >= 0)
 			CloseSocket_upnphttp(h);
 		free(h->req_buf);
 		free(h->res_buf);
+		free(h->req_password);
+		free(h->res_password);
 		free(h);
 	}
 }
@@ -146,19 +248,40 @@ ParseHttpHeaders(struct upnphttp * h)
 {
 	int client = 0;
 	char * line;
+	char * end;
+	char * eol;
 	char * colon;
 	char * p;
-	int n;
+	int n, namelen;
+
+#define HEADER_IS(name) \
+	(namelen == sizeof(name) - 1 && strncasecmp(line, name, sizeof(name) - 1) == 0)
+
+	/* Each line is visited once, and dispatched on the first letter of
+	 * its name.  Values are stored as slices of req_buf. */
 	line = h->req_buf;
-	/* TODO : check if req_buf, contentoff are ok */
-	while(line < (h->req_buf + h->req_contentoff))
+	end = h->req_buf + h->req_contentoff;
+	while(line < end)
 	{
-		colon = strchr(line, ':');
-		if(colon)
+		eol = memchr(line, '\n', end - line);
+		if(!eol)
+			break;
+		colon = memchr(line, ':', eol - line);
+		if(!colon)
+			goto next_header;
+		namelen = colon - line;
+		p = colon + 1;
+		while(*p == ' ' || *p == '\t')
+			p++;
+		switch(tolower(*line))
 		{
-			if(strncasecmp(line, "Content-Length", 14)==0)
+		case 'a':
+			if(HEADER_IS("Accept-Language"))
+				h->reqflags |= FLAG_LANGUAGE;
+			break;
+		case 'c':
+			if(HEADER_IS("Content-Length"))
 			{
-				p = colon;
 				while(*p && (*p < '0' || *p > '9'))
 					p++;
 				h->req_contentlen = atoi(p);
@@ -167,107 +290,55 @@ ParseHttpHeaders(struct upnphttp * h)
 					h->req_contentlen = 0;
 				}
 			}
-			else if(strncasecmp(line, "SOAPAction", 10)==0)
+			else if(HEADER_IS("Callback"))
 			{
-				p = colon;
-				n = 0;
-				while(*p == ':' || *p == ' ' || *p == '\t')
-					p++;
-				while(p[n] >= ' ')
-					n++;
-				if(n >= 2 &&
-				   ((p[0] == '"' && p[n-1] == '"') ||
-				    (p[0] == '\'' && p[n-1] == '\'')))
-				{
-					p++;
-					n -= 2;
-				}
-				h->req_soapAction = p;
-				h->req_soapActionLen = n;
-			}
-			else if(strncasecmp(line, "Callback", 8)==0)
-			{
-				p = colon;
 				while(*p && *p != '<' && *p != '\r' )
 					p++;
 				n = 0;
 				while(p[n] && p[n] != '>' && p[n] != '\r' )
 					n++;
-				h->req_Callback = p + 1;
-				h->req_CallbackLen = MAX(0, n - 1);
+				h->req_Callback.off = p + 1 - h->req_buf;
+				h->req_Callback.len = MAX(0, n - 1);
+			}
+			else if(HEADER_IS("Connection"))
+			{
+				if(strcasestrc(p, "close", '\r'))
+					h->reqflags &= ~FLAG_KEEPALIVE;
+				else if(strcasestrc(p, "keep-alive", '\r'))
+					h->reqflags |= FLAG_KEEPALIVE;
 			}
-			else if(strncasecmp(line, "SID", 3)==0)
+			break;
+		case 'f':
+			if(HEADER_IS("FriendlyName"))
 			{
-				//zqiu: fix bug for test 4.0.5
-				//Skip extra headers like "SIDHEADER: xxxxxx xxx"
-				for(p=line+3;p<colon;p++)
+				int i;
+				for (i = 0; client_types[i].name; i++)
 				{
-					if(!isspace(*p))
+					if (client_types[i].match_type != EFriendlyName)
+						continue;
+					if (strstrc(p, client_types[i].match, '\r') != NULL)
 					{
-						p = NULL; //unexpected header
+						client = i;
 						break;
 					}
 				}
-				if(p) {
-					p = colon + 1;
-					while(isspace(*p))
-						p++;
-					n = 0;
-					while(p[n] && !isspace(p[n]))
-						n++;
-					h->req_SID = p;
-					h->req_SIDLen = n;
-				}
-			}
-			else if(strncasecmp(line, "NT", 2)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				n = 0;
-				while(p[n] && !isspace(p[n]))
-					n++;
-				h->req_NT = p;
-				h->req_NTLen = n;
-			}
-			/* Timeout: Seconds-nnnn */
-			/* TIMEOUT
-			Recommended. Requested duration until subscription expires,
-			either number of seconds or infinite. Recommendation
-			by a UPnP Forum working committee. Defined by UPnP vendor.
-			Consists of the keyword "Second-" followed (without an
-			intervening space) by either an integer or the keyword "infinite". */
-			else if(strncasecmp(line, "Timeout", 7)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "Second-", 7)==0) {
-					h->req_Timeout = atoi(p+7);
-				}
 			}
-			// Range: bytes=xxx-yyy
-			else if(strncasecmp(line, "Range", 5)==0)
+			break;
+		case 'g':
+			if(HEADER_IS("getcontentFeatures.dlna.org") ||
+			   HEADER_IS("getAvailableSeekRange.dlna.org"))
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "bytes=", 6)==0) {
-					h->reqflags |= FLAG_RANGE;
-					h->req_RangeStart = strtoll(p+6, &colon, 10);
-					h->req_RangeEnd = colon ? atoll(colon+1) : 0;
-					DPRINTF(E_DEBUG, L_HTTP, "Range Start-End: %lld - %lld\n",
-						(long long)h->req_RangeStart,
-						h->req_RangeEnd ? (long long)h->req_RangeEnd : -1);
-				}
+				if( (*p != '1') || !isspace(p[1]) )
+					h->reqflags |= FLAG_INVALID_REQ;
 			}
-			else if(strncasecmp(line, "Host", 4)==0)
+			else if(HEADER_IS("getCaptionInfo.sec"))
+				h->reqflags |= FLAG_CAPTION;
+			break;
+		case 'h':
+			if(HEADER_IS("Host"))
 			{
 				int i;
 				h->reqflags |= FLAG_HOST;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
 				for(n = 0; n<n_lan_addr; n++)
 				{
 					for(i=0; lan_addr[n].str[i]; i++)
@@ -282,93 +353,87 @@ ParseHttpHeaders(struct upnphttp * h)
 					}
 				}
 			}
-			else if(strncasecmp(line, "User-Agent", 10)==0)
+			break;
+		case 'n':
+			if(HEADER_IS("NT"))
 			{
-				int i;
-				/* Skip client detection if we already detected it. */
-				if( client )
-					goto next_header;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EUserAgent)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
+				n = 0;
+				while(p[n] && !isspace(p[n]))
+					n++;
+				h->req_NT.off = p - h->req_buf;
+				h->req_NT.len = n;
 			}
-			else if(strncasecmp(line, "X-AV-Client-Info", 16)==0)
+			break;
+		case 'p':
+			if(HEADER_IS("PlaySpeed.dlna.org"))
+				h->reqflags |= FLAG_PLAYSPEED;
+			break;
+		case 'r':
+			// Range: bytes=xxx-yyy
+			if(HEADER_IS("Range"))
 			{
-				int i;
-				/* Skip client detection if we already detected it. */
-				if( client && client_types[client].type < EStandardDLNA150 )
-					goto next_header;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EXAVClientInfo)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
+				if(strncasecmp(p, "bytes=", 6)==0) {
+					h->reqflags |= FLAG_RANGE;
+					h->req_RangeStart = strtoll(p+6, &colon, 10);
+					h->req_RangeEnd = colon ? atoll(colon+1) : 0;
+					DPRINTF(E_DEBUG, L_HTTP, "Range Start-End: %lld - %lld\n",
+						(long long)h->req_RangeStart,
+						h->req_RangeEnd ? (long long)h->req_RangeEnd : -1);
 				}
 			}
-			else if(strncasecmp(line, "Transfer-Encoding", 17)==0)
+			else if(HEADER_IS("realTimeInfo.dlna.org"))
+				h->reqflags |= FLAG_REALTIMEINFO;
+			break;
+		case 's':
+			if(HEADER_IS("SOAPAction"))
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "chunked", 7)==0)
+				n = 0;
+				while(p[n] >= ' ')
+					n++;
+				if(n >= 2 &&
+				   ((p[0] == '"' && p[n-1] == '"') ||
+				    (p[0] == '\'' && p[n-1] == '\'')))
 				{
-					h->reqflags |= FLAG_CHUNKED;
-				}
-			}
-			else if(strncasecmp(line, "Accept-Language", 15)==0)
-			{
-				h->reqflags |= FLAG_LANGUAGE;
-			}
-			else if(strncasecmp(line, "getcontentFeatures.dlna.org", 27)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
 					p++;
-				if( (*p != '1') || !isspace(p[1]) )
-					h->reqflags |= FLAG_INVALID_REQ;
-			}
-			else if(strncasecmp(line, "TimeSeekRange.dlna.org", 22)==0)
-			{
-				h->reqflags |= FLAG_TIMESEEK;
+					n -= 2;
+				}
+				h->req_soapAction.off = p - h->req_buf;
+				h->req_soapAction.len = n;
 			}
-			else if(strncasecmp(line, "PlaySpeed.dlna.org", 18)==0)
+			else if(HEADER_IS("SID"))
 			{
-				h->reqflags |= FLAG_PLAYSPEED;
+				n = 0;
+				while(p[n] && !isspace(p[n]))
+					n++;
+				h->req_SID.off = p - h->req_buf;
+				h->req_SID.len = n;
 			}
-			else if(strncasecmp(line, "realTimeInfo.dlna.org", 21)==0)
+			break;
+		case 't':
+			/* Timeout: Seconds-nnnn */
+			/* TIMEOUT
+			Recommended. Requested duration until subscription expires,
+			either number of seconds or infinite. Recommendation
+			by a UPnP Forum working committee. Defined by UPnP vendor.
+			Consists of the keyword "Second-" followed (without an
+			intervening space) by either an integer or the keyword "infinite". */
+			if(HEADER_IS("Timeout"))
 			{
-				h->reqflags |= FLAG_REALTIMEINFO;
+				if(strncasecmp(p, "Second-", 7)==0) {
+					h->req_Timeout = atoi(p+7);
+				}
 			}
-			else if(strncasecmp(line, "getAvailableSeekRange.dlna.org", 21)==0)
+			else if(HEADER_IS("Transfer-Encoding"))
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if( (*p != '1') || !isspace(p[1]) )
-					h->reqflags |= FLAG_INVALID_REQ;
+				if(strncasecmp(p, "chunked", 7)==0)
+				{
+					h->reqflags |= FLAG_CHUNKED;
+				}
 			}
-			else if(strncasecmp(line, "transferMode.dlna.org", 21)==0)
+			else if(HEADER_IS("TimeSeekRange.dlna.org"))
+				h->reqflags |= FLAG_TIMESEEK;
+			else if(HEADER_IS("transferMode.dlna.org"))
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
 				if(strncasecmp(p, "Streaming", 9)==0)
 				{
 					h->reqflags |= FLAG_XFERSTREAMING;
@@ -382,19 +447,17 @@ ParseHttpHeaders(struct upnphttp * h)
 					h->reqflags |= FLAG_XFERBACKGROUND;
 				}
 			}
-			else if(strncasecmp(line, "getCaptionInfo.sec", 18)==0)
-			{
-				h->reqflags |= FLAG_CAPTION;
-			}
-			else if(strncasecmp(line, "FriendlyName", 12)==0)
+			break;
+		case 'u':
+			if(HEADER_IS("User-Agent"))
 			{
 				int i;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
+				/* Skip client detection if we already detected it. */
+				if( client )
+					break;
 				for (i = 0; client_types[i].name; i++)
 				{
-					if (client_types[i].match_type != EFriendlyName)
+					if (client_types[i].match_type != EUserAgent)
 						continue;
 					if (strstrc(p, client_types[i].match, '\r') != NULL)
 					{
@@ -403,18 +466,36 @@ ParseHttpHeaders(struct upnphttp * h)
 					}
 				}
 			}
-			else if(strncasecmp(line, "uctt.upnp.org:", 14)==0)
+			else if(HEADER_IS("uctt.upnp.org"))
 			{
 				/* Conformance testing */
 				SETFLAG(DLNA_STRICT_MASK);
 			}
+			break;
+		case 'x':
+			if(HEADER_IS("X-AV-Client-Info"))
+			{
+				int i;
+				/* Skip client detection if we already detected it. */
+				if( client && client_types[client].type < EStandardDLNA150 )
+					break;
+				for (i = 0; client_types[i].name; i++)
+				{
+					if (client_types[i].match_type != EXAVClientInfo)
+						continue;
+					if (strstrc(p, client_types[i].match, '\r') != NULL)
+					{
+						client = i;
+						break;
+					}
+				}
+			}
+			break;
 		}
 next_header:
-		line = strstr(line, "\r\n");
-		if (!line)
-			return;
-		line += 2;
+		line = eol + 1;
 	}
+#undef HEADER_IS
 	if( h->reqflags & FLAG_CHUNKED )
 	{
 		char *endptr;
@@ -454,11 +535,17 @@ next_header:
 		enum client_types ctype = h->req_client->type->type;
 		/* If we know the client and our new detection is generic, use our cached info */
 		/* If we detected a Samsung Series B earlier, don't overwrite it with Series A info */
-		if ((ctype && ctype < EStandardDLNA150 && type >= EStandardDLNA150) ||
-		    (ctype == ESamsungSeriesB && type == ESamsungSeriesA))
-			return;
-		h->req_client->type = &client_types[client];
-		h->req_client->age = time(NULL);
+		if (!(ctype && ctype < EStandardDLNA150 && type >= EStandardDLNA150) &&
+		    !(ctype == ESamsungSeriesB && type == ESamsungSeriesA))
+		{
+			h->req_client->type = &client_types[client];
+			h->req_client->age = time(NULL);
+		}
+	}
+	if (h->req_client)
+	{
+		h->req_ctype = h->req_client->type->type;
+		h->req_cflags = h->req_client->type->flags;
 	}
 }
 
@@ -470,11 +557,13 @@ Send400(struct upnphttp * h)
 		"<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>"
 		"<BODY><H1>Bad Request</H1>The request is invalid"
 		" for this HTTP version.</BODY></HTML>\r\n";
+	/* we can't trust the framing of a bad request */
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	h->respflags = FLAG_HTML;
 	BuildResp2_upnphttp(h, 400, "Bad Request",
 	                    body400, sizeof(body400) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 403 error message */
@@ -489,7 +578,7 @@ Send403(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 403, "Forbidden",
 	                    body403, sizeof(body403) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 404 error message */
@@ -504,7 +593,7 @@ Send404(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 404, "Not Found",
 	                    body404, sizeof(body404) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 406 error message */
@@ -519,7 +608,7 @@ Send406(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 406, "Not Acceptable",
 	                    body406, sizeof(body406) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 416 error message */
@@ -534,7 +623,7 @@ Send416(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 416, "Requested Range Not Satisfiable",
 	                    body416, sizeof(body416) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 500 error message */
@@ -549,7 +638,7 @@ Send500(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 500, "Internal Server Errror",
 	                    body500, sizeof(body500) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 501 error message */
@@ -564,7 +653,22 @@ Send501(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 501, "Not Implemented",
 	                    body501, sizeof(body501) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
+}
+
+/* very minimalistic 503 error message */
+static void
+Send503(struct upnphttp * h)
+{
+	static const char body503[] =
+		"<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>"
+		"<BODY><H1>Service Unavailable</H1>Too many transfers are "
+		"in progress.</BODY></HTML>\r\n";
+	h->respflags = FLAG_HTML;
+	BuildResp2_upnphttp(h, 503, "Service Unavailable",
+	                    body503, sizeof(body503) - 1);
+	SendResp_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* Sends the description generated by the parameter */
@@ -582,7 +686,7 @@ sendXMLdesc(struct upnphttp * h, char * (f)(int *))
 	}
 	BuildResp_upnphttp(h, desc, len);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 	free(desc);
 }
 
@@ -599,7 +703,7 @@ SendResp_readynas_admin(struct upnphttp * h)
 
 	BuildResp_upnphttp(h, body, l);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 #endif
 
@@ -609,6 +713,8 @@ SendResp_presentation(struct upnphttp * h)
 	struct string_s str;
 	char body[4096];
 	int a, v, p, i;
+	unsigned long hits, misses;
+	size_t bytes;
 
 	INIT_STR(str, body);
 
@@ -630,7 +736,7 @@ SendResp_presentation(struct upnphttp * h)
 		"<tr><td>Image files</td><td>%d</td></tr>"
 		"</table>", a, v, p);
 
-	if (scanning)
+	if (scanning || rebuilding)
 		strcatf(&str,
 			"<br><i>* Media scan in progress</i><br>");
 
@@ -649,12 +755,15 @@ SendResp_presentation(struct upnphttp * h)
 	}
 	strcatf(&str, "</table>");
 
-	strcatf(&str, "<br>%d connection%s currently open<br>", number_of_children, (number_of_children == 1 ? "" : "s"));
+	strcatf(&str, "<br>%d connection%s currently open<br>", n_xfer, (n_xfer == 1 ? "" : "s"));
+	upnpsoap_cache_stats(&hits, &misses, &bytes);
+	strcatf(&str, "<br>Browse cache: %lu hits, %lu misses, %lu KiB used<br>",
+		hits, misses, (unsigned long)(bytes / 1024));
 	strcatf(&str, "</BODY></HTML>\r\n");
 
 	BuildResp_upnphttp(h, str.data, str.off);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* ProcessHTTPPOST_upnphttp()
@@ -664,13 +773,14 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 {
 	if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
 	{
-		if(h->req_soapAction)
+		if(h->req_soapAction.off)
 		{
 			/* we can process the request */
-			DPRINTF(E_DEBUG, L_HTTP, "SOAPAction: %.*s\n", h->req_soapActionLen, h->req_soapAction);
+			DPRINTF(E_DEBUG, L_HTTP, "SOAPAction: %.*s\n", h->req_soapAction.len,
+				HTTP_SLICE(h, h->req_soapAction));
 			ExecuteSoapAction(h, 
-				h->req_soapAction,
-				h->req_soapActionLen);
+				HTTP_SLICE(h, h->req_soapAction),
+				h->req_soapAction.len);
 		}
 		else
 		{
@@ -681,14 +791,16 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 			BuildResp2_upnphttp(h, 400, "Bad Request",
 			                    err400str, sizeof(err400str) - 1);
 			SendResp_upnphttp(h);
-			CloseSocket_upnphttp(h);
+			Finish_upnphttp(h);
 		}
 	}
-	else
+	else if(Reserve_upnphttp(h, h->req_contentoff + h->req_contentlen) == 0)
 	{
 		/* waiting for remaining data */
 		h->state = 1;
 	}
+	else
+		Send400(h);
 }
 
 static int
@@ -696,16 +808,16 @@ check_event(struct upnphttp *h)
 {
 	enum event_type type;
 
-	if (h->req_Callback)
+	if (h->req_Callback.off)
 	{
-		if (h->req_SID || !h->req_NT)
+		if (h->req_SID.off || !h->req_NT.off)
 		{
 			BuildResp2_upnphttp(h, 400, "Bad Request",
 				            "<html><body>Bad request</body></html>", 37);
 			type = E_INVALID;
 		}
-		else if (strncmp(h->req_Callback, "http://", 7) != 0 ||
-		         strncmp(h->req_NT, "upnp:event", h->req_NTLen) != 0)
+		else if (strncmp(HTTP_SLICE(h, h->req_Callback), "http://", 7) != 0 ||
+		         strncmp(HTTP_SLICE(h, h->req_NT), "upnp:event", h->req_NT.len) != 0)
 		{
 			/* Missing or invalid CALLBACK : 412 Precondition Failed.
 			 * If CALLBACK header is missing or does not contain a valid HTTP URL,
@@ -716,10 +828,10 @@ check_event(struct upnphttp *h)
 		else
 			type = E_SUBSCRIBE;
 	}
-	else if (h->req_SID)
+	else if (h->req_SID.off)
 	{
 		/* subscription renew */
-		if (h->req_NT)
+		if (h->req_NT.off)
 		{
 			BuildResp2_upnphttp(h, 400, "Bad Request",
 				            "<html><body>Bad request</body></html>", 37);
@@ -744,8 +856,8 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 	enum event_type type;
 	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPSubscribe %s\n", path);
 	DPRINTF(E_DEBUG, L_HTTP, "Callback '%.*s' Timeout=%d\n",
-		h->req_CallbackLen, h->req_Callback, h->req_Timeout);
-	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
+		h->req_Callback.len, HTTP_SLICE(h, h->req_Callback), h->req_Timeout);
+	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SID.len, HTTP_SLICE(h, h->req_SID));
 
 	type = check_event(h);
 	if (type == E_SUBSCRIBE)
@@ -754,22 +866,22 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 		 * - respond HTTP/x.x 200 OK 
 		 * - Send the initial event message */
 		/* Server:, SID:; Timeout: Second-(xx|infinite) */
-		sid = upnpevents_addSubscriber(path, h->req_Callback,
-		                               h->req_CallbackLen, h->req_Timeout);
+		sid = upnpevents_addSubscriber(path, HTTP_SLICE(h, h->req_Callback),
+		                               h->req_Callback.len, h->req_Timeout);
 		h->respflags = FLAG_TIMEOUT;
 		if (sid)
 		{
 			DPRINTF(E_DEBUG, L_HTTP, "generated sid=%s\n", sid);
 			h->respflags |= FLAG_SID;
-			h->req_SID = sid;
-			h->req_SIDLen = strlen(sid);
+			h->res_SID = sid;
+			h->res_SIDLen = strlen(sid);
 		}
 		BuildResp_upnphttp(h, 0, 0);
 	}
 	else if (type == E_RENEW)
 	{
 		/* subscription renew */
-		if (renewSubscription(h->req_SID, h->req_SIDLen, h->req_Timeout) < 0)
+		if (renewSubscription(HTTP_SLICE(h, h->req_SID), h->req_SID.len, h->req_Timeout) < 0)
 		{
 			/* Invalid SID
 			   412 Precondition Failed. If a SID does not correspond to a known,
@@ -783,11 +895,13 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 			h->respflags = FLAG_TIMEOUT;
 			h->req_Timeout = 300;
 			h->respflags |= FLAG_SID;
+			h->res_SID = HTTP_SLICE(h, h->req_SID);
+			h->res_SIDLen = h->req_SID.len;
 			BuildResp_upnphttp(h, 0, 0);
 		}
 	}
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 static void
@@ -795,18 +909,18 @@ ProcessHTTPUnSubscribe_upnphttp(struct upnphttp * h, const char * path)
 {
 	enum event_type type;
 	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPUnSubscribe %s\n", path);
-	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
+	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SID.len, HTTP_SLICE(h, h->req_SID));
 	/* Remove from the list */
 	type = check_event(h);
 	if (type != E_INVALID)
 	{
-		if(upnpevents_removeSubscriber(h->req_SID, h->req_SIDLen) < 0)
+		if(upnpevents_removeSubscriber(HTTP_SLICE(h, h->req_SID), h->req_SID.len) < 0)
 			BuildResp2_upnphttp(h, 412, "Precondition Failed", 0, 0);
 		else
 			BuildResp_upnphttp(h, 0, 0);
 	}
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* Parse and process Http Query 
@@ -818,7 +932,7 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 	char HttpUrl[512];
 	char * HttpVer;
 	char * p;
-	int i;
+	int i, body;
 	p = h->req_buf;
 	if(!p)
 		return;
@@ -854,11 +968,31 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 		}
 	}
 
+	/* HTTP/1.1 connections are persistent unless the client says otherwise */
+	if(strcmp(HttpVer, "HTTP/1.1") == 0)
+		h->reqflags |= FLAG_KEEPALIVE;
+
+	body = h->req_contentlen;
+	h->req_contentlen = -1;
 	ParseHttpHeaders(h);
+	if(h->req_contentlen < 0)
+	{
+		/* Without a Content-Length, a POST body runs to the end of
+		 * what we received and the connection can't be reused. */
+		if(strcmp("POST", HttpCommand) == 0)
+		{
+			h->req_contentlen = body;
+			h->reqflags &= ~FLAG_KEEPALIVE;
+		}
+		else
+			h->req_contentlen = 0;
+	}
 
 	/* see if we need to wait for remaining data */
 	if( (h->reqflags & FLAG_CHUNKED) )
 	{
+		/* the body is decoded in place, so don't try to reuse the buffer */
+		h->reqflags &= ~FLAG_KEEPALIVE;
 		if( h->req_chunklen == -1)
 		{
 			Send400(h);
@@ -926,7 +1060,7 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 		if(strcmp(ROOTDESC_PATH, HttpUrl) == 0)
 		{
 			/* If it's a Xbox360, we might need a special friendly_name to be recognized */
-			if( h->req_client && h->req_client->type->type == EXbox )
+			if( h->req_ctype == EXbox )
 			{
 				char model_sav[2];
 				i = 0;
@@ -942,7 +1076,7 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 					friendly_name[i] = '\0';
 				memcpy(modelnumber, model_sav, 2);
 			}
-			else if( h->req_client && h->req_client->type->flags & FLAG_SAMSUNG_DCM10 )
+			else if( h->req_cflags & FLAG_SAMSUNG_DCM10 )
 			{
 				sendXMLdesc(h, genRootDescSamsung);
 			}
@@ -1046,18 +1180,76 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 }
 
 
-void
+/* Make room for size bytes (plus a terminating NUL) in req_buf */
+static int
+Reserve_upnphttp(struct upnphttp * h, int size)
+{
+	char *buf;
+
+	if(size < h->req_bufsize)
+		return 0;
+	if(size >= HTTP_REQ_MAXSIZE)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Request too large (%d bytes)\n", size);
+		return -1;
+	}
+	buf = realloc(h->req_buf, size + 1);
+	if(!buf)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Receive request: %s\n", strerror(errno));
+		return -1;
+	}
+	h->req_buf = buf;
+	h->req_bufsize = size + 1;
+	return 0;
+}
+
+/* Process the request once all of its headers have been received */
+static void
+ProcessHeaders_upnphttp(struct upnphttp * h)
+{
+	const char * endheaders;
+
+	/* search for the string "\r\n\r\n", resuming where the last
+	 * search left off (less 3 bytes, in case it was split) */
+	endheaders = strstr(h->req_buf + MAX(h->req_scanoff - 3, 0), "\r\n\r\n");
+	if(endheaders)
+	{
+		h->req_contentoff = endheaders - h->req_buf + 4;
+		h->req_contentlen = h->req_buflen - h->req_contentoff;
+		ProcessHttpQuery_upnphttp(h);
+	}
+	else
+		h->req_scanoff = h->req_buflen;
+}
+
+int
 Process_upnphttp(struct upnphttp * h)
 {
-	char buf[2048];
-	int n;
+	int n, space;
 	if(!h)
-		return;
+		return -1;
 	switch(h->state)
 	{
 	case 0:
-		n = recv(h->socket, buf, 2048, 0);
-		if(n<0)
+		if(!h->req_buf && Reserve_upnphttp(h, HTTP_REQ_BUFSIZE - 1) != 0)
+		{
+			h->state = 100;
+			break;
+		}
+		space = h->req_bufsize - h->req_buflen - 1;
+		if(space <= 0)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", h->req_buflen);
+			Send400(h);
+			break;
+		}
+		n = recv(h->socket, h->req_buf + h->req_buflen, space, 0);
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 1;
+		else if(n < 0 && errno == EINTR)
+			break;
+		else if(n<0)
 		{
 			DPRINTF(E_ERROR, L_HTTP, "recv (state0): %s\n", strerror(errno));
 			h->state = 100;
@@ -1069,41 +1261,41 @@ Process_upnphttp(struct upnphttp * h)
 		}
 		else
 		{
-			int new_req_buflen;
-			const char * endheaders;
-			/* if 1st arg of realloc() is null,
-			 * realloc behaves the same as malloc() */
-			new_req_buflen = n + h->req_buflen + 1;
-			if (new_req_buflen >= 1024 * 1024)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", new_req_buflen);
-				h->state = 100;
-				break;
-			}
-			h->req_buf = (char *)realloc(h->req_buf, new_req_buflen);
-			if (!h->req_buf)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers: %s\n", strerror(errno));
-				h->state = 100;
-				break;
-			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
 			h->req_buf[h->req_buflen] = '\0';
-			/* search for the string "\r\n\r\n" */
-			endheaders = strstr(h->req_buf, "\r\n\r\n");
-			if(endheaders)
-			{
-				h->req_contentoff = endheaders - h->req_buf + 4;
-				h->req_contentlen = h->req_buflen - h->req_contentoff;
-				ProcessHttpQuery_upnphttp(h);
-			}
+			ProcessHeaders_upnphttp(h);
 		}
 		break;
+	case 3:
+		/* the next request was pipelined behind the previous one */
+		h->state = 0;
+		ProcessHeaders_upnphttp(h);
+		break;
 	case 1:
 	case 2:
-		n = recv(h->socket, buf, sizeof(buf), 0);
-		if(n < 0)
+		/* the body length is known in state 1, so req_buf already has
+		 * room for it; a chunked body grows the buffer as it comes */
+		space = h->req_bufsize - h->req_buflen - 1;
+		if(space <= 0 && h->state == 2)
+		{
+			if(Reserve_upnphttp(h, MIN(h->req_bufsize * 2, HTTP_REQ_MAXSIZE)) != 0)
+			{
+				h->state = 100;
+				break;
+			}
+			space = h->req_bufsize - h->req_buflen - 1;
+		}
+		if(space <= 0)
+		{
+			h->state = 100;
+			break;
+		}
+		n = recv(h->socket, h->req_buf + h->req_buflen, space, 0);
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 1;
+		else if(n < 0 && errno == EINTR)
+			break;
+		else if(n < 0)
 		{
 			DPRINTF(E_ERROR, L_HTTP, "recv (state%d): %s\n", h->state, strerror(errno));
 			h->state = 100;
@@ -1115,23 +1307,12 @@ Process_upnphttp(struct upnphttp * h)
 		}
 		else
 		{
-			buf[sizeof(buf)-1] = '\0';
-			/*fwrite(buf, 1, n, stdout);*/	/* debug */
-			h->req_buf = (char *)realloc(h->req_buf, n + h->req_buflen);
-			if (!h->req_buf)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive request body: %s\n", strerror(errno));
-				h->state = 100;
-				break;
-			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
+			h->req_buf[h->req_buflen] = '\0';
 			if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
 			{
-				/* Need the struct to point to the realloc'd memory locations */
 				if( h->state == 1 )
 				{
-					ParseHttpHeaders(h);
 					ProcessHTTPPOST_upnphttp(h);
 				}
 				else if( h->state == 2 )
@@ -1144,6 +1325,52 @@ Process_upnphttp(struct upnphttp * h)
 	default:
 		DPRINTF(E_WARN, L_HTTP, "Unexpected state: %d\n", h->state);
 	}
+	return 0;
+}
+
+void
+Finish_upnphttp(struct upnphttp * h)
+{
+	int used, left;
+	char *buf;
+
+	/* a response still being sent is finished by continue_xfer() */
+	if(h->socket < 0 || h->state == 4)
+		return;
+	if(!(h->reqflags & FLAG_KEEPALIVE) || quitting)
+	{
+		CloseSocket_upnphttp(h);
+		return;
+	}
+
+	/* anything received past this request belongs to the next one */
+	used = h->req_contentoff + h->req_contentlen;
+	left = h->req_buflen - used;
+	if(left > 0)
+		memmove(h->req_buf, h->req_buf + used, left);
+	else
+		left = 0;
+	h->req_buflen = left;
+	/* give back the room a large request body needed */
+	if(h->req_bufsize > HTTP_REQ_BUFSIZE && left < HTTP_REQ_BUFSIZE)
+	{
+		buf = realloc(h->req_buf, HTTP_REQ_BUFSIZE);
+		if(buf)
+		{
+			h->req_buf = buf;
+			h->req_bufsize = HTTP_REQ_BUFSIZE;
+		}
+	}
+	if(h->req_buf)
+		h->req_buf[left] = '\0';
+
+	free(h->req_password);
+	free(h->res_password);
+	memset(&h->req_contentlen, 0, offsetof(struct upnphttp, res_buf) -
+	                              offsetof(struct upnphttp, req_contentlen));
+	h->res_buflen = 0;
+	h->respflags = 0;
+	h->state = left ? 3 : 0;
 }
 
 /* with response code and response message
@@ -1157,9 +1384,7 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	static const char httpresphead[] =
 		"%s %d %s\r\n"
 		"Content-Type: %s\r\n"
-		"Connection: close\r\n"
-		"Content-Length: %d\r\n"
-		"Server: " MINIDLNA_SERVER_STRING "\r\n";
+		"Connection: %s\r\n";
 	time_t curtime = time(NULL);
 	char date[30];
 	int templen;
@@ -1176,7 +1401,13 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	strcatf(&res, httpresphead, "HTTP/1.1",
 	              respcode, respmsg,
 	              (h->respflags&FLAG_HTML)?"text/html":"text/xml; charset=\"utf-8\"",
-							 bodylen);
+	              (h->reqflags&FLAG_KEEPALIVE)?"keep-alive":"close");
+	/* a chunked body is sent with SendChunk_upnphttp() */
+	if(h->respflags & FLAG_CHUNKED)
+		strcatf(&res, "Transfer-Encoding: chunked\r\n");
+	else
+		strcatf(&res, "Content-Length: %d\r\n", bodylen);
+	strcatf(&res, "Server: " MINIDLNA_SERVER_STRING "\r\n");
 	/* Additional headers */
 	if(h->respflags & FLAG_TIMEOUT) {
 		strcatf(&res, "Timeout: Second-");
@@ -1187,7 +1418,7 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 		}
 	}
 	if(h->respflags & FLAG_SID) {
-		strcatf(&res, "SID: %.*s\r\n", h->req_SIDLen, h->req_SID);
+		strcatf(&res, "SID: %.*s\r\n", h->res_SIDLen, h->res_SID);
 	}
 	if(h->reqflags & FLAG_LANGUAGE) {
 		strcatf(&res, "Content-Language: en\r\n");
@@ -1224,108 +1455,250 @@ BuildResp_upnphttp(struct upnphttp *h, const char *body, int bodylen)
 	BuildResp2_upnphttp(h, 200, "OK", body, bodylen);
 }
 
+/* Append to the response that start_xfer() will send. */
+static int
+queue_data(struct upnphttp * h, const char * data, int len)
+{
+	char *buf;
+
+	if(h->res_buflen + len > h->res_buf_alloclen)
+	{
+		buf = realloc(h->res_buf, h->res_buflen + len);
+		if(!buf)
+			return -1;
+		h->res_buf = buf;
+		h->res_buf_alloclen = h->res_buflen + len;
+	}
+	memcpy(h->res_buf + h->res_buflen, data, len);
+	h->res_buflen += len;
+	return 0;
+}
+
+/* Send res_buf without waiting.  Whatever the socket won't take is left
+ * for start_xfer() to finish, so a stalled client never holds up the
+ * event loop. */
 void
 SendResp_upnphttp(struct upnphttp * h)
 {
-	int n;
+	int ret;
+
 	DPRINTF(E_DEBUG, L_HTTP, "HTTP RESPONSE: %.*s\n", h->res_buflen, h->res_buf);
-	n = send(h->socket, h->res_buf, h->res_buflen, 0);
-	if(n<0)
-	{
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
-	}
-	else if(n < h->res_buflen)
-	{
-		/* TODO : handle correctly this case */
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
-						n, h->res_buflen);
-	}
+	ret = send_xfer(h);
+	if(ret < 0)
+		h->reqflags &= ~FLAG_KEEPALIVE;
+	else if(ret == 0)
+		start_xfer(h, -1, 0, -1);
+	else
+		h->res_sent = 0;
 }
 
-static int
-send_data(struct upnphttp * h, char * header, size_t size, int flags)
+/* Queue len bytes of data as one chunk of a FLAG_CHUNKED response, behind
+ * the header; len 0 ends the response.  As much as the socket will take
+ * is sent right away, and the rest waits in res_buf for SendResp_upnphttp()
+ * once the request is finished.  This is only for the thread that owns the
+ * request (state 5).  On error the connection is marked to be closed. */
+int
+SendChunk_upnphttp(struct upnphttp * h, const char * data, int len)
 {
-	int n;
+	char buf[16];
+	int ret;
 
-	n = send(h->socket, header, size, flags);
-	if(n<0)
-	{
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
-	} 
-	else if(n < h->res_buflen)
+	if(len)
 	{
-		/* TODO : handle correctly this case */
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
-						n, h->res_buflen);
+		snprintf(buf, sizeof(buf), "%x\r\n", len);
+		ret = queue_data(h, buf, strlen(buf));
+		if(ret == 0)
+			ret = queue_data(h, data, len);
+		if(ret == 0)
+			ret = queue_data(h, "\r\n", 2);
 	}
 	else
+		ret = queue_data(h, "0\r\n\r\n", 5);
+	if(ret == 0)
+		ret = send_xfer(h);
+	if(ret > 0)
+		h->res_buflen = h->res_sent = 0;
+	else if(ret == 0 && h->res_sent)
 	{
-		return 0;
+		/* keep only what is still to be sent */
+		h->res_buflen -= h->res_sent;
+		memmove(h->res_buf, h->res_buf + h->res_sent, h->res_buflen);
+		h->res_sent = 0;
 	}
-	return 1;
+	if(ret < 0)
+	{
+		h->reqflags &= ~FLAG_KEEPALIVE;
+		return -1;
+	}
+	return 0;
 }
 
-static void
-send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
+/* Write as much of the transfer as the socket will take.
+ * Returns 1 when it is complete, 0 if the socket is full, -1 on error. */
+static int
+send_xfer(struct upnphttp * h)
 {
-	off_t send_size;
-	off_t ret;
-	char *buf = NULL;
-#if HAVE_SENDFILE
-	int try_sendfile = 1;
-#endif
+	ssize_t n;
+	off_t len;
+
+	while( h->res_sent < h->res_buflen )
+	{
+		n = send(h->socket, h->res_buf + h->res_sent, h->res_buflen - h->res_sent,
+		         (h->xfer_fd >= 0) ? MSG_MORE : 0);
+		if( n < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			if( errno == EAGAIN || errno == EWOULDBLOCK )
+				return 0;
+			DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
+			return -1;
+		}
+		h->res_sent += n;
+	}
 
-	while( offset <= end_offset )
+	while( h->xfer_fd >= 0 && h->xfer_offset <= h->xfer_end )
 	{
+		len = h->xfer_end - h->xfer_offset + 1;
 #if HAVE_SENDFILE
-		if( try_sendfile )
+		if( !h->xfer_buf )
 		{
-			send_size = ( ((end_offset - offset) < MAX_BUFFER_SIZE) ? (end_offset - offset + 1) : MAX_BUFFER_SIZE);
-			ret = sys_sendfile(h->socket, sendfd, &offset, send_size);
-			if( ret == -1 )
+			n = sys_sendfile(h->socket, h->xfer_fd, &h->xfer_offset,
+			                 (len < MAX_BUFFER_SIZE) ? len : MAX_BUFFER_SIZE);
+			if( n > 0 )
+				continue;
+			if( n == 0 )
 			{
-				DPRINTF(E_DEBUG, L_HTTP, "sendfile error :: error no. %d [%s]\n", errno, strerror(errno));
-				/* If sendfile isn't supported on the filesystem, don't bother trying to use it again. */
-				if( errno == EOVERFLOW || errno == EINVAL )
-					try_sendfile = 0;
-				else if( errno != EAGAIN )
-					break;
+				DPRINTF(E_WARN, L_HTTP, "sendfile: unexpected end of file\n");
+				return -1;
 			}
-			else
-			{
-				//DPRINTF(E_DEBUG, L_HTTP, "sent %lld bytes to %d. offset is now %lld.\n", ret, h->socket, offset);
+			if( errno == EINTR )
 				continue;
-			}
+			if( errno == EAGAIN )
+				return 0;
+			DPRINTF(E_DEBUG, L_HTTP, "sendfile error :: error no. %d [%s]\n", errno, strerror(errno));
+			/* If sendfile isn't supported on the filesystem, don't bother trying to use it again. */
+			if( errno != EOVERFLOW && errno != EINVAL )
+				return -1;
 		}
 #endif
 		/* Fall back to regular I/O */
-		if( !buf )
-			buf = malloc(MIN_BUFFER_SIZE);
-		send_size = (((end_offset - offset) < MIN_BUFFER_SIZE) ? (end_offset - offset + 1) : MIN_BUFFER_SIZE);
-		lseek(sendfd, offset, SEEK_SET);
-		ret = read(sendfd, buf, send_size);
-		if( ret == -1 ) {
-			DPRINTF(E_DEBUG, L_HTTP, "read error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno == EAGAIN )
+		if( !h->xfer_buf && !(h->xfer_buf = malloc(MIN_BUFFER_SIZE)) )
+			return -1;
+		if( len > MIN_BUFFER_SIZE )
+			len = MIN_BUFFER_SIZE;
+		n = pread(h->xfer_fd, h->xfer_buf, len, h->xfer_offset);
+		if( n <= 0 )
+		{
+			if( n < 0 && errno == EINTR )
 				continue;
-			else
-				break;
+			DPRINTF(E_DEBUG, L_HTTP, "read error :: error no. %d [%s]\n", errno, strerror(errno));
+			return -1;
 		}
-		ret = write(h->socket, buf, ret);
-		if( ret == -1 ) {
-			DPRINTF(E_DEBUG, L_HTTP, "write error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno == EAGAIN )
+		n = send(h->socket, h->xfer_buf, n, 0);
+		if( n < 0 )
+		{
+			if( errno == EINTR )
 				continue;
-			else
-				break;
+			if( errno == EAGAIN || errno == EWOULDBLOCK )
+				return 0;
+			DPRINTF(E_DEBUG, L_HTTP, "write error :: error no. %d [%s]\n", errno, strerror(errno));
+			return -1;
+		}
+		h->xfer_offset += n;
+	}
+
+	return 1;
+}
+
+/* Send the queued response data from res_sent on, followed by bytes
+ * offset through end_offset of fd (if fd isn't -1), without blocking the
+ * event loop.  The transfer owns fd from here on.  Only file transfers
+ * count against max_connections; anything else is already in memory. */
+static void
+start_xfer(struct upnphttp * h, int fd, off_t offset, off_t end_offset)
+{
+	if( fd >= 0 && n_xfer >= runtime_vars.max_connections )
+	{
+		DPRINTF(E_WARN, L_HTTP, "Exceeded max connections [%d], refusing transfer\n",
+			runtime_vars.max_connections);
+		close(fd);
+		free(h->res_buf);
+		h->res_buf = NULL;
+		h->res_buflen = h->res_buf_alloclen = 0;
+		Send503(h);
+		return;
+	}
+
+	h->xfer_fd = fd;
+	h->xfer_offset = offset;
+	h->xfer_end = end_offset;
+	h->state = 4;
+	n_xfer++;
+	/* the scanner holds back while a file is streamed */
+	if( fd >= 0 )
+		scan_io_streaming(1);
+	if( h->req_client )
+		h->req_client->connections++;
+
+	continue_xfer(h);
+}
+
+static void
+continue_xfer(struct upnphttp * h)
+{
+	int ret;
+
+	ret = send_xfer(h);
+	if( ret == 0 )
+	{
+		/* wait for the client to catch up */
+		if( h->ev.rdwr != EVENT_WRITE )
+		{
+			h->ev.rdwr = EVENT_WRITE;
+			event_module.mod(&h->ev);
 		}
-		offset += ret;
+		return;
+	}
+
+	end_xfer(h);
+	if( ret < 0 )
+	{
+		CloseSocket_upnphttp(h);
+		return;
+	}
+	if( h->ev.rdwr != EVENT_READ )
+	{
+		h->ev.rdwr = EVENT_READ;
+		event_module.mod(&h->ev);
 	}
-	free(buf);
+	Finish_upnphttp(h);
+}
+
+static void
+end_xfer(struct upnphttp * h)
+{
+	if( h->xfer_fd >= 0 )
+	{
+		close(h->xfer_fd);
+		h->xfer_fd = -1;
+		scan_io_streaming(-1);
+	}
+	free(h->xfer_buf);
+	h->xfer_buf = NULL;
+	/* don't hang on to a large in-memory body */
+	free(h->res_buf);
+	h->res_buf = NULL;
+	h->res_buflen = h->res_buf_alloclen = 0;
+	h->res_sent = 0;
+	n_xfer--;
+	if( h->req_client )
+		h->req_client->connections--;
+	h->state = 0;
 }
 
 static void
-start_dlna_header(struct string_s *str, int respcode, const char *tmode, const char *mime)
+start_dlna_header(struct upnphttp *h, struct string_s *str, int respcode, const char *tmode, const char *mime)
 {
 	char date[30];
 	time_t now;
@@ -1333,14 +1706,15 @@ start_dlna_header(struct string_s *str, int respcode, const char *tmode, const c
 	now = time(NULL);
 	strftime(date, sizeof(date),"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&now));
 	strcatf(str, "HTTP/1.1 %d OK\r\n"
-	             "Connection: close\r\n"
+	             "Connection: %s\r\n"
 	             "Date: %s\r\n"
 	             "Server: " MINIDLNA_SERVER_STRING "\r\n"
 	             "EXT:\r\n"
 	             "realTimeInfo.dlna.org: DLNA.ORG_TLAG=*\r\n"
 	             "transferMode.dlna.org: %s\r\n"
 	             "Content-Type: %s\r\n",
-	             respcode, date, tmode, mime);
+	             respcode, (h->reqflags & FLAG_KEEPALIVE) ? "keep-alive" : "close",
+	             date, tmode, mime);
 }
 
 static int
@@ -1429,15 +1803,17 @@ SendResp_icon(struct upnphttp * h, char * icon)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", mime);
+	start_dlna_header(h, &str, 200, "Interactive", mime);
 	strcatf(&str, "Content-Length: %d\r\n\r\n", size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( queue_data(h, str.data, str.off) != 0 ||
+	    (h->req_command != EHead && queue_data(h, data, size) != 0) )
 	{
-		if( h->req_command != EHead )
-			send_data(h, data, size, 0);
+		h->res_buflen = 0;
+		Send500(h);
+		return;
 	}
-	CloseSocket_upnphttp(h);
+	start_xfer(h, -1, 0, -1);
 }
 
 static void
@@ -1483,18 +1859,23 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	start_dlna_header(h, &str, 200, "Interactive", "image/jpeg");
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN\r\n\r\n",
 	              (intmax_t)size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( queue_data(h, str.data, str.off) != 0 )
+	{
+		close(fd);
+		Send500(h);
+		return;
+	}
+	if( h->req_command == EHead )
 	{
-		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
+		close(fd);
+		fd = -1;
 	}
-	close(fd);
-	CloseSocket_upnphttp(h);
+	start_xfer(h, fd, 0, size-1);
 }
 
 static void
@@ -1533,16 +1914,21 @@ SendResp_caption(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "smi/caption");
+	start_dlna_header(h, &str, 200, "Interactive", "smi/caption");
 	strcatf(&str, "Content-Length: %jd\r\n\r\n", (intmax_t)size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( queue_data(h, str.data, str.off) != 0 )
+	{
+		close(fd);
+		Send500(h);
+		return;
+	}
+	if( h->req_command == EHead )
 	{
-		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
+		close(fd);
+		fd = -1;
 	}
-	close(fd);
-	CloseSocket_upnphttp(h);
+	start_xfer(h, fd, 0, size-1);
 }
 
 static void
@@ -1596,32 +1982,108 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	start_dlna_header(h, &str, 200, "Interactive", "image/jpeg");
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1\r\n\r\n",
 	              (intmax_t)ed->size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( queue_data(h, str.data, str.off) != 0 ||
+	    (h->req_command != EHead && queue_data(h, (char *)ed->data, ed->size) != 0) )
 	{
-		if( h->req_command != EHead )
-			send_data(h, (char *)ed->data, ed->size, 0);
+		h->res_buflen = 0;
+		Send500(h);
 	}
+	else
+		start_xfer(h, -1, 0, -1);
 	exif_data_unref(ed);
-	CloseSocket_upnphttp(h);
+}
+
+/* A resized image, made on a SOAP worker */
+struct resize_job {
+	char *path;
+	int scale;
+	int rotate;
+	int dstw;
+	int dsth;
+	int chunked;
+	unsigned char *data;
+	int size;
+	struct string_s str;
+	char header[512];
+};
+
+/* Decode, resize and encode the image; only touches the job */
+static void
+resize_image(void *arg)
+{
+	struct resize_job *job = arg;
+	image_s *imsrc, *imdst = NULL;
+
+	imsrc = image_new_from_jpeg(job->path, 1, NULL, 0, job->scale, job->rotate);
+	if( !imsrc )
+	{
+		DPRINTF(E_WARN, L_HTTP, "Unable to open image %s!\n", job->path);
+		return;
+	}
+	imdst = image_resize(imsrc, job->dstw, job->dsth);
+	if( imdst )
+	{
+		job->data = image_save_to_jpeg_buf(imdst, &job->size);
+		image_free(imdst);
+	}
+	image_free(imsrc);
+}
+
+/* Back on the main thread: send what resize_image() made */
+static void
+send_resized(struct upnphttp * h, void *arg)
+{
+	struct resize_job *job = arg;
+	char buf[32];
+	int ret;
+
+	if( !job->data && !(job->chunked && h->req_command == EHead) )
+	{
+		Send500(h);
+		goto done;
+	}
+	if( !job->chunked )
+		strcatf(&job->str, "Content-Length: %d\r\n\r\n", job->size);
+
+	ret = queue_data(h, job->str.data, job->str.off);
+	if( ret == 0 && h->req_command != EHead )
+	{
+		if( job->chunked )
+		{
+			snprintf(buf, sizeof(buf), "%x\r\n", job->size);
+			ret |= queue_data(h, buf, strlen(buf));
+		}
+		ret |= queue_data(h, (char *)job->data, job->size);
+		if( job->chunked )
+			ret |= queue_data(h, "\r\n0\r\n\r\n", 7);
+	}
+	if( ret == 0 )
+		start_xfer(h, -1, 0, -1);
+	else
+	{
+		h->res_buflen = 0;
+		Send500(h);
+	}
+done:
+	free(job->data);
+	free(job->path);
+	free(job);
 }
 
 static void
 SendResp_resizedimg(struct upnphttp * h, char * object)
 {
-	char header[512];
 	char buf[128];
-	struct string_s str;
 	char **result;
 	char dlna_pn[22];
 	uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I;
-	int width=640, height=480, dstw, dsth, size;
+	int width=640, height=480, dstw, dsth;
 	int srcw, srch;
-	unsigned char * data = NULL;
 	char *path, *file_path = NULL;
 	char *resolution = NULL;
 	char *key, *val;
@@ -1629,12 +2091,13 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	int rotate;
 	int pixw = 0, pixh = 0;
 	long long id;
-	int rows=0, chunked, ret;
-	image_s *imsrc = NULL, *imdst = NULL;
+	int rows=0, ret;
+	struct resize_job *job;
 	int scale = 1;
 	const char *tmode;
 
 	id = strtoll(object, &saveptr, 10);
+	backfill_want(id);
 	snprintf(buf, sizeof(buf), "SELECT PATH, RESOLUTION, ROTATION from DETAILS where ID = '%lld'", (long long)id);
 	ret = sql_get_table(db, buf, &result, &rows, NULL);
 	if( ret != SQLITE_OK )
@@ -1688,15 +2151,6 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 		}
 	}
 
-#if USE_FORK
-	pid_t newpid = 0;
-	newpid = process_fork(h->req_client);
-	if( newpid > 0 )
-	{
-		CloseSocket_upnphttp(h);
-		goto resized_error;
-	}
-#endif
 	if( h->reqflags & (FLAG_XFERSTREAMING|FLAG_RANGE) )
 	{
 		DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Streaming with an image!\n");
@@ -1729,7 +2183,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	if( ret != 2 )
 	{
 		Send500(h);
-		return;
+		goto resized_error;
 	}
 	/* Figure out the best destination resolution we can use */
 	dstw = width;
@@ -1764,80 +2218,42 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	else if( srcw>>2 >= dstw && srch>>2 >= dsth )
 		scale = 2;
 
-	INIT_STR(str, header);
+	job = calloc(1, sizeof(*job));
+	if( !job || !(job->path = strdup(file_path)) )
+	{
+		free(job);
+		Send500(h);
+		goto resized_error;
+	}
+	job->scale = scale;
+	job->rotate = rotate;
+	job->dstw = dstw;
+	job->dsth = dsth;
+	INIT_STR(job->str, job->header);
 
-#if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	if( h->reqflags & FLAG_XFERBACKGROUND )
 		tmode = "Background";
 	else
-#endif
 		tmode = "Interactive";
-	start_dlna_header(&str, 200, tmode, "image/jpeg");
-	strcatf(&str, "contentFeatures.dlna.org: %sDLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\r\n",
+	start_dlna_header(h, &job->str, 200, tmode, "image/jpeg");
+	strcatf(&job->str, "contentFeatures.dlna.org: %sDLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\r\n",
 	              dlna_pn, dlna_flags, 0);
 
-	if( strcmp(h->HttpVer, "HTTP/1.0") == 0 )
-	{
-		chunked = 0;
-		imsrc = image_new_from_jpeg(file_path, 1, NULL, 0, scale, rotate);
-	}
-	else
-	{
-		chunked = 1;
-		strcatf(&str, "Transfer-Encoding: chunked\r\n\r\n");
-	}
+	job->chunked = strcmp(h->HttpVer, "HTTP/1.0") != 0;
+	if( job->chunked )
+		strcatf(&job->str, "Transfer-Encoding: chunked\r\n\r\n");
 
-	if( !chunked )
+	if( job->chunked && h->req_command == EHead )
+		send_resized(h, job);
+	/* decoding a large photo takes a while, so it is done on a worker */
+	else if( queue_http_job(h, resize_image, send_resized, job) != 0 )
 	{
-		if( !imsrc )
-		{
-			DPRINTF(E_WARN, L_HTTP, "Unable to open image %s!\n", file_path);
-			Send500(h);
-			goto resized_error;
-		}
-
-		imdst = image_resize(imsrc, dstw, dsth);
-		data = image_save_to_jpeg_buf(imdst, &size);
-
-		strcatf(&str, "Content-Length: %d\r\n\r\n", size);
+		resize_image(job);
+		send_resized(h, job);
 	}
 
-	if( (send_data(h, str.data, str.off, 0) == 0) && (h->req_command != EHead) )
-	{
-		if( chunked )
-		{
-			imsrc = image_new_from_jpeg(file_path, 1, NULL, 0, scale, rotate);
-			if( !imsrc )
-			{
-				DPRINTF(E_WARN, L_HTTP, "Unable to open image %s!\n", file_path);
-				Send500(h);
-				goto resized_error;
-			}
-			imdst = image_resize(imsrc, dstw, dsth);
-			data = image_save_to_jpeg_buf(imdst, &size);
-
-			ret = sprintf(buf, "%x\r\n", size);
-			send_data(h, buf, ret, MSG_MORE);
-			send_data(h, (char *)data, size, MSG_MORE);
-			send_data(h, "\r\n0\r\n\r\n", 7, 0);
-		}
-		else
-		{
-			send_data(h, (char *)data, size, 0);
-		}
-	}
-	DPRINTF(E_INFO, L_HTTP, "Done serving %s\n", file_path);
-	if( imsrc )
-		image_free(imsrc);
-	if( imdst )
-		image_free(imdst);
-	CloseSocket_upnphttp(h);
 resized_error:
 	sqlite3_free_table(result);
-#if USE_FORK
-	if( newpid == 0 )
-		_exit(0);
-#endif
 }
 
 static void
@@ -1852,20 +2268,18 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	int64_t id;
 	int sendfh;
 	uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
-	uint32_t cflags = h->req_client ? h->req_client->type->flags : 0;
+	uint32_t cflags = h->req_cflags;
 	const char *tmode;
-	enum client_types ctype = h->req_client ? h->req_client->type->type : 0;
+	enum client_types ctype = h->req_ctype;
 	static struct { int64_t id;
 	                enum client_types client;
 	                char path[PATH_MAX];
 	                char mime[32];
 	                char dlna[96];
 	              } last_file = { 0, 0 };
-#if USE_FORK
-	pid_t newpid = 0;
-#endif
 
 	id = strtoll(object, NULL, 10);
+	backfill_want(id);
 	if( cflags & FLAG_MS_PFS )
 	{
 		if( strstr(object, "?albumArt=true") )
@@ -1931,15 +2345,6 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			last_file.dlna[0] = '\0';
 		sqlite3_free_table(result);
 	}
-#if USE_FORK
-	newpid = process_fork(h->req_client);
-	if( newpid > 0 )
-	{
-		CloseSocket_upnphttp(h);
-		return;
-	}
-#endif
-
 	DPRINTF(E_INFO, L_HTTP, "Serving DetailID: %lld [%s]\n", (long long)id, last_file.path);
 
 	if( h->reqflags & FLAG_XFERSTREAMING )
@@ -1948,7 +2353,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		{
 			DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Streaming with an image!\n");
 			Send406(h);
-			goto error;
+			return;
 		}
 	}
 	else if( h->reqflags & FLAG_XFERINTERACTIVE )
@@ -1957,7 +2362,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		{
 			DPRINTF(E_WARN, L_HTTP, "Bad realTimeInfo flag with Interactive request!\n");
 			Send400(h);
-			goto error;
+			return;
 		}
 		if( strncmp(last_file.mime, "image", 5) != 0 )
 		{
@@ -1967,7 +2372,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			if( !(cflags & FLAG_SAMSUNG) || GETFLAG(DLNA_STRICT_MASK) )
 			{
 				Send406(h);
-				goto error;
+				return;
 			}
 		}
 	}
@@ -1979,24 +2384,21 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			Send403(h);
 		else
 			Send404(h);
-		goto error;
+		return;
 	}
 	size = lseek(sendfh, 0, SEEK_END);
 	lseek(sendfh, 0, SEEK_SET);
 
 	INIT_STR(str, header);
 
-#if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	if( h->reqflags & FLAG_XFERBACKGROUND )
 		tmode = "Background";
-	else
-#endif
-	if( strncmp(last_file.mime, "image", 5) == 0 )
+	else if( strncmp(last_file.mime, "image", 5) == 0 )
 		tmode = "Interactive";
 	else
 		tmode = "Streaming";
 
-	start_dlna_header(&str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
+	start_dlna_header(h, &str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
 
 	if( h->reqflags & FLAG_RANGE )
 	{
@@ -2009,14 +2411,14 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			DPRINTF(E_WARN, L_HTTP, "Specified range was invalid!\n");
 			Send400(h);
 			close(sendfh);
-			goto error;
+			return;
 		}
 		if( h->req_RangeEnd >= size )
 		{
 			DPRINTF(E_WARN, L_HTTP, "Specified range was outside file boundaries!\n");
 			Send416(h);
 			close(sendfh);
-			goto error;
+			return;
 		}
 
 		total = h->req_RangeEnd - h->req_RangeStart + 1;
@@ -2056,18 +2458,16 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	              last_file.dlna, 1, 0, dlna_flags, 0);
 
 	//DEBUG DPRINTF(E_DEBUG, L_HTTP, "RESPONSE: %s\n", str.data);
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( queue_data(h, str.data, str.off) != 0 )
 	{
-		if( h->req_command != EHead )
-			send_file(h, sendfh, offset, h->req_RangeEnd);
+		close(sendfh);
+		Send500(h);
+		return;
 	}
-	close(sendfh);
-
-	CloseSocket_upnphttp(h);
-error:
-#if USE_FORK
-	if( newpid == 0 )
-		_exit(0);
-#endif
-	return;
+	if( h->req_command == EHead )
+	{
+		close(sendfh);
+		sendfh = -1;
+	}
+	start_xfer(h, sendfh, offset, h->req_RangeEnd);
 }
@@ -51,20 +51,43 @@
 
 #include <netinet/in.h>
 #include <sys/queue.h>
+#include <time.h>
 
 #include "minidlnatypes.h"
 #include "config.h"
+#include "event.h"
 
 /* server: HTTP header returned in all HTTP responses : */
 #define MINIDLNA_SERVER_STRING	OS_VERSION " DLNADOC/1.50 UPnP/1.0 " SERVER_NAME "/" MINIDLNA_VERSION
 
+/* seconds a persistent connection may stay idle between requests */
+#define HTTP_KEEPALIVE_TIMEOUT	15
+
+/* req_buf starts out this size, and the request headers must fit in it */
+#define HTTP_REQ_BUFSIZE	8192
+/* largest request (headers and body) we will buffer */
+#define HTTP_REQ_MAXSIZE	(1024 * 1024)
+
 /*
  states :
   0 - waiting for data to read
   1 - waiting for HTTP Post Content.
+  2 - waiting for the rest of a chunked request.
+  3 - a pipelined request is already buffered.
+  4 - sending a response body from the event loop.
+  5 - a SOAP worker thread owns the request.
   ...
   >= 100 - to be deleted
 */
+/* A header value, kept as an offset into req_buf so that it stays valid
+ * when the buffer grows to hold the body.  off is 0 if it wasn't sent. */
+struct http_slice {
+	int off;
+	int len;
+};
+
+#define HTTP_SLICE(h, s)	((h)->req_buf + (s).off)
+
 enum httpCommands {
 	EUnknown = 0,
 	EGet,
@@ -75,39 +98,56 @@ enum httpCommands {
 };
 
 struct upnphttp {
+	struct event ev;
 	int socket;
 	struct in_addr clientaddr;	/* client address */
 	int iface;
 	int state;
+	time_t timestamp;	/* last activity, see Expire_upnphttp() */
 	char HttpVer[16];
 	/* request */
 	char * req_buf;
 	int req_buflen;
+	int req_bufsize;	/* allocated size of req_buf */
+	/* everything from req_contentlen up to res_buf is reset between
+	 * requests on a persistent connection */
 	int req_contentlen;
 	int req_contentoff;     /* header length */
+	int req_scanoff;	/* req_buf already searched for the end of headers */
 	enum httpCommands req_command;
 	struct client_cache_s * req_client;
-	const char * req_soapAction;
-	int req_soapActionLen;
-	const char * req_Callback;	/* For SUBSCRIBE */
-	int req_CallbackLen;
-	const char * req_NT;
-	int req_NTLen;
+	/* copies of what SOAP workers need from req_client, since the main
+	 * thread may give its cache slot to another client meanwhile */
+	int req_ctype;
+	uint32_t req_cflags;
+	char * req_password;
+	struct http_slice req_soapAction;
+	struct http_slice req_Callback;	/* For SUBSCRIBE */
+	struct http_slice req_NT;
 	int req_Timeout;
-	const char * req_SID;		/* For UNSUBSCRIBE */
-	int req_SIDLen;
+	struct http_slice req_SID;	/* For UNSUBSCRIBE */
 	off_t req_RangeStart;
 	off_t req_RangeEnd;
 	long int req_chunklen;
 	uint32_t reqflags;
+	const char * res_SID;		/* sent back with FLAG_SID */
+	int res_SIDLen;
+	char * res_password;	/* the client's new password list, */
+	int res_setpassword;	/* set once the SOAP worker is done */
 	/* response */
 	char * res_buf;
 	int res_buflen;
 	int res_buf_alloclen;
 	uint32_t respflags;
+	/* transfer state, while in state 4 */
+	int res_sent;		/* bytes of res_buf already sent */
+	int xfer_fd;		/* file to send after res_buf, or -1 */
+	off_t xfer_offset;
+	off_t xfer_end;		/* last byte to send */
+	char * xfer_buf;	/* only used if sendfile() can't be */
 	/*int res_contentlen;*/
 	/*int res_contentoff;*/		/* header length */
-	LIST_ENTRY(upnphttp) entries;
+	TAILQ_ENTRY(upnphttp) entries;
 };
 
 #define FLAG_TIMEOUT            0x00000001
@@ -115,6 +155,7 @@ struct upnphttp {
 #define FLAG_RANGE              0x00000004
 #define FLAG_HOST               0x00000008
 #define FLAG_LANGUAGE           0x00000010
+#define FLAG_KEEPALIVE          0x00000020
 
 #define FLAG_INVALID_REQ        0x00000040
 #define FLAG_HTML               0x00000080
@@ -144,10 +185,25 @@ CloseSocket_upnphttp(struct upnphttp *);
 void
 Delete_upnphttp(struct upnphttp *);
 
-/* Process_upnphttp() */
-void
+/* Process_upnphttp()
+ * advance the request by one step; returns 1 once the socket has no
+ * more to read until the next event */
+int
 Process_upnphttp(struct upnphttp *);
 
+/* Finish_upnphttp()
+ * called once a response has been sent: get ready for the next
+ * request on a persistent connection, or close the socket */
+void
+Finish_upnphttp(struct upnphttp *);
+
+/* Expire_upnphttp()
+ * free the connections that finished since the last call, close those
+ * idle for at least timeout seconds (0 closes them all) and return the
+ * number still open.  Call it between batches of events. */
+int
+Expire_upnphttp(int timeout);
+
 /* BuildHeader_upnphttp()
  * build the header for the HTTP Response
  * also allocate the buffer for body data */
@@ -175,9 +231,16 @@ Send500(struct upnphttp *);
 void
 Send501(struct upnphttp *);
 
-/* SendResp_upnphttp() */
+/* SendResp_upnphttp()
+ * send the response without blocking; the rest goes out in state 4 */
 void
 SendResp_upnphttp(struct upnphttp *);
 
+/* SendChunk_upnphttp()
+ * queue a chunk of a response built with FLAG_CHUNKED in respflags,
+ * or the last one if len is 0, and send what the socket will take */
+int
+SendChunk_upnphttp(struct upnphttp *, const char *, int);
+
 #endif
 
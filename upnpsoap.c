@@ -60,6 +60,10 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "upnpglobalvars.h"
 #include "utils.h"
@@ -72,6 +76,8 @@
 #include "sql.h"
 #include "log.h"
 
+#define INIT_STR(s, d) { s.data = d; s.size = sizeof(d); s.off = 0; }
+
 #ifdef __sparc__ /* Sorting takes too long on slow processors with very large containers */
 # define __SORT_LIMIT if( totalMatches < 10000 )
 #else
@@ -123,27 +129,27 @@ SoapError(struct upnphttp * h, int errCode, const char * errDesc)
 	DPRINTF(E_WARN, L_HTTP, "Returning UPnPError %d: %s\n", errCode, errDesc);
 	bodylen = snprintf(body, sizeof(body), resp, errCode, errDesc);
 	BuildResp2_upnphttp(h, 500, "Internal Server Error", body, bodylen);
-	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
 }
 
+static const char beforebody[] =
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body>";
+
+static const char afterbody[] =
+	"</s:Body>"
+	"</s:Envelope>\r\n";
+
+/* Actions only build their response; ExecuteSoapAction() or the worker
+ * pool sends it, so that actions can run off the main thread. */
 static void
-BuildSendAndCloseSoapResp(struct upnphttp * h,
+BuildSoapResp(struct upnphttp * h,
                           const char * body, int bodylen)
 {
-	static const char beforebody[] =
-		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
-		"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-		"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-		"<s:Body>";
-
-	static const char afterbody[] =
-		"</s:Body>"
-		"</s:Envelope>\r\n";
-
 	if (!body || bodylen < 0)
 	{
-		Send500(h);
+		SoapError(h, 501, "Action Failed");
 		return;
 	}
 
@@ -158,13 +164,257 @@ BuildSendAndCloseSoapResp(struct upnphttp * h,
 
 	memcpy(h->res_buf + h->res_buflen, afterbody, sizeof(afterbody) - 1);
 	h->res_buflen += sizeof(afterbody) - 1;
+}
 
-	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+/* Send the result built so far as a chunk of a streamed response, sending
+ * the header first if this is the first one.  Once anything has been
+ * streamed, a failure can only be reported by closing the connection. */
+static int
+StreamSoapResp(struct Response *args, int last)
+{
+	struct upnphttp *h = args->h;
+	struct string_s *str = args->str;
+
+	if( args->streaming < 0 || quitting )
+		goto error;
+	if( !args->streaming )
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Streaming SOAP response [%d results so far]\n",
+			args->returned);
+		args->streaming = 1;
+		h->respflags |= FLAG_CHUNKED;
+		BuildHeader_upnphttp(h, 200, "OK", 0);
+		if( SendChunk_upnphttp(h, beforebody, sizeof(beforebody) - 1) != 0 )
+			goto error;
+	}
+	if( str->off && SendChunk_upnphttp(h, str->data, str->off) != 0 )
+		goto error;
+	str->off = 0;
+	if( last && (SendChunk_upnphttp(h, afterbody, sizeof(afterbody) - 1) != 0 ||
+	             SendChunk_upnphttp(h, NULL, 0) != 0) )
+		goto error;
+	return 0;
+error:
+	h->reqflags &= ~FLAG_KEEPALIVE;
+	args->streaming = -1;
+	return -1;
+}
+
+/* Build the response, or finish streaming it if it outgrew the buffer */
+static void
+EndSoapResp(struct upnphttp * h, struct Response *args)
+{
+	if( args->streaming )
+		StreamSoapResp(args, 1);
+	else
+		BuildSoapResp(h, args->str->data, args->str->off);
+}
+
+/* Browse and Search responses are cached until the database changes.
+ * An entry is only good for the updateID and change count it was built
+ * under, so the whole cache is dropped as soon as either moves. */
+#define SOAP_CACHE_BUCKETS 256
+
+struct soap_cache_entry {
+	struct soap_cache_entry *next;	/* hash chain */
+	TAILQ_ENTRY(soap_cache_entry) lru;
+	unsigned int hash;
+	int keylen;
+	int len;
+	char *data;			/* response body, followed by the key */
+};
+
+struct soap_cache_stamp {
+	uint32_t update_id;
+	unsigned int changes;
+};
+
+static TAILQ_HEAD(soap_cache_lru, soap_cache_entry) cache_lru = TAILQ_HEAD_INITIALIZER(cache_lru);
+static struct soap_cache_entry *cache_table[SOAP_CACHE_BUCKETS];
+static struct soap_cache_stamp cache_stamp;
+static size_t cache_bytes;
+static unsigned long cache_hits, cache_misses;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+soap_cache_hash(const char *key, int len)
+{
+	unsigned int hash = 5381;
+
+	while (len--)
+		hash = ((hash << 5) + hash) + (unsigned char)*key++;
+
+	return hash;
+}
+
+static void
+soap_cache_remove(struct soap_cache_entry *e)
+{
+	struct soap_cache_entry **p;
+
+	for (p = &cache_table[e->hash % SOAP_CACHE_BUCKETS]; *p != e; p = &(*p)->next)
+		continue;
+	*p = e->next;
+	TAILQ_REMOVE(&cache_lru, e, lru);
+	cache_bytes -= sizeof(*e) + e->len + e->keylen;
+	free(e->data);
+	free(e);
+}
+
+static struct soap_cache_stamp
+soap_cache_now(void)
+{
+	struct soap_cache_stamp now;
+
+	now.update_id = updateID;
+	now.changes = sql_commits;
+
+	return now;
+}
+
+/* Called with cache_lock held.  Returns the current generation, dropping
+ * every entry if it has moved on since they were stored. */
+static struct soap_cache_stamp
+soap_cache_check(void)
+{
+	struct soap_cache_stamp now = soap_cache_now();
+	struct soap_cache_entry *e;
+
+	if (now.update_id != cache_stamp.update_id || now.changes != cache_stamp.changes)
+	{
+		while ((e = TAILQ_FIRST(&cache_lru)) != NULL)
+			soap_cache_remove(e);
+		cache_stamp = now;
+	}
+
+	return now;
+}
+
+/* Length-prefix every field, so that no value can run into the next */
+static void
+soap_cache_key_add(struct string_s *key, const char *val)
+{
+	if (val)
+		strcatf(key, "%d:%s", (int)strlen(val), val);
+	else
+		strcatf(key, "-:");
+}
+
+static int
+soap_cache_key(struct string_s *key, const char *action, const struct Response *args,
+               int start, int count, const char *id, const char *criteria, const char *sort)
+{
+	strcatf(key, "%s:%d:%d:%u:%u:%d:%d:", action, start, count,
+		args->filter, args->flags, args->client, args->iface);
+	soap_cache_key_add(key, id);
+	soap_cache_key_add(key, criteria);
+	soap_cache_key_add(key, sort);
+	soap_cache_key_add(key, args->password);
+
+	/* a truncated key could match someone else's request */
+	return (key->off < key->size - 1);
+}
+
+/* Build the response from the cache if we have it.  Otherwise note the
+ * generation in *stamp for soap_cache_put(). */
+static int
+soap_cache_get(struct upnphttp *h, const struct string_s *key,
+               struct soap_cache_stamp *stamp)
+{
+	struct soap_cache_entry *e;
+	unsigned int hash;
+
+	hash = soap_cache_hash(key->data, key->off);
+	pthread_mutex_lock(&cache_lock);
+	*stamp = soap_cache_check();
+	for (e = cache_table[hash % SOAP_CACHE_BUCKETS]; e; e = e->next)
+	{
+		if (e->hash == hash && e->keylen == key->off &&
+		    memcmp(e->data + e->len, key->data, key->off) == 0)
+			break;
+	}
+	if (e)
+	{
+		cache_hits++;
+		TAILQ_REMOVE(&cache_lru, e, lru);
+		TAILQ_INSERT_HEAD(&cache_lru, e, lru);
+		BuildSoapResp(h, e->data, e->len);
+	}
+	else
+		cache_misses++;
+	pthread_mutex_unlock(&cache_lock);
+
+	return (e != NULL);
+}
+
+static void
+soap_cache_put(const struct string_s *key, const struct soap_cache_stamp *stamp,
+               const char *body, int len)
+{
+	struct soap_cache_entry *e, *dup;
+	struct soap_cache_stamp now;
+	size_t budget = (size_t)runtime_vars.browse_cache_size * 1024;
+	size_t size = sizeof(*e) + len + key->off;
+
+	/* one large response should not wipe out everything else */
+	if (size > budget / 8)
+		return;
+	e = malloc(sizeof(*e));
+	if (!e)
+		return;
+	e->data = malloc(len + key->off);
+	if (!e->data)
+	{
+		free(e);
+		return;
+	}
+	memcpy(e->data, body, len);
+	memcpy(e->data + len, key->data, key->off);
+	e->len = len;
+	e->keylen = key->off;
+	e->hash = soap_cache_hash(key->data, key->off);
+
+	pthread_mutex_lock(&cache_lock);
+	now = soap_cache_check();
+	/* the database changed while we were building it */
+	if (now.update_id != stamp->update_id || now.changes != stamp->changes)
+	{
+		pthread_mutex_unlock(&cache_lock);
+		free(e->data);
+		free(e);
+		return;
+	}
+	/* another worker may have beaten us to it */
+	for (dup = cache_table[e->hash % SOAP_CACHE_BUCKETS]; dup; dup = dup->next)
+	{
+		if (dup->hash == e->hash && dup->keylen == e->keylen &&
+		    memcmp(dup->data + dup->len, key->data, key->off) == 0)
+		{
+			soap_cache_remove(dup);
+			break;
+		}
+	}
+	while (cache_bytes + size > budget)
+		soap_cache_remove(TAILQ_LAST(&cache_lru, soap_cache_lru));
+	e->next = cache_table[e->hash % SOAP_CACHE_BUCKETS];
+	cache_table[e->hash % SOAP_CACHE_BUCKETS] = e;
+	TAILQ_INSERT_HEAD(&cache_lru, e, lru);
+	cache_bytes += size;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void
+upnpsoap_cache_stats(unsigned long *hits, unsigned long *misses, size_t *bytes)
+{
+	pthread_mutex_lock(&cache_lock);
+	*hits = cache_hits;
+	*misses = cache_misses;
+	*bytes = cache_bytes;
+	pthread_mutex_unlock(&cache_lock);
 }
 
 static void
-GetSystemUpdateID(struct upnphttp * h, const char * action)
+GetSystemUpdateID(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp[] =
 		"<u:%sResponse "
@@ -178,11 +428,11 @@ GetSystemUpdateID(struct upnphttp * h, const char * action)
 	bodylen = snprintf(body, sizeof(body), resp,
 		action, "urn:schemas-upnp-org:service:ContentDirectory:1",
 		updateID, action);
-	BuildSendAndCloseSoapResp(h, body, bodylen);
+	BuildSoapResp(h, body, bodylen);
 }
 
 static void
-IsAuthorizedValidated(struct upnphttp * h, const char * action)
+IsAuthorizedValidated(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp[] =
 		"<u:%sResponse "
@@ -202,7 +452,7 @@ IsAuthorizedValidated(struct upnphttp * h, const char * action)
 		bodylen = snprintf(body, sizeof(body), resp,
 			action, "urn:microsoft.com:service:X_MS_MediaReceiverRegistrar:1",
 			1, action);	
-		BuildSendAndCloseSoapResp(h, body, bodylen);
+		BuildSoapResp(h, body, bodylen);
 	}
 	else
 		SoapError(h, 402, "Invalid Args");
@@ -211,7 +461,7 @@ IsAuthorizedValidated(struct upnphttp * h, const char * action)
 }
 
 static void
-RegisterDevice(struct upnphttp * h, const char * action)
+RegisterDevice(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp[] =
 		"<u:%sResponse "
@@ -225,11 +475,11 @@ RegisterDevice(struct upnphttp * h, const char * action)
 	bodylen = snprintf(body, sizeof(body), resp,
 		action, "urn:microsoft.com:service:X_MS_MediaReceiverRegistrar:1",
 		uuidvalue, action);
-	BuildSendAndCloseSoapResp(h, body, bodylen);
+	BuildSoapResp(h, body, bodylen);
 }
 
 static void
-GetProtocolInfo(struct upnphttp * h, const char * action)
+GetProtocolInfo(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp[] =
 		"<u:%sResponse "
@@ -246,12 +496,12 @@ GetProtocolInfo(struct upnphttp * h, const char * action)
 	bodylen = asprintf(&body, resp,
 		action, "urn:schemas-upnp-org:service:ConnectionManager:1",
 		action);	
-	BuildSendAndCloseSoapResp(h, body, bodylen);
+	BuildSoapResp(h, body, bodylen);
 	free(body);
 }
 
 static void
-GetSortCapabilities(struct upnphttp * h, const char * action)
+GetSortCapabilities(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp[] =
 		"<u:%sResponse "
@@ -271,11 +521,11 @@ GetSortCapabilities(struct upnphttp * h, const char * action)
 	bodylen = snprintf(body, sizeof(body), resp,
 		action, "urn:schemas-upnp-org:service:ContentDirectory:1",
 		action);	
-	BuildSendAndCloseSoapResp(h, body, bodylen);
+	BuildSoapResp(h, body, bodylen);
 }
 
 static void
-GetSearchCapabilities(struct upnphttp * h, const char * action)
+GetSearchCapabilities(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp[] =
 		"<u:%sResponse xmlns:u=\"%s\">"
@@ -300,11 +550,11 @@ GetSearchCapabilities(struct upnphttp * h, const char * action)
 	bodylen = snprintf(body, sizeof(body), resp,
 		action, "urn:schemas-upnp-org:service:ContentDirectory:1",
 		action);	
-	BuildSendAndCloseSoapResp(h, body, bodylen);
+	BuildSoapResp(h, body, bodylen);
 }
 
 static void
-GetCurrentConnectionIDs(struct upnphttp * h, const char * action)
+GetCurrentConnectionIDs(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	/* TODO: Use real data. - JM */
 	static const char resp[] =
@@ -319,11 +569,11 @@ GetCurrentConnectionIDs(struct upnphttp * h, const char * action)
 	bodylen = snprintf(body, sizeof(body), resp,
 		action, "urn:schemas-upnp-org:service:ConnectionManager:1",
 		action);	
-	BuildSendAndCloseSoapResp(h, body, bodylen);
+	BuildSoapResp(h, body, bodylen);
 }
 
 static void
-GetCurrentConnectionInfo(struct upnphttp * h, const char * action)
+GetCurrentConnectionInfo(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	/* TODO: Use real data. - JM */
 	static const char resp[] =
@@ -363,7 +613,7 @@ GetCurrentConnectionInfo(struct upnphttp * h, const char * action)
 		bodylen = snprintf(body, sizeof(body), resp,
 			action, "urn:schemas-upnp-org:service:ConnectionManager:1",
 			action);	
-		BuildSendAndCloseSoapResp(h, body, bodylen);
+		BuildSoapResp(h, body, bodylen);
 	}
 	ClearNameValueList(&data);	
 }
@@ -400,12 +650,41 @@ GetCurrentConnectionInfo(struct upnphttp * h, const char * action)
 #define FILTER_PV_SUBTITLE                       0x0C000000
 #define FILTER_AV_MEDIA_CLASS                    0x10000000
 
+/* A SOAP worker must not touch h->req_client, whose cache slot the main
+ * thread may give to another client meanwhile.  It gets the copy of the
+ * password list made by queue_soap_job(), and soap_process_done() stores
+ * its changes. */
+static char *
+get_client_password(struct upnphttp *h)
+{
+	char *password;
+
+	if (h->state != 5)
+		return h->req_client ? GetClientPassword(h->req_client) : NULL;
+	password = h->req_password;
+	h->req_password = NULL;
+	return password;
+}
+
+static void
+set_client_password(struct upnphttp *h, char *password)
+{
+	if (h->state != 5)
+	{
+		SetClientPassword(h->req_client, password);
+		return;
+	}
+	free(h->res_password);
+	h->res_password = password;
+	h->res_setpassword = 1;
+}
+
 static uint32_t
 set_filter_flags(char *filter, struct upnphttp *h)
 {
 	char *item, *saveptr = NULL;
 	uint32_t flags = 0;
-	int samsung = h->req_client && (h->req_client->type->flags & FLAG_SAMSUNG);
+	int samsung = (h->req_cflags & FLAG_SAMSUNG);
 
 	if( !filter || (strlen(filter) <= 1) ) {
 		/* Not the full 32 bits.  Skip vendor-specific stuff by default. */
@@ -738,7 +1017,7 @@ add_res(char *size, char *duration, char *bitrate, char *sampleFrequency,
 }
 
 static int
-get_child_count(const char *object, struct magic_container_s *magic, const char *password)
+get_child_count(sqlite3 *db, const char *object, struct magic_container_s *magic, const char *password)
 {
 	int ret;
 
@@ -749,6 +1028,11 @@ get_child_count(const char *object, struct magic_container_s *magic, const char
 			ret = sql_get_int_field(db, "SELECT count(*) from %s", magic->child_count);
 		}
 
+	} else if (!password && !scanning) {
+		/* kept up to date by the scanner, but only for public children */
+		if (magic && magic->objectid && *(magic->objectid))
+			object = *(magic->objectid);
+		ret = sql_get_int_bind(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", "s", object);
 	} else if (magic && magic->objectid && *(magic->objectid)) {
 		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s' and (password is null or password = '' or password in (%s));", *(magic->objectid), password ? password : "''");
 	} else {
@@ -759,18 +1043,19 @@ get_child_count(const char *object, struct magic_container_s *magic, const char
 }
 
 static int
-object_exists(const char *object)
+object_exists(sqlite3 *db, const char *object)
 {
 	int ret;
-	ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%q'",
-				strcmp(object, "*") == 0 ? "0" : object);
+	ret = sql_get_int_bind(db, "SELECT count(*) from OBJECTS where OBJECT_ID = ?",
+				"s", strcmp(object, "*") == 0 ? "0" : object);
 	return (ret > 0);
 }
 
 #define COLUMNS "o.DETAIL_ID, o.CLASS," \
                 " d.SIZE, d.TITLE, d.DURATION, d.BITRATE, d.SAMPLERATE, d.ARTIST," \
                 " d.ALBUM, d.GENRE, d.COMMENT, d.CHANNELS, d.TRACK, d.DATE, d.RESOLUTION," \
-                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC "
+                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC," \
+                " o.CHILD_COUNT "
 #define SELECT_COLUMNS "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " COLUMNS
 
 #define NON_ZERO(x) (x && atoi(x))
@@ -780,17 +1065,25 @@ static int
 callback(void *args, int argc, char **argv, char **azColName)
 {
 	struct Response *passed_args = (struct Response *)args;
+	sqlite3 *db = passed_args->db;
 	char *id = argv[0], *parent = argv[1], *refID = argv[2], *detailID = argv[3], *class = argv[4], *size = argv[5], *title = argv[6],
 	     *duration = argv[7], *bitrate = argv[8], *sampleFrequency = argv[9], *artist = argv[10], *album = argv[11],
 	     *genre = argv[12], *comment = argv[13], *nrAudioChannels = argv[14], *track = argv[15], *date = argv[16], *resolution = argv[17],
-	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23];
+	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23],
+	     *child_count = argv[25];
 	char dlna_buf[128];
 	const char *ext;
 	struct string_s *str = passed_args->str;
 	int ret = 0;
 
-	/* Make sure we have at least 8KB left of allocated memory to finish the response. */
-	if( str->off > (str->size - 8192) )
+	/* Make sure we have at least 8KB left of allocated memory to finish the response,
+	 * by sending what we have so far if the response can be streamed. */
+	if( passed_args->h && str->off > (str->size - 8192) )
+	{
+		if( StreamSoapResp(passed_args, 0) != 0 )
+			return -1;
+	}
+	else if( str->off > (str->size - 8192) )
 	{
 #if MAX_RESPONSE_SIZE > 0
 		if( (str->size+DEFAULT_RESP_SIZE) <= MAX_RESPONSE_SIZE )
@@ -824,6 +1117,8 @@ callback(void *args, int argc, char **argv, char **azColName)
 	{
 		uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
 		char *alt_title = NULL;
+		if( backfilling )
+			backfill_want(strtoll(detailID, NULL, 10));
 		/* We may need special handling for certain MIME types */
 		if( *mime == 'v' )
 		{
@@ -863,7 +1158,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 			if( (passed_args->flags & FLAG_CAPTION_RES) ||
 			    (passed_args->filter & (FILTER_SEC_CAPTION_INFO_EX|FILTER_PV_SUBTITLE)) )
 			{
-				if( sql_get_int_field(db, "SELECT ID from CAPTIONS where ID = '%s'", detailID) > 0 )
+				if( sql_get_int_bind(db, "SELECT ID from CAPTIONS where ID = ?", "s", detailID) > 0 )
 					passed_args->flags |= FLAG_HAS_CAPTIONS;
 			}
 			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
@@ -945,7 +1240,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 		if( passed_args->filter & FILTER_SEC_DCM_INFO ) {
 			/* Get bookmark */
 			ret = strcatf(str, "&lt;sec:dcmInfo&gt;CREATIONDATE=0,FOLDER=%s,BM=%d&lt;/sec:dcmInfo&gt;",
-			              title, sql_get_int_field(db, "SELECT SEC from BOOKMARKS where ID = '%s'", detailID));
+			              title, sql_get_int_bind(db, "SELECT SEC from BOOKMARKS where ID = ?", "s", detailID));
 		}
 		if( artist ) {
 			if( (*mime == 'v') && (passed_args->filter & FILTER_UPNP_ACTOR) ) {
@@ -972,7 +1267,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 			add_res(size, duration, bitrate, sampleFrequency, nrAudioChannels,
 			        resolution, dlna_buf, mime, detailID, ext, passed_args);
 			if( *mime == 'i' ) {
-				int srcw, srch;
+				int srcw = 0, srch = 0;
 				if( resolution && (sscanf(resolution, "%6dx%6d", &srcw, &srch) == 2) )
 				{
 					if( srcw > 4096 || srch > 4096 )
@@ -989,7 +1284,8 @@ callback(void *args, int argc, char **argv, char **azColName)
 					                   mime, "DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1", lan_addr[passed_args->iface].str,
 					                   runtime_vars.port, detailID);
 				}
-				else
+				/* not before its metadata has been read */
+				else if( srcw && srch )
 					add_resized_res(srcw, srch, 160, 160, "JPEG_TN", detailID, passed_args);
 			}
 			else if( *mime == 'v' ) {
@@ -1125,10 +1421,13 @@ callback(void *args, int argc, char **argv, char **azColName)
 			ret = strcatf(str, "searchable=\"%d\" ", check_magic_container(id, passed_args->flags) ? 0 : 1);
 		}
 		if( passed_args->filter & FILTER_CHILDCOUNT ) {
+			struct magic_container_s *magic = check_magic_container(id, passed_args->flags);
 			if (strcmp(id, PASSWORD_CONTAINER) == 0) {
 				ret = strcatf(str, "childCount=\"%d\"", 10);
+			} else if (!magic && !passed_args->password && !scanning && child_count) {
+				ret = strcatf(str, "childCount=\"%s\"", child_count);
 			} else {
-				ret = strcatf(str, "childCount=\"%d\"", get_child_count(id, check_magic_container(id, passed_args->flags), passed_args->password));
+				ret = strcatf(str, "childCount=\"%d\"", get_child_count(db, id, magic, passed_args->password));
 			}
 		}
 		/* If the client calls for BrowseMetadata on root, we have to include our "upnp:searchClass"'s, unless they're filtered out */
@@ -1304,8 +1603,263 @@ static void createPasswordContainer(struct Response *passed_args, const char *id
 	}
 }
 
+/* Keyset pagination.  Clients page through big containers by raising
+ * StartingIndex, and "limit offset, count" makes SQLite walk past every
+ * row before the page each time.  So we remember the sort key of the last
+ * row of each page, and when the next page is asked for, seek past that
+ * key instead.  Random jumps still use the offset. */
+#define BROWSE_CURSORS 16
+#define CURSOR_KEYS 8
+
+struct browse_cursor {
+	char *key;		/* conditions, sort order and passwords */
+	int next;		/* the StartingIndex that continues from here */
+	unsigned int used;
+	struct soap_cache_stamp stamp;
+	char *values[CURSOR_KEYS];
+};
+
+struct cursor_query {
+	struct Response *args;
+	int nkeys;
+	const char *expr[CURSOR_KEYS];
+	int desc[CURSOR_KEYS];
+	char terms[512];
+	char *key;
+	int start;
+	struct soap_cache_stamp stamp;
+	char *columns;
+	char *seek;
+	int rows;
+	int failed;
+	char *values[CURSOR_KEYS];
+};
+
+static struct browse_cursor cursors[BROWSE_CURSORS];
+static unsigned int cursor_clock;
+static pthread_mutex_t cursor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Split "order by a, b DESC, ..." into its terms */
+static int
+cursor_parse_order(struct cursor_query *q, const char *orderBy)
+{
+	char *item, *saveptr = NULL, *p;
+	size_t len;
+
+	if (strncasecmp(orderBy, "order by ", 9) != 0 ||
+	    strlen(orderBy + 9) >= sizeof(q->terms))
+		return -1;
+	strcpy(q->terms, orderBy + 9);
+	for (item = strtok_r(q->terms, ",", &saveptr); item;
+	     item = strtok_r(NULL, ",", &saveptr))
+	{
+		if (q->nkeys == CURSOR_KEYS)
+			return -1;
+		while (isspace(*item))
+			item++;
+		len = strlen(item);
+		while (len && isspace(item[len-1]))
+			item[--len] = '\0';
+		q->desc[q->nkeys] = 0;
+		if (len > 5 && strcasecmp(item + len - 5, " DESC") == 0)
+		{
+			q->desc[q->nkeys] = 1;
+			item[len-5] = '\0';
+		}
+		else if (len > 4 && strcasecmp(item + len - 4, " ASC") == 0)
+			item[len-4] = '\0';
+		/* only plain columns can be compared with a saved value */
+		for (p = item; *p; p++)
+			if (!isalnum(*p) && *p != '_' && *p != '.')
+				return -1;
+		if (p == item)
+			return -1;
+		q->expr[q->nkeys++] = item;
+	}
+
+	return q->nkeys ? 0 : -1;
+}
+
+/* Rows strictly after the saved key, in the sort order.  NULLs sort
+ * first, so they need spelling out; otherwise a row value comparison
+ * lets SQLite seek in an index. */
+static char *
+cursor_condition(const struct cursor_query *q, char *const *values)
+{
+	char *cond = NULL;
+	int i, simple = (sqlite3_libversion_number() >= 3015000);
+
+	for (i = 0; i < q->nkeys; i++)
+		if (q->desc[i] || !values[i])
+			simple = 0;
+	if (simple)
+	{
+		for (i = 0; i < q->nkeys; i++)
+			cond = sqlite3_mprintf("%z%s%s", cond, i ? ", " : "(", q->expr[i]);
+		for (i = 0; i < q->nkeys; i++)
+			cond = sqlite3_mprintf("%z%s%Q", cond, i ? ", " : ") > (", values[i]);
+		return sqlite3_mprintf("and %z)", cond);
+	}
+
+	for (i = q->nkeys - 1; i >= 0; i--)
+	{
+		const char *k = q->expr[i];
+		char *after;
+
+		if (!q->desc[i])
+			after = values[i] ? sqlite3_mprintf("%s > %Q", k, values[i]) :
+			                    sqlite3_mprintf("%s is not null", k);
+		else
+			after = values[i] ? sqlite3_mprintf("(%s < %Q or %s is null)", k, values[i], k) :
+			                    sqlite3_mprintf("0");
+		if (cond)
+			cond = sqlite3_mprintf("%z or (%s is %Q and (%z))", after, k, values[i], cond);
+		else
+			cond = after;
+	}
+
+	return sqlite3_mprintf("and (%z)", cond);
+}
+
+/* Get ready to page through the rows matching where, making the order
+ * total first so that a cursor always picks up where the offset would.
+ * Returns 0 if the query can use cursors. */
+static int
+cursor_start(struct cursor_query *q, struct Response *args, const char *where,
+             char **orderBy, int start)
+{
+	struct string_s key;
+	char keybuf[1024], *order;
+	int i, best = 0;
+
+	memset(q, 0, sizeof(*q));
+	if (*orderBy)
+	{
+		if (xasprintf(&order, "%s, o.OBJECT_ID", *orderBy) < 0)
+			return -1;
+		free(*orderBy);
+		*orderBy = order;
+	}
+	/* the order SQLite would give us from IDX_SCANNER_OPT anyway */
+	else if (xasprintf(orderBy, "order by o.NAME, o.OBJECT_ID") < 0)
+	{
+		*orderBy = NULL;
+		return -1;
+	}
+	if (cursor_parse_order(q, *orderBy) != 0)
+		return -1;
+
+	INIT_STR(key, keybuf);
+	soap_cache_key_add(&key, where);
+	soap_cache_key_add(&key, *orderBy);
+	soap_cache_key_add(&key, args->password);
+	if (key.off >= key.size - 1)
+		return -1;
+	q->key = strdup(keybuf);
+	if (!q->key)
+		return -1;
+
+	for (i = 0; i < q->nkeys; i++)
+		q->columns = sqlite3_mprintf("%z, %s", q->columns, q->expr[i]);
+	q->columns = sqlite3_mprintf("%z ", q->columns);
+	q->args = args;
+	q->start = start;
+
+	pthread_mutex_lock(&cursor_lock);
+	q->stamp = soap_cache_now();
+	for (i = 0; start && i < BROWSE_CURSORS; i++)
+	{
+		struct browse_cursor *c = &cursors[i];
+
+		if (c->key && c->next == start && strcmp(c->key, q->key) == 0 &&
+		    c->stamp.update_id == q->stamp.update_id &&
+		    c->stamp.changes == q->stamp.changes)
+		{
+			c->used = ++cursor_clock;
+			q->seek = cursor_condition(q, c->values);
+			best = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cursor_lock);
+	if (best)
+		DPRINTF(E_DEBUG, L_HTTP, "Continuing cursor at %d: %s\n", start, q->seek);
+
+	return 0;
+}
+
+static int
+cursor_callback(void *ptr, int argc, char **argv, char **azColName)
+{
+	struct cursor_query *q = ptr;
+	int i;
+
+	for (i = 0; i < q->nkeys; i++)
+	{
+		const char *val = argv[argc - q->nkeys + i];
+
+		free(q->values[i]);
+		q->values[i] = val ? strdup(val) : NULL;
+		if (val && !q->values[i])
+			q->failed = 1;
+	}
+	q->rows++;
+
+	return callback(q->args, argc, argv, azColName);
+}
+
+/* Save the end of a full page as the cursor for the next one */
+static void
+cursor_end(struct cursor_query *q, int ret, int requested)
+{
+	struct soap_cache_stamp now;
+	struct browse_cursor *c = NULL;
+	int i;
+
+	if (!q->args)
+		return;
+	pthread_mutex_lock(&cursor_lock);
+	now = soap_cache_now();
+	if (ret == SQLITE_OK && !q->failed && q->rows == requested &&
+	    now.update_id == q->stamp.update_id && now.changes == q->stamp.changes)
+	{
+		/* carry on with the cursor we came from, or reuse the oldest */
+		for (i = 0; i < BROWSE_CURSORS; i++)
+		{
+			if (cursors[i].key && cursors[i].next == q->start &&
+			    strcmp(cursors[i].key, q->key) == 0)
+			{
+				c = &cursors[i];
+				break;
+			}
+			if (!c || cursors[i].used < c->used)
+				c = &cursors[i];
+		}
+		free(c->key);
+		c->key = q->key;
+		q->key = NULL;
+		c->next = q->start + q->rows;
+		c->used = ++cursor_clock;
+		c->stamp = q->stamp;
+		for (i = 0; i < CURSOR_KEYS; i++)
+		{
+			free(c->values[i]);
+			c->values[i] = q->values[i];
+			q->values[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&cursor_lock);
+
+	for (i = 0; i < CURSOR_KEYS; i++)
+		free(q->values[i]);
+	free(q->key);
+	sqlite3_free(q->columns);
+	sqlite3_free(q->seek);
+	q->args = NULL;
+}
+
 static void
-BrowseContentDirectory(struct upnphttp * h, const char * action)
+BrowseContentDirectory(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp0[] =
 			"<u:BrowseResponse "
@@ -1332,9 +1886,16 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	int StartingIndex = 0;
 	int isPasswd = 0;
 	int AddedPasswordContainer=0;
+	struct string_s key;
+	char keybuf[1024];
+	struct soap_cache_stamp stamp;
+	int cache = 0;
+	struct cursor_query cursor;
+	int plain = 0;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
+	memset(&cursor, 0, sizeof(cursor));
 
 	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
 
@@ -1384,11 +1945,15 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 
 	args.returned = 0;
 	args.requested = RequestedCount;
-	args.client = h->req_client ? h->req_client->type->type : 0;
-	args.flags = h->req_client ? h->req_client->type->flags : 0;
+	args.client = h->req_ctype;
+	args.flags = h->req_cflags;
 	args.str = &str;
-	
-	args.password = h->req_client ? h->req_client->password : NULL;
+	args.db = db;
+	args.password = get_client_password(h);
+	/* results too large to buffer are streamed to HTTP/1.1 clients,
+	 * but only from a worker, since a slow client blocks the sender */
+	if( h->state == 5 && strcmp(h->HttpVer, "HTTP/1.1") == 0 )
+		args.h = h;
 
 	DPRINTF(E_DEBUG, L_HTTP, "Browsing ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
@@ -1402,6 +1967,19 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 
 	isPasswd = check_password_container(ObjectID);
 
+	/* Password containers change what the client may see, and the
+	 * recently added lists age, so neither is cached. */
+	if( runtime_vars.browse_cache_size > 0 && !scanning && !isPasswd &&
+	    (strcmp(BrowseFlag+6, "Metadata") == 0 ||
+	     !(magic = check_magic_container(ObjectID, args.flags)) || !magic->where) )
+	{
+		INIT_STR(key, keybuf);
+		cache = soap_cache_key(&key, action, &args, StartingIndex, RequestedCount,
+		                       ObjectID, BrowseFlag, SortCriteria);
+		if( cache && soap_cache_get(h, &key, &stamp) )
+			goto browse_error;
+	}
+
 	if( strcmp(BrowseFlag+6, "Metadata") == 0 )
 	{
 		const char *id = ObjectID;
@@ -1435,10 +2013,11 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			DPRINTF(E_INFO, L_HTTP, "Is Password %s", ObjectID);
 			createPasswordContainer(&args, ObjectID, 0);
 			totalMatches = args.returned;
-		        if (h->req_client && args.password) {
-				DPRINTF(E_INFO, L_HTTP, "Passwords %s", args.password);
-				h->req_client->password = args.password;
-
+			if (h->req_client) {
+				if (args.password)
+					DPRINTF(E_INFO, L_HTTP, "Passwords %s", args.password);
+				set_client_password(h, args.password);
+				args.password = NULL;
 			}
 	    } else {
 			magic = check_magic_container(ObjectID, args.flags);
@@ -1459,12 +2038,13 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 				if (magic->max_count > 0)
 				{
 					int limit = MAX(magic->max_count - StartingIndex, 0);
-					ret = get_child_count(ObjectID, magic, args.password);
+					ret = get_child_count(db, ObjectID, magic, args.password);
 					totalMatches = MIN(ret, limit);
 					if (RequestedCount > limit || RequestedCount < 0)
 						RequestedCount = limit;
 				}
 			}
+			plain = !where[0];
 			if (!where[0]) {
 				if (strcmp(ObjectID, "0") == 0 || strcmp(ObjectID, MUSIC_ID) == 0 || strcmp(ObjectID, BROWSEDIR_ID) == 0 ||
 				    strcmp(ObjectID, VIDEO_ID) == 0 || strcmp(ObjectID, IMAGE_ID) == 0) {
@@ -1476,7 +2056,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			}
 
 			if (!totalMatches) {
-				totalMatches = get_child_count(ObjectID, magic, args.password) + AddedPasswordContainer;
+				totalMatches = get_child_count(db, ObjectID, magic, args.password) + AddedPasswordContainer;
 			}
 
 			ret = 0;
@@ -1518,13 +2098,22 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 				goto browse_error;
 			}
 
-			sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
+			/* pages of ordinary containers can continue from a cursor */
+			if (plain && RequestedCount > 0)
+				cursor_start(&cursor, &args, where, &orderBy, StartingIndex);
+
+			sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS "%s"
 		              "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where (%s and (o.password is null or o.password = '' or o.password in (%s)) %s)  limit %d, %d;",
-				      objectid_sql, parentid_sql, refid_sql,
-				      where, args.password ? args.password : "''", THISORNUL(orderBy), StartingIndex, RequestedCount);
+				      " where (%s and (o.password is null or o.password = '' or o.password in (%s))) %s %s limit %d, %d;",
+				      objectid_sql, parentid_sql, refid_sql, THISORNUL(cursor.columns),
+				      where, args.password ? args.password : "''", THISORNUL(cursor.seek), THISORNUL(orderBy),
+				      cursor.seek ? 0 : StartingIndex, RequestedCount);
 			DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
-			ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+			if (cursor.args)
+				ret = sqlite3_exec(db, sql, cursor_callback, (void *) &cursor, &zErrMsg);
+			else
+				ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+			cursor_end(&cursor, ret, RequestedCount);
 		}
 	}
 	if (!isPasswd) {
@@ -1532,14 +2121,18 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 		{
 			DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
 			sqlite3_free(zErrMsg);
-			SoapError(h, 709, "Unsupported or invalid sort criteria");
+			/* too late for a SOAP error once streaming has started */
+			if( args.streaming )
+				h->reqflags &= ~FLAG_KEEPALIVE;
+			else
+				SoapError(h, 709, "Unsupported or invalid sort criteria");
 			goto browse_error;
 		}
 		sqlite3_free(sql);
 		/* Does the object even exist? */
 		if( !totalMatches )
 		{
-			if( !object_exists(ObjectID) )
+			if( !object_exists(db, ObjectID) )
 			{
 				SoapError(h, 701, "No such object error");
 				goto browse_error;
@@ -1552,9 +2145,12 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:BrowseResponse>",
 	                    args.returned, totalMatches, updateID);
-	BuildSendAndCloseSoapResp(h, str.data, str.off);
+	if( cache && !args.streaming )
+		soap_cache_put(&key, &stamp, str.data, str.off);
+	EndSoapResp(h, &args);
 browse_error:
 	ClearNameValueList(&data);
+	free(args.password);
 	free(orderBy);
 	free(str.data);
 }
@@ -1571,11 +2167,146 @@ charcat(struct string_s *str, char c)
 	str->off += 1;
 }
 
+/* Turn "<column> contains <literal>" into a lookup in the full-text index
+ * when the column is indexed and the literal is long enough to make up a
+ * trigram.  s points just past the operator.  Returns how much of s was
+ * consumed, or 0 to fall back to LIKE. */
+static int
+search_fts(struct string_s *criteria, const char *s, int negate)
+{
+	static const char *const columns[] = { "TITLE", "ARTIST", "ALBUM", "CREATOR", NULL };
+	const char *start = s, *col = NULL;
+	struct string_s lit;
+	char *match, *clause, *p;
+	size_t end, len;
+	int i, chars = 0;
+
+	if (!GETFLAG(SEARCH_INDEX_MASK) || scanning)
+		return 0;
+
+	end = criteria->off;
+	while (end && criteria->data[end-1] == ' ')
+		end--;
+	for (i = 0; columns[i]; i++)
+	{
+		len = strlen(columns[i]) + 2;
+		if (end >= len &&
+		    strncmp(criteria->data + end - len, "d.", 2) == 0 &&
+		    strncmp(criteria->data + end - len + 2, columns[i], len - 2) == 0 &&
+		    (end == len || criteria->data[end-len-1] == ' ' || criteria->data[end-len-1] == '('))
+		{
+			col = columns[i];
+			end -= len;
+			break;
+		}
+	}
+	if (!col)
+		return 0;
+
+	while (isspace(*s))
+		s++;
+	if (*s == '"')
+		s++;
+	else if (strncmp(s, "&quot;", 6) == 0)
+		s += 6;
+	else
+		return 0;
+
+	/* unescape the literal the same way the LIKE translation does */
+	lit.size = strlen(s) * 2 + 1;
+	lit.data = malloc(lit.size);
+	lit.off = 0;
+	if (!lit.data)
+		return 0;
+	for (;;)
+	{
+		if (!*s)
+		{
+			free(lit.data);
+			return 0;
+		}
+		if (*s == '"')
+		{
+			s++;
+			break;
+		}
+		if (strncmp(s, "&quot;", 6) == 0)
+		{
+			s += 6;
+			break;
+		}
+		if (strncmp(s, "\\&quot;", 7) == 0)
+		{
+			strcatf(&lit, "&amp;quot;");
+			s += 7;
+		}
+		else if (strncmp(s, "&apos;", 6) == 0)
+		{
+			strcatf(&lit, "'");
+			s += 6;
+		}
+		else
+			lit.data[lit.off++] = *s++;
+	}
+	lit.data[lit.off] = '\0';
+	for (p = lit.data; *p; p++)
+		if ((*p & 0xC0) != 0x80)
+			chars++;
+	if (chars < 3)
+	{
+		free(lit.data);
+		return 0;
+	}
+
+	/* an FTS5 string, with its double quotes doubled */
+	match = malloc(strlen(col) + lit.off * 2 + 8);
+	if (!match)
+	{
+		free(lit.data);
+		return 0;
+	}
+	p = match + sprintf(match, "%s : \"", col);
+	for (i = 0; i < lit.off; i++)
+	{
+		if (lit.data[i] == '"')
+			*p++ = '"';
+		*p++ = lit.data[i];
+	}
+	strcpy(p, "\"");
+	free(lit.data);
+
+	/* "not like" never matches a NULL column, so neither may this */
+	if (negate)
+		clause = sqlite3_mprintf("(d.%s is not NULL and o.DETAIL_ID not in"
+		                         " (SELECT rowid from DETAILS_FTS where DETAILS_FTS match %Q))",
+		                         col, match);
+	else
+		clause = sqlite3_mprintf("o.DETAIL_ID in (SELECT rowid from DETAILS_FTS"
+		                         " where DETAILS_FTS match %Q)", match);
+	free(match);
+	if (!clause)
+		return 0;
+	len = strlen(clause);
+	p = realloc(criteria->data, criteria->size + len);
+	if (!p)
+	{
+		sqlite3_free(clause);
+		return 0;
+	}
+	criteria->data = p;
+	criteria->size += len;
+	criteria->off = end;
+	strcatf(criteria, "%s", clause);
+	sqlite3_free(clause);
+
+	return s - start;
+}
+
 static inline char *
 parse_search_criteria(const char *str, char *sep)
 {
 	struct string_s criteria;
-	int len;
+	int len, n;
 	int literal = 0, like = 0;
 	const char *s;
 
@@ -1717,6 +2448,11 @@ parse_search_criteria(const char *str, char *sep)
 			case 'c':
 				if (strncmp(s, "contains", 8) == 0)
 				{
+					if ((n = search_fts(&criteria, s + 8, 0)) > 0)
+					{
+						s += 8 + n;
+						continue;
+					}
 					strcatf(&criteria, "like");
 					s += 8;
 					like = 2;
@@ -1733,6 +2469,18 @@ parse_search_criteria(const char *str, char *sep)
 					like = 1;
 					continue;
 				}
+				else if (strncmp(s, "doesNotContain", 14) == 0)
+				{
+					if ((n = search_fts(&criteria, s + 14, 1)) > 0)
+					{
+						s += 14 + n;
+						continue;
+					}
+					strcatf(&criteria, "not like");
+					s += 14;
+					like = 2;
+					continue;
+				}
 				else if (strncmp(s, "dc:date", 7) == 0)
 				{
 					strcatf(&criteria, "d.DATE");
@@ -1831,7 +2579,7 @@ parse_search_criteria(const char *str, char *sep)
 }
 
 static void
-SearchContentDirectory(struct upnphttp * h, const char * action)
+SearchContentDirectory(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp0[] =
 			"<u:SearchResponse "
@@ -1848,11 +2596,15 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	int ret;
 	const char *ContainerID;
 	char *Filter, *SearchCriteria, *SortCriteria;
-	char *orderBy = NULL, *where = NULL, sep[] = "$*";
+	char *orderBy = NULL, *where = NULL, *subtree = NULL, sep[] = "$*";
 	char groupBy[] = "group by DETAIL_ID";
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
+	struct string_s key;
+	char keybuf[1024];
+	struct soap_cache_stamp stamp;
+	int cache = 0;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
@@ -1893,10 +2645,13 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 
 	args.returned = 0;
 	args.requested = RequestedCount;
-	args.client = h->req_client ? h->req_client->type->type : 0;
-	args.flags = h->req_client ? h->req_client->type->flags : 0;
-	args.password = h->req_client ? h->req_client->password : NULL;
+	args.client = h->req_ctype;
+	args.flags = h->req_cflags;
+	args.password = get_client_password(h);
 	args.str = &str;
+	args.db = db;
+	if( h->state == 5 && strcmp(h->HttpVer, "HTTP/1.1") == 0 )
+		args.h = h;
 	DPRINTF(E_DEBUG, L_HTTP, "Searching ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
 	                         " * Count: %d\n"
@@ -1907,6 +2662,15 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 				ContainerID, RequestedCount, StartingIndex,
 	                        SearchCriteria, Filter, SortCriteria);
 
+	if( runtime_vars.browse_cache_size > 0 && !scanning )
+	{
+		INIT_STR(key, keybuf);
+		cache = soap_cache_key(&key, action, &args, StartingIndex, RequestedCount,
+		                       ContainerID, SearchCriteria, SortCriteria);
+		if( cache && soap_cache_get(h, &key, &stamp) )
+			goto search_error;
+	}
+
 	magic = check_magic_container(ContainerID, args.flags);
 	if (magic && magic->objectid && *(magic->objectid))
 		ContainerID = *(magic->objectid);
@@ -1920,14 +2684,18 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 
 	where = parse_search_criteria(SearchCriteria, sep);
 	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", where);
+	if( strcmp(sep, "$*") == 0 && *ContainerID != '*' )
+		subtree = sqlite3_mprintf(SUBTREE_SQL, ContainerID, ContainerID);
+	else
+		subtree = sqlite3_mprintf("OBJECT_ID glob '%q%s'", ContainerID, sep);
 
 	totalMatches = sql_get_int_field(db, "SELECT (select count(distinct DETAIL_ID)"
 	                                     " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID glob '%q%s') and (%s) and (o.password is null or o.password = '' or o.password in (%s)))"
+	                                     " where (%s) and (%s) and (o.password is null or o.password = '' or o.password in (%s)))"
 	                                     " + "
 	                                     "(select count(*) from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
 	                                     " where (OBJECT_ID = '%q') and (%s) and (o.password is null or o.password = '' or o.password in (%s)))",
-	                                     ContainerID, sep, where, args.password ? args.password : "''", ContainerID, where, args.password ? args.password : "''");
+	                                     subtree, where, args.password ? args.password : "''", ContainerID, where, args.password ? args.password : "''");
 	if( totalMatches < 0 )
 	{
 		/* Must be invalid SQL, so most likely bad or unhandled search criteria. */
@@ -1937,7 +2705,7 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	/* Does the object even exist? */
 	if( !totalMatches )
 	{
-		if( !object_exists(ContainerID) )
+		if( !object_exists(db, ContainerID) )
 		{
 			SoapError(h, 710, "No such container");
 			goto search_error;
@@ -1955,10 +2723,10 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 
 	sql = sqlite3_mprintf( SELECT_COLUMNS
 	                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                      " where OBJECT_ID glob '%q%s' and (%s) and (o.password is null or o.password = '' or o.password in (%s)) %s "
+	                      " where (%s) and (%s) and (o.password is null or o.password = '' or o.password in (%s)) %s "
 	                      "%z %s"
 	                      " limit %d, %d",
-	                      ContainerID, sep, where, args.password ? args.password : "''", groupBy,
+	                      subtree, where, args.password ? args.password : "''", groupBy,
 	                      (*ContainerID == '*') ? NULL :
 	                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS
 	                                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
@@ -1970,6 +2738,7 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	{
 		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
 		sqlite3_free(zErrMsg);
+		cache = 0;
 	}
 	sqlite3_free(sql);
 	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
@@ -1978,11 +2747,15 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:SearchResponse>",
 	                    args.returned, totalMatches, updateID);
-	BuildSendAndCloseSoapResp(h, str.data, str.off);
+	if( cache && !args.streaming )
+		soap_cache_put(&key, &stamp, str.data, str.off);
+	EndSoapResp(h, &args);
 search_error:
 	ClearNameValueList(&data);
+	free(args.password);
 	free(orderBy);
 	free(where);
+	sqlite3_free(subtree);
 	free(str.data);
 }
 
@@ -1995,7 +2768,7 @@ QueryStateVariable remains useful as a limited test tool but may not be
 part of some future versions of UPnP.
 */
 static void
-QueryStateVariable(struct upnphttp * h, const char * action)
+QueryStateVariable(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp[] =
         "<u:%sResponse "
@@ -2024,7 +2797,7 @@ QueryStateVariable(struct upnphttp * h, const char * action)
 		bodylen = snprintf(body, sizeof(body), resp,
                            action, "urn:schemas-upnp-org:control-1-0",
 		                   "Connected", action);
-		BuildSendAndCloseSoapResp(h, body, bodylen);
+		BuildSoapResp(h, body, bodylen);
 	}
 	else
 	{
@@ -2036,7 +2809,7 @@ QueryStateVariable(struct upnphttp * h, const char * action)
 }
 
 static void
-SamsungGetFeatureList(struct upnphttp * h, const char * action)
+SamsungGetFeatureList(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp[] =
 		"<u:X_GetFeatureListResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
@@ -2075,11 +2848,11 @@ SamsungGetFeatureList(struct upnphttp * h, const char * action)
 
 	len = snprintf(body, sizeof(body), resp, audio, video, image);
 
-	BuildSendAndCloseSoapResp(h, body, len);
+	BuildSoapResp(h, body, len);
 }
 
 static void
-SamsungSetBookmark(struct upnphttp * h, const char * action)
+SamsungSetBookmark(struct upnphttp * h, const char * action, sqlite3 *db)
 {
 	static const char resp[] =
 	    "<u:X_SetBookmarkResponse"
@@ -2107,7 +2880,7 @@ SamsungSetBookmark(struct upnphttp * h, const char * action)
 		                   "((select DETAIL_ID from OBJECTS where OBJECT_ID = '%q'), %q)", rid, PosSecond);
 		if( ret != SQLITE_OK )
 			DPRINTF(E_WARN, L_METADATA, "Error setting bookmark %s on ObjectID='%s'\n", PosSecond, rid);
-		BuildSendAndCloseSoapResp(h, resp, sizeof(resp)-1);
+		BuildSoapResp(h, resp, sizeof(resp)-1);
 	}
 	else
 		SoapError(h, 402, "Invalid Args");
@@ -2115,30 +2888,333 @@ SamsungSetBookmark(struct upnphttp * h, const char * action)
 	ClearNameValueList(&data);	
 }
 
-static const struct 
+static const struct soapMethod
 {
 	const char * methodName; 
-	void (*methodImpl)(struct upnphttp *, const char *);
+	void (*methodImpl)(struct upnphttp *, const char *, sqlite3 *);
+	int threaded;	/* read-only, may run on a worker */
 }
 soapMethods[] =
 {
-	{ "QueryStateVariable", QueryStateVariable},
-	{ "Browse", BrowseContentDirectory},
-	{ "Search", SearchContentDirectory},
-	{ "GetSearchCapabilities", GetSearchCapabilities},
-	{ "GetSortCapabilities", GetSortCapabilities},
-	{ "GetSystemUpdateID", GetSystemUpdateID},
-	{ "GetProtocolInfo", GetProtocolInfo},
-	{ "GetCurrentConnectionIDs", GetCurrentConnectionIDs},
-	{ "GetCurrentConnectionInfo", GetCurrentConnectionInfo},
-	{ "IsAuthorized", IsAuthorizedValidated},
-	{ "IsValidated", IsAuthorizedValidated},
-	{ "RegisterDevice", RegisterDevice},
-	{ "X_GetFeatureList", SamsungGetFeatureList},
-	{ "X_SetBookmark", SamsungSetBookmark},
-	{ 0, 0 }
+	{ "QueryStateVariable", QueryStateVariable, 0},
+	{ "Browse", BrowseContentDirectory, 1},
+	{ "Search", SearchContentDirectory, 1},
+	{ "GetSearchCapabilities", GetSearchCapabilities, 0},
+	{ "GetSortCapabilities", GetSortCapabilities, 0},
+	{ "GetSystemUpdateID", GetSystemUpdateID, 0},
+	{ "GetProtocolInfo", GetProtocolInfo, 0},
+	{ "GetCurrentConnectionIDs", GetCurrentConnectionIDs, 0},
+	{ "GetCurrentConnectionInfo", GetCurrentConnectionInfo, 0},
+	{ "IsAuthorized", IsAuthorizedValidated, 0},
+	{ "IsValidated", IsAuthorizedValidated, 0},
+	{ "RegisterDevice", RegisterDevice, 0},
+	{ "X_GetFeatureList", SamsungGetFeatureList, 0},
+	{ "X_SetBookmark", SamsungSetBookmark, 0},
+	{ 0, 0, 0 }
+};
+
+/* Worker pool.  Each worker has its own read-only connection; finished
+ * jobs are handed back to the event loop through a pipe, and the
+ * connection stays in state 5 until then. */
+struct soap_job {
+	struct upnphttp *h;
+	const struct soapMethod *method;
+	/* or other work, finished by done() on the main thread */
+	void (*work)(void *);
+	void (*done)(struct upnphttp *, void *);
+	void *arg;
+	TAILQ_ENTRY(soap_job) entries;
 };
 
+TAILQ_HEAD(soap_jobs, soap_job);
+
+struct soap_worker {
+	pthread_t thread;
+	sqlite3 *db;
+};
+
+static struct soap_worker *workers;
+static int n_workers = 0;
+static int stopping = 0;
+static int suspended = 0;
+static int n_parked = 0;
+static struct soap_jobs pending = TAILQ_HEAD_INITIALIZER(pending);
+static struct soap_jobs done = TAILQ_HEAD_INITIALIZER(done);
+static pthread_mutex_t soap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t soap_cond = PTHREAD_COND_INITIALIZER;
+static int soap_pipe[2] = { -1, -1 };
+static struct event soap_ev;
+
+static void *
+soap_worker(void *arg)
+{
+	struct soap_worker *w = arg;
+	struct soap_job *job;
+
+	db = w->db;
+	pthread_mutex_lock(&soap_lock);
+	for (;;)
+	{
+		while (!stopping && !suspended && TAILQ_EMPTY(&pending))
+			pthread_cond_wait(&soap_cond, &soap_lock);
+		if (stopping)
+			break;
+		if (suspended)
+		{
+			/* wait here while the database is swapped */
+			n_parked++;
+			pthread_cond_broadcast(&soap_cond);
+			while (suspended && !stopping)
+				pthread_cond_wait(&soap_cond, &soap_lock);
+			n_parked--;
+			db = w->db;
+			continue;
+		}
+		job = TAILQ_FIRST(&pending);
+		TAILQ_REMOVE(&pending, job, entries);
+		pthread_mutex_unlock(&soap_lock);
+
+		if (job->work)
+			job->work(job->arg);
+		else
+			job->method->methodImpl(job->h, job->method->methodName, w->db);
+
+		pthread_mutex_lock(&soap_lock);
+		/* one wakeup is enough until the event loop empties the list */
+		if (TAILQ_EMPTY(&done) && write(soap_pipe[1], "", 1) < 0 && errno != EAGAIN)
+			DPRINTF(E_ERROR, L_HTTP, "write(soap_pipe): %s\n", strerror(errno));
+		TAILQ_INSERT_TAIL(&done, job, entries);
+	}
+	pthread_mutex_unlock(&soap_lock);
+
+	return NULL;
+}
+
+static void
+soap_process_done(struct event *ev)
+{
+	struct soap_jobs jobs = TAILQ_HEAD_INITIALIZER(jobs);
+	struct soap_job *job;
+	struct upnphttp *h;
+	char buf[64];
+
+	/* drain the pipe before taking the list, so no wakeup is lost */
+	while (read(ev->fd, buf, sizeof(buf)) > 0)
+		continue;
+
+	pthread_mutex_lock(&soap_lock);
+	TAILQ_CONCAT(&jobs, &done, entries);
+	pthread_mutex_unlock(&soap_lock);
+
+	while ((job = TAILQ_FIRST(&jobs)) != NULL)
+	{
+		TAILQ_REMOVE(&jobs, job, entries);
+		h = job->h;
+		if (job->done)
+		{
+			job->done(h, job->arg);
+			free(job);
+			h->ev.process(&h->ev);
+			continue;
+		}
+		free(job);
+		if (h->res_setpassword)
+		{
+			/* unless the slot went to another client */
+			if (h->req_client && h->req_client->addr.s_addr == h->clientaddr.s_addr)
+			{
+				SetClientPassword(h->req_client, h->res_password);
+				h->res_password = NULL;
+			}
+			h->res_setpassword = 0;
+		}
+		SendResp_upnphttp(h);
+		Finish_upnphttp(h);
+		/* pick up anything the client sent in the meantime */
+		h->ev.process(&h->ev);
+	}
+}
+
+static int
+queue_soap_job(struct upnphttp *h, const struct soapMethod *method)
+{
+	struct soap_job *job;
+
+	if (!n_workers)
+		return -1;
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -1;
+	job->h = h;
+	job->method = method;
+	h->state = 5;
+	h->req_password = h->req_client ? GetClientPassword(h->req_client) : NULL;
+
+	pthread_mutex_lock(&soap_lock);
+	TAILQ_INSERT_TAIL(&pending, job, entries);
+	pthread_cond_signal(&soap_cond);
+	pthread_mutex_unlock(&soap_lock);
+
+	return 0;
+}
+
+int
+queue_http_job(struct upnphttp *h, void (*work)(void *),
+               void (*done)(struct upnphttp *, void *), void *arg)
+{
+	struct soap_job *job;
+
+	if (!n_workers)
+		return -1;
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -1;
+	job->h = h;
+	job->work = work;
+	job->done = done;
+	job->arg = arg;
+	h->state = 5;
+
+	pthread_mutex_lock(&soap_lock);
+	TAILQ_INSERT_TAIL(&pending, job, entries);
+	pthread_cond_signal(&soap_cond);
+	pthread_mutex_unlock(&soap_lock);
+
+	return 0;
+}
+
+int
+upnpsoap_start_workers(int threads)
+{
+	char path[PATH_MAX];
+	int i, flags;
+
+	if (threads <= 0)
+		return 0;
+	if (!sqlite3_threadsafe())
+	{
+		DPRINTF(E_ERROR, L_HTTP, "SQLite library is not threadsafe!  "
+		                         "SOAP actions will run on the main thread.\n");
+		return 0;
+	}
+	if (pipe(soap_pipe) < 0)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "pipe(): %s\n", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < 2; i++)
+	{
+		flags = fcntl(soap_pipe[i], F_GETFL);
+		fcntl(soap_pipe[i], F_SETFL, flags | O_NONBLOCK);
+	}
+	soap_ev = (struct event){ .fd = soap_pipe[0], .rdwr = EVENT_READ,
+	                          .process = soap_process_done };
+	if (event_module.add(&soap_ev) != 0)
+		goto error;
+
+	workers = calloc(threads, sizeof(struct soap_worker));
+	if (!workers)
+		goto error;
+	snprintf(path, sizeof(path), "%s/files.db", db_path);
+	for (i = 0; i < threads; i++)
+	{
+		if ((workers[i].db = sql_open(path, 1)) == NULL)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Failed to open database for SOAP worker\n");
+			break;
+		}
+		if (pthread_create(&workers[i].thread, NULL, soap_worker, &workers[i]) != 0)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "pthread_create() failed for SOAP worker\n");
+			sql_close(workers[i].db);
+			break;
+		}
+		n_workers++;
+	}
+	DPRINTF(E_INFO, L_HTTP, "Started %d SOAP worker threads\n", n_workers);
+
+	return n_workers ? 0 : -1;
+error:
+	DPRINTF(E_ERROR, L_HTTP, "Failed to start SOAP workers\n");
+	upnpsoap_stop_workers();
+	return -1;
+}
+
+/* Jobs still queued are dropped; their connections are closed with the rest */
+void
+upnpsoap_stop_workers(void)
+{
+	struct soap_job *job;
+	int i;
+
+	pthread_mutex_lock(&soap_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&soap_cond);
+	pthread_mutex_unlock(&soap_lock);
+
+	for (i = 0; i < n_workers; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		sql_close(workers[i].db);
+	}
+	free(workers);
+	workers = NULL;
+	n_workers = 0;
+
+	TAILQ_CONCAT(&pending, &done, entries);
+	while ((job = TAILQ_FIRST(&pending)) != NULL)
+	{
+		TAILQ_REMOVE(&pending, job, entries);
+		free(job);
+	}
+	if (soap_pipe[0] >= 0)
+	{
+		event_module.del(&soap_ev);
+		close(soap_pipe[0]);
+		close(soap_pipe[1]);
+		soap_pipe[0] = soap_pipe[1] = -1;
+	}
+}
+
+void
+upnpsoap_suspend_workers(void)
+{
+	int i;
+
+	pthread_mutex_lock(&soap_lock);
+	suspended = 1;
+	pthread_cond_broadcast(&soap_cond);
+	/* actions already running finish first */
+	while (n_parked < n_workers)
+		pthread_cond_wait(&soap_cond, &soap_lock);
+	pthread_mutex_unlock(&soap_lock);
+
+	for (i = 0; i < n_workers; i++)
+	{
+		sql_close(workers[i].db);
+		workers[i].db = NULL;
+	}
+}
+
+void
+upnpsoap_resume_workers(void)
+{
+	char path[PATH_MAX];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/files.db", db_path);
+	for (i = 0; i < n_workers; i++)
+	{
+		if ((workers[i].db = sql_open(path, 1)) == NULL)
+			DPRINTF(E_FATAL, L_HTTP, "Failed to reopen database for SOAP worker\n");
+	}
+
+	pthread_mutex_lock(&soap_lock);
+	suspended = 0;
+	pthread_cond_broadcast(&soap_cond);
+	pthread_mutex_unlock(&soap_lock);
+}
+
 void
 ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
 {
@@ -2163,8 +3239,10 @@ ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
 			len = strlen(soapMethods[i].methodName);
 			if(strncmp(p, soapMethods[i].methodName, len) == 0)
 			{
-				soapMethods[i].methodImpl(h, soapMethods[i].methodName);
-				return;
+				if(soapMethods[i].threaded && queue_soap_job(h, &soapMethods[i]) == 0)
+					return;
+				soapMethods[i].methodImpl(h, soapMethods[i].methodName, db);
+				goto send;
 			}
 			i++;
 		}
@@ -2173,5 +3251,7 @@ ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
 	}
 
 	SoapError(h, 401, "Invalid Action");
+send:
+	SendResp_upnphttp(h);
+	Finish_upnphttp(h);
 }
-
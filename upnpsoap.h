@@ -21,6 +21,8 @@
 #ifndef __UPNPSOAP_H__
 #define __UPNPSOAP_H__
 
+#include <sqlite3.h>
+
 #define DEFAULT_RESP_SIZE 131072
 #define MAX_RESPONSE_SIZE 2097152
 
@@ -35,6 +37,7 @@
 
 struct Response
 {
+	sqlite3 *db;
 	struct string_s *str;
 	int start;
 	int returned;
@@ -44,6 +47,8 @@ struct Response
 	uint32_t flags;
 	enum client_types client;
 	char *password;
+	struct upnphttp *h;	/* set if the response may be streamed */
+	int streaming;		/* 1 once streaming has started, -1 if it failed */
 };
 
 /* ExecuteSoapAction():
@@ -51,5 +56,33 @@ struct Response
 void
 ExecuteSoapAction(struct upnphttp *, const char *, int);
 
+/* Start threads to run Browse and Search off the main thread.
+ * With 0 threads, every action runs inline. */
+int
+upnpsoap_start_workers(int threads);
+
+void
+upnpsoap_stop_workers(void);
+
+/* queue_http_job()
+ * run work(arg) on a worker, for a request that would hold up the main
+ * loop, then done(h, arg) back on the main thread.  h is in state 5
+ * meanwhile.  Returns -1 if there are no workers to run it. */
+int
+queue_http_job(struct upnphttp *h, void (*work)(void *),
+               void (*done)(struct upnphttp *, void *), void *arg);
+
+/* Park the workers and close their connections, so that files.db can be
+ * replaced; upnpsoap_resume_workers() opens the new one for them */
+void
+upnpsoap_suspend_workers(void);
+
+void
+upnpsoap_resume_workers(void);
+
+/* Browse/Search response cache counters, for the status page */
+void
+upnpsoap_cache_stats(unsigned long *hits, unsigned long *misses, size_t *bytes);
+
 #endif
 
@@ -29,6 +29,9 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "minidlnatypes.h"
 #include "upnpglobalvars.h"
@@ -442,19 +445,21 @@ is_album_art(const char * name)
 	return (album_art_name ? 1 : 0);
 }
 
+/* Like resolve_unknown_type(), for name in the directory open at dirfd.
+ * path is the full path of the same file, used for the symlink checks. */
 int
-resolve_unknown_type(const char * path, media_types dir_type)
+resolve_unknown_type_at(int dirfd, const char *name, const char *path, media_types dir_type)
 {
 	struct stat entry;
 	unsigned char type = TYPE_UNKNOWN;
 	char str_buf[PATH_MAX];
 	ssize_t len;
 
-	if( lstat(path, &entry) == 0 )
+	if( fstatat(dirfd, name, &entry, AT_SYMLINK_NOFOLLOW) == 0 )
 	{
 		if( S_ISLNK(entry.st_mode) )
 		{
-			if( (len = readlink(path, str_buf, PATH_MAX-1)) > 0 )
+			if( (len = readlinkat(dirfd, name, str_buf, PATH_MAX-1)) > 0 )
 			{
 				str_buf[len] = '\0';
 				//DEBUG DPRINTF(E_DEBUG, L_GENERAL, "Checking for recursive symbolic link: %s (%s)\n", path, str_buf);
@@ -464,7 +469,7 @@ resolve_unknown_type(const char * path, media_types dir_type)
 					return type;
 				}
 			}
-			stat(path, &entry);
+			fstatat(dirfd, name, &entry, 0);
 		}
 
 		if( S_ISDIR(entry.st_mode) )
@@ -503,3 +508,27 @@ resolve_unknown_type(const char * path, media_types dir_type)
 	return type;
 }
 
+int
+resolve_unknown_type(const char * path, media_types dir_type)
+{
+	return resolve_unknown_type_at(AT_FDCWD, path, path, dir_type);
+}
+
+/* Set the I/O priority of the calling thread; with IO_PRIO_IDLE it only
+ * gets the disk when nothing else wants it.  Returns the old priority,
+ * or -1 if it can't be changed. */
+int
+set_io_priority(int prio)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	int old;
+
+	old = syscall(SYS_ioprio_get, 1 /* IOPRIO_WHO_PROCESS */, 0);
+	if( syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, prio) < 0 )
+		return -1;
+	return (old < 0) ? 0 : old;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
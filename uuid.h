@@ -32,6 +32,9 @@
 #define NSEC_PER_MSEC 1000000L
 #endif
 
+unsigned long long
+monotonic_us(void);
+
 int
 get_uuid_string(char *buf);
 